@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <shared/hash.h>
 #include <shared/util.h>
 
 #include "libkmod.h"
@@ -50,6 +51,7 @@ struct kmod_elf {
 	uint64_t size;
 	bool x32;
 	bool msb;
+	bool sparse; /* only what kmod_elf_read_sparse() reads is in memory */
 	struct {
 		struct {
 			uint64_t offset;
@@ -66,7 +68,10 @@ struct kmod_elf {
 	struct {
 		uint64_t offset;
 		uint64_t size;
+		uint16_t idx;
 	} sections[KMOD_ELF_SECTION_MAX];
+	/* name -> index of every section, built on demand */
+	struct hash *section_names;
 };
 
 //#undef ENABLE_ELFDBG
@@ -271,6 +276,66 @@ fail:
 	return -EINVAL;
 }
 
+/*
+ * Perfect hash on section_name_map: the first 3 characters are enough to tell
+ * the names apart, then a single comparison confirms it.
+ */
+static enum kmod_elf_section elf_section_from_name(const char *name)
+{
+	enum kmod_elf_section sec;
+
+	switch (name[0]) {
+	case '_':
+		if (name[1] != '_')
+			return KMOD_ELF_SECTION_MAX;
+		if (name[2] == 'k')
+			sec = KMOD_ELF_SECTION_KSYMTAB;
+		else if (name[2] == 'v')
+			sec = KMOD_ELF_SECTION_VERSIONS;
+		else
+			return KMOD_ELF_SECTION_MAX;
+		break;
+	case '.':
+		if (name[1] == 'm')
+			sec = KMOD_ELF_SECTION_MODINFO;
+		else if (name[1] == 'n')
+			sec = KMOD_ELF_SECTION_BUILD_ID;
+		else if (name[1] == 's')
+			sec = name[2] == 't' ? KMOD_ELF_SECTION_STRTAB :
+					       KMOD_ELF_SECTION_SYMTAB;
+		else
+			return KMOD_ELF_SECTION_MAX;
+		break;
+	default:
+		return KMOD_ELF_SECTION_MAX;
+	}
+
+	return streq(name, section_name_map[sec]) ? sec : KMOD_ELF_SECTION_MAX;
+}
+
+/*
+ * Only look at the name of the section: most sections are not interesting and
+ * this avoids reading and validating the rest of their header.
+ */
+static const char *elf_get_section_name(const struct kmod_elf *elf, uint16_t idx)
+{
+	uint64_t nameoff;
+	uint64_t off = elf_get_section_header_offset(elf, idx);
+
+	if (off == 0)
+		return NULL;
+
+	if (elf->x32)
+		nameoff = elf_get_u32(elf, off + offsetof(Elf32_Shdr, sh_name));
+	else
+		nameoff = elf_get_u32(elf, off + offsetof(Elf64_Shdr, sh_name));
+
+	if (nameoff >= elf->header.strings.size)
+		return NULL;
+
+	return elf_get_mem(elf, elf->header.strings.offset + nameoff);
+}
+
 static void kmod_elf_save_sections(struct kmod_elf *elf)
 {
 	const uint16_t all_sec = (1 << KMOD_ELF_SECTION_MAX) - 1;
@@ -279,22 +344,24 @@ static void kmod_elf_save_sections(struct kmod_elf *elf)
 
 	for (uint16_t i = 1; i < elf->header.section.count && found_sec != all_sec; i++) {
 		uint64_t off, size;
-		const char *n;
-		int err = elf_get_section_info(elf, i, &off, &size, &n);
-		if (err < 0)
+		const char *n = elf_get_section_name(elf, i);
+		int err;
+
+		if (n == NULL)
 			continue;
 
-		for (sec = KMOD_ELF_SECTION_KSYMTAB; sec < KMOD_ELF_SECTION_MAX; sec++) {
-			if (found_sec & (1 << sec))
-				continue;
+		sec = elf_section_from_name(n);
+		if (sec == KMOD_ELF_SECTION_MAX || (found_sec & (1 << sec)))
+			continue;
 
-			if (streq(section_name_map[sec], n)) {
-				elf->sections[sec].offset = off;
-				elf->sections[sec].size = size;
-				found_sec |= 1 << sec;
-				break;
-			}
-		}
+		err = elf_get_section_info(elf, i, &off, &size, &n);
+		if (err < 0)
+			continue;
+
+		elf->sections[sec].offset = off;
+		elf->sections[sec].size = size;
+		elf->sections[sec].idx = i;
+		found_sec |= 1 << sec;
 	}
 
 	for (sec = KMOD_ELF_SECTION_KSYMTAB; sec < KMOD_ELF_SECTION_MAX; sec++) {
@@ -304,33 +371,14 @@ static void kmod_elf_save_sections(struct kmod_elf *elf)
 		ELFDBG(elf, "section %s not found\n", section_name_map[sec]);
 		elf->sections[sec].offset = 0;
 		elf->sections[sec].size = 0;
+		elf->sections[sec].idx = 0;
 	}
 }
 
-int kmod_elf_new(const void *memory, off_t size, struct kmod_elf **out_elf)
+/* Load the ELF header and check the section header table is within bounds */
+static int elf_load_header(struct kmod_elf *elf)
 {
-	struct kmod_elf *elf;
 	size_t shdrs_size, shdr_size;
-	int err;
-	const char *name;
-
-	assert_cc(sizeof(uint16_t) == sizeof(Elf32_Half));
-	assert_cc(sizeof(uint16_t) == sizeof(Elf64_Half));
-	assert_cc(sizeof(uint32_t) == sizeof(Elf32_Word));
-	assert_cc(sizeof(uint32_t) == sizeof(Elf64_Word));
-
-	elf = malloc(sizeof(struct kmod_elf));
-	if (elf == NULL)
-		return -ENOMEM;
-
-	err = elf_identify(elf, memory, size);
-	if (err < 0) {
-		free(elf);
-		return err;
-	}
-
-	elf->memory = memory;
-	elf->size = size;
 
 #define READV(field) elf_get_uint(elf, offsetof(typeof(*hdr), field), sizeof(hdr->field))
 
@@ -345,14 +393,14 @@ int kmod_elf_new(const void *memory, off_t size, struct kmod_elf **out_elf)
 
 		shdr_size = sizeof(Elf32_Shdr);
 		if (!elf_range_valid(elf, 0, sizeof(*hdr)))
-			goto invalid;
+			return -EINVAL;
 		LOAD_HEADER;
 	} else {
 		Elf64_Ehdr *hdr;
 
 		shdr_size = sizeof(Elf64_Shdr);
 		if (!elf_range_valid(elf, 0, sizeof(*hdr)))
-			goto invalid;
+			return -EINVAL;
 		LOAD_HEADER;
 	}
 #undef LOAD_HEADER
@@ -367,10 +415,42 @@ int kmod_elf_new(const void *memory, off_t size, struct kmod_elf **out_elf)
 	if (elf->header.section.entry_size != shdr_size) {
 		ELFDBG(elf, "unexpected section entry size: %" PRIu16 ", expected %zu\n",
 		       elf->header.section.entry_size, shdr_size);
-		goto invalid;
+		return -EINVAL;
 	}
 	shdrs_size = shdr_size * elf->header.section.count;
 	if (!elf_range_valid(elf, elf->header.section.offset, shdrs_size))
+		return -EINVAL;
+
+	return 0;
+}
+
+int kmod_elf_new(const void *memory, off_t size, bool sparse, struct kmod_elf **out_elf)
+{
+	struct kmod_elf *elf;
+	int err;
+	const char *name;
+
+	assert_cc(sizeof(uint16_t) == sizeof(Elf32_Half));
+	assert_cc(sizeof(uint16_t) == sizeof(Elf64_Half));
+	assert_cc(sizeof(uint32_t) == sizeof(Elf32_Word));
+	assert_cc(sizeof(uint32_t) == sizeof(Elf64_Word));
+
+	elf = malloc(sizeof(struct kmod_elf));
+	if (elf == NULL)
+		return -ENOMEM;
+
+	err = elf_identify(elf, memory, size);
+	if (err < 0) {
+		free(elf);
+		return err;
+	}
+
+	elf->memory = memory;
+	elf->size = size;
+	elf->sparse = sparse;
+	elf->section_names = NULL;
+
+	if (elf_load_header(elf) < 0)
 		goto invalid;
 
 	if (elf_get_section_info(elf, elf->header.strings.section,
@@ -398,111 +478,338 @@ invalid:
 
 void kmod_elf_unref(struct kmod_elf *elf)
 {
+	hash_free(elf->section_names);
 	free(elf);
 }
 
-/*
- * Returns section index on success, negative value otherwise.
- * On success, sec_off and sec_size are range checked and valid.
- */
-int kmod_elf_get_section(const struct kmod_elf *elf, const char *section,
-			 uint64_t *sec_off, uint64_t *sec_size)
+struct elf_sparse_batch {
+	const struct kmod_file *file;
+	struct kmod_file_range ranges[16];
+	size_t count;
+};
+
+static int elf_sparse_flush(struct elf_sparse_batch *batch)
 {
-	uint16_t i;
+	int err = kmod_file_read_ranges(batch->file, batch->ranges, batch->count);
 
-	*sec_off = 0;
-	*sec_size = 0;
+	batch->count = 0;
+	return err;
+}
 
-	for (i = 1; i < elf->header.section.count; i++) {
-		uint64_t off, size;
-		const char *n;
-		int err = elf_get_section_info(elf, i, &off, &size, &n);
+static int elf_sparse_add(struct elf_sparse_batch *batch, uint64_t offset, uint64_t size)
+{
+	int err;
+
+	if (batch->count == ARRAY_SIZE(batch->ranges)) {
+		err = elf_sparse_flush(batch);
 		if (err < 0)
+			return err;
+	}
+
+	batch->ranges[batch->count].offset = offset;
+	batch->ranges[batch->count].size = size;
+	batch->count++;
+	return 0;
+}
+
+/* Add the sections holding the values of __crc_ symbols, see kmod_elf_resolve_crc() */
+static int elf_sparse_add_crcs(const struct kmod_elf *elf, struct elf_sparse_batch *batch)
+{
+	uint64_t str_off, strtablen, sym_off, symtablen, symlen;
+	_cleanup_free_ uint8_t *added = NULL;
+	int err;
+
+	str_off = elf->sections[KMOD_ELF_SECTION_STRTAB].offset;
+	strtablen = elf->sections[KMOD_ELF_SECTION_STRTAB].size;
+	sym_off = elf->sections[KMOD_ELF_SECTION_SYMTAB].offset;
+	symtablen = elf->sections[KMOD_ELF_SECTION_SYMTAB].size;
+	if (str_off == 0 || sym_off == 0)
+		return 0;
+
+	symlen = elf->x32 ? sizeof(Elf32_Sym) : sizeof(Elf64_Sym);
+
+	added = calloc(elf->header.section.count, sizeof(uint8_t));
+	if (added == NULL)
+		return -ENOMEM;
+
+	for (uint64_t i = symlen; i + symlen <= symtablen; i += symlen) {
+		uint64_t off, size;
+		uint32_t name_off;
+		uint16_t shndx;
+		const char *name;
+
+#define READV(field) \
+	elf_get_uint(elf, sym_off + i + offsetof(typeof(*s), field), sizeof(s->field))
+		if (elf->x32) {
+			Elf32_Sym *s;
+
+			name_off = READV(st_name);
+			shndx = READV(st_shndx);
+		} else {
+			Elf64_Sym *s;
+
+			name_off = READV(st_name);
+			shndx = READV(st_shndx);
+		}
+#undef READV
+		if (shndx == SHN_UNDEF || shndx >= elf->header.section.count ||
+		    added[shndx] || name_off >= strtablen)
 			continue;
-		if (!streq(section, n))
+
+		name = elf_get_mem(elf, str_off + name_off);
+		if (!strstartswith(name, "__crc_"))
 			continue;
 
-		*sec_off = off;
-		*sec_size = size;
-		return i;
+		added[shndx] = 1;
+		if (elf_get_section_info(elf, shndx, &off, &size, &name) < 0)
+			continue;
+
+		err = elf_sparse_add(batch, off, size);
+		if (err < 0)
+			return err;
 	}
 
-	return -ENODATA;
+	return 0;
 }
 
-/* array will be allocated with strings in a single malloc, just free *array */
-int kmod_elf_get_modinfo_strings(const struct kmod_elf *elf, char ***array)
+/*
+ * Fill the memory of a sparsely loaded file (see kmod_file_get_sparse_contents())
+ * with the parts used by kmod_elf: the headers, the sections in section_name_map,
+ * the crc values and whatever is appended after the ELF image, i.e. the
+ * signature. The rest is never read from disk.
+ */
+int kmod_elf_read_sparse(const struct kmod_file *file, const void *memory, uint64_t size)
 {
-	size_t i, j, count;
-	size_t tmp_size, vec_size, total_size;
-	uint64_t off, size;
-	const char *strings;
-	char *s, **a;
+	struct elf_sparse_batch batch = {
+		.file = file,
+	};
+	struct kmod_elf elf = {
+		.memory = memory,
+		.size = size,
+		.sparse = true,
+	};
+	uint64_t shdrs_size, end;
+	const char *name;
+	int err;
 
-	*array = NULL;
+	err = elf_sparse_add(&batch, 0,
+			     size < sizeof(Elf64_Ehdr) ? size : sizeof(Elf64_Ehdr));
+	if (err == 0)
+		err = elf_sparse_flush(&batch);
+	if (err < 0)
+		return err;
 
-	off = elf->sections[KMOD_ELF_SECTION_MODINFO].offset;
-	size = elf->sections[KMOD_ELF_SECTION_MODINFO].size;
-	if (off == 0)
-		return -ENODATA;
+	err = elf_identify(&elf, memory, size);
+	if (err < 0)
+		return err;
 
-	strings = elf_get_mem(elf, off);
+	err = elf_load_header(&elf);
+	if (err < 0)
+		return err;
 
-	/* skip zero padding */
-	while (size > 1 && strings[0] == '\0') {
-		strings++;
-		size--;
+	shdrs_size = (uint64_t)elf.header.section.entry_size * elf.header.section.count;
+	err = elf_sparse_add(&batch, elf.header.section.offset, shdrs_size);
+	if (err == 0)
+		err = elf_sparse_flush(&batch);
+	if (err < 0)
+		return err;
+
+	if (elf_get_section_info(&elf, elf.header.strings.section,
+				 &elf.header.strings.offset, &elf.header.strings.size,
+				 &name) < 0)
+		return -EINVAL;
+
+	err = elf_sparse_add(&batch, elf.header.strings.offset, elf.header.strings.size);
+	if (err == 0)
+		err = elf_sparse_flush(&batch);
+	if (err < 0)
+		return err;
+
+	end = elf.header.section.offset + shdrs_size;
+	for (uint16_t i = 1; i < elf.header.section.count; i++) {
+		uint64_t off, sz, type_off;
+
+		/* .bss and friends take no room in the file */
+		type_off = elf_get_section_header_offset(&elf, i) +
+			   (elf.x32 ? offsetof(Elf32_Shdr, sh_type) :
+				      offsetof(Elf64_Shdr, sh_type));
+		if (elf_get_u32(&elf, type_off) == SHT_NOBITS)
+			continue;
+
+		if (elf_get_section_info(&elf, i, &off, &sz, &name) < 0)
+			continue;
+
+		if (off + sz > end)
+			end = off + sz;
+
+		if (elf_section_from_name(name) == KMOD_ELF_SECTION_MAX)
+			continue;
+
+		err = elf_sparse_add(&batch, off, sz);
+		if (err < 0)
+			return err;
 	}
 
-	if (size <= 1)
-		return 0;
+	if (end < size) {
+		err = elf_sparse_add(&batch, end, size - end);
+		if (err < 0)
+			return err;
+	}
 
-	for (i = 0, count = 0; i < size;) {
-		if (strings[i] != '\0') {
-			i++;
+	err = elf_sparse_flush(&batch);
+	if (err < 0)
+		return err;
+
+	kmod_elf_save_sections(&elf);
+
+	err = elf_sparse_add_crcs(&elf, &batch);
+	if (err == 0)
+		err = elf_sparse_flush(&batch);
+
+	return err;
+}
+
+static struct hash *elf_get_section_names(const struct kmod_elf *elf)
+{
+	struct hash *names, *expected = NULL;
+	unsigned int n_buckets;
+
+	names = __atomic_load_n(&elf->section_names, __ATOMIC_ACQUIRE);
+	if (names != NULL)
+		return names;
+
+	n_buckets = elf->header.section.count / 4;
+	if (n_buckets < 16)
+		n_buckets = 16;
+
+	names = hash_new(n_buckets, NULL);
+	if (names == NULL)
+		return NULL;
+
+	for (uint16_t i = 1; i < elf->header.section.count; i++) {
+		uint64_t off, size;
+		const char *n;
+		int err = elf_get_section_info(elf, i, &off, &size, &n);
+		if (err < 0)
 			continue;
-		}
 
-		while (strings[i] == '\0' && i < size)
-			i++;
+		/* keep the first one, as a linear search would */
+		err = hash_add_unique(names, n, (void *)(uintptr_t)i);
+		if (err < 0 && err != -EEXIST) {
+			hash_free(names);
+			return NULL;
+		}
+	}
 
-		count++;
+	/*
+	 * remove const: this only caches internal state. Concurrent callers may
+	 * race building it, the loser drops its copy.
+	 */
+	if (!__atomic_compare_exchange_n(&((struct kmod_elf *)elf)->section_names,
+					 &expected, names, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		hash_free(names);
+		names = expected;
 	}
 
-	if (strings[i - 1] != '\0')
-		count++;
+	return names;
+}
 
-	/* (string vector + NULL) * sizeof(char *) + size + NUL */
-	if (uaddsz_overflow(count, 1, &tmp_size) ||
-	    umulsz_overflow(sizeof(char *), tmp_size, &vec_size) ||
-	    uaddsz_overflow(size, vec_size, &tmp_size) ||
-	    uaddsz_overflow(1, tmp_size, &total_size)) {
-		return -ENOMEM;
+/*
+ * Returns section index on success, negative value otherwise.
+ * On success, sec_off and sec_size are range checked and valid. Sections not in
+ * section_name_map aren't there when only parts of the file were read, asking
+ * for them fails with -ENOTSUP.
+ */
+int kmod_elf_get_section(const struct kmod_elf *elf, const char *section,
+			 uint64_t *sec_off, uint64_t *sec_size)
+{
+	enum kmod_elf_section sec = elf_section_from_name(section);
+	struct hash *names;
+	const char *n;
+	uint16_t i;
+
+	*sec_off = 0;
+	*sec_size = 0;
+
+	if (sec != KMOD_ELF_SECTION_MAX) {
+		if (elf->sections[sec].idx == 0)
+			return -ENODATA;
+
+		*sec_off = elf->sections[sec].offset;
+		*sec_size = elf->sections[sec].size;
+		return elf->sections[sec].idx;
 	}
 
-	*array = a = malloc(total_size);
-	if (*array == NULL)
+	if (elf->sparse) {
+		ELFDBG(elf, "section %s was not read\n", section);
+		return -ENOTSUP;
+	}
+
+	names = elf_get_section_names(elf);
+	if (names == NULL)
 		return -ENOMEM;
 
-	s = (char *)(a + count + 1);
-	memcpy(s, strings, size);
+	i = (uintptr_t)hash_find(names, section);
+	if (i == 0)
+		return -ENODATA;
+
+	if (elf_get_section_info(elf, i, sec_off, sec_size, &n) < 0)
+		return -ENODATA;
+
+	return i;
+}
+
+/*
+ * Split .modinfo in "key=value" strings, in a single pass and without copying.
+ * keylen passed to cb is len if there's no '='.
+ */
+int kmod_elf_foreach_modinfo_string(const struct kmod_elf *elf,
+				    int (*cb)(const char *str, size_t len, size_t keylen,
+					      void *data),
+				    void *data)
+{
+	uint64_t off, size;
+	const char *strings, *end;
+	int count = 0;
+
+	off = elf->sections[KMOD_ELF_SECTION_MODINFO].offset;
+	size = elf->sections[KMOD_ELF_SECTION_MODINFO].size;
+	if (off == 0)
+		return -ENODATA;
+
+	strings = elf_get_mem(elf, off);
+	end = strings + size;
 
-	/* make sure the last string is NULL-terminated */
-	s[size] = '\0';
-	a[count] = NULL;
-	a[0] = s;
+	while (strings < end) {
+		const char *p, *nul;
+		int err;
 
-	for (i = 0, j = 1; j < count && i < size;) {
-		if (s[i] != '\0') {
-			i++;
+		/* skip zero padding and separators */
+		if (*strings == '\0') {
+			strings++;
 			continue;
 		}
 
-		while (i < size && s[i] == '\0')
-			i++;
+		/* keys are short: scan them here and leave the value to memchr() */
+		for (p = strings; p < end && *p != '=' && *p != '\0'; p++)
+			;
 
-		a[j] = &s[i];
-		j++;
+		if (p < end && *p == '=') {
+			/* the last string may not be terminated */
+			nul = memchr(p, '\0', end - p);
+			if (nul == NULL)
+				nul = end;
+		} else {
+			nul = p;
+		}
+
+		err = cb(strings, nul - strings, p - strings, data);
+		if (err < 0)
+			return err;
+
+		count++;
+		strings = nul;
 	}
 
 	return count;
@@ -528,17 +835,17 @@ static inline void elf_get_modversion_lengths(const struct kmod_elf *elf, size_t
 	}
 }
 
-/* array will be allocated with strings in a single malloc, just free *array */
-int kmod_elf_get_modversions(const struct kmod_elf *elf, struct kmod_modversion **array)
+int kmod_elf_foreach_modversion(const struct kmod_elf *elf,
+				int (*cb)(const char *symbol, size_t len, uint64_t crc,
+					  enum kmod_symbol_bind bind, void *data),
+				void *data)
 {
 	size_t i, count, crclen, namlen, verlen;
 	uint64_t off, sec_off, size;
-	struct kmod_modversion *a;
+	int err;
 
 	elf_get_modversion_lengths(elf, &verlen, &crclen, &namlen);
 
-	*array = NULL;
-
 	sec_off = elf->sections[KMOD_ELF_SECTION_VERSIONS].offset;
 	size = elf->sections[KMOD_ELF_SECTION_VERSIONS].size;
 	if (sec_off == 0)
@@ -556,10 +863,6 @@ int kmod_elf_get_modversions(const struct kmod_elf *elf, struct kmod_modversion
 		return -EINVAL;
 	}
 
-	*array = a = malloc(sizeof(struct kmod_modversion) * count);
-	if (*array == NULL)
-		return -ENOMEM;
-
 	for (i = 0, off = sec_off; i < count; i++, off += verlen) {
 		uint64_t crc = elf_get_uint(elf, off, crclen);
 		const char *symbol = elf_get_mem(elf, off + crclen);
@@ -570,12 +873,14 @@ int kmod_elf_get_modversions(const struct kmod_elf *elf, struct kmod_modversion
 			return -EINVAL;
 		}
 
-		if (symbol[0] == '.')
+		if (symbol[0] == '.') {
 			symbol++;
+			nlen--;
+		}
 
-		a[i].crc = crc;
-		a[i].bind = KMOD_SYMBOL_UNDEF;
-		a[i].symbol = symbol;
+		err = cb(symbol, nlen, crc, KMOD_SYMBOL_UNDEF, data);
+		if (err < 0)
+			return err;
 	}
 
 	return count;
@@ -655,47 +960,43 @@ static int elf_strip_vermagic(const struct kmod_elf *elf, uint8_t *changed)
 	return -ENODATA;
 }
 
-int kmod_elf_strip(const struct kmod_elf *elf, unsigned int flags, const void **stripped)
+/*
+ * changed must be a writable copy of the memory elf was created with. Only the
+ * bytes being stripped are written to, so a copy-on-write mapping only
+ * duplicates the pages that contain them.
+ */
+int kmod_elf_strip(const struct kmod_elf *elf, unsigned int flags, void *changed)
 {
-	uint8_t *changed;
-	int err = 0;
+	int err;
 
 	assert(flags & (KMOD_INSERT_FORCE_MODVERSION | KMOD_INSERT_FORCE_VERMAGIC));
 
-	changed = memdup(elf->memory, elf->size);
-	if (changed == NULL)
-		return -ENOMEM;
-
-	ELFDBG(elf, "copied memory to allow writing.\n");
-
 	if (flags & KMOD_INSERT_FORCE_MODVERSION) {
 		err = elf_strip_versions_section(elf, changed);
 		if (err < 0)
-			goto fail;
+			return err;
 	}
 
 	if (flags & KMOD_INSERT_FORCE_VERMAGIC) {
 		err = elf_strip_vermagic(elf, changed);
 		if (err < 0)
-			goto fail;
+			return err;
 	}
 
-	*stripped = changed;
 	return 0;
-fail:
-	free(changed);
-	return err;
 }
 
-static int kmod_elf_get_symbols_symtab(const struct kmod_elf *elf,
-				       struct kmod_modversion **array)
+static int kmod_elf_foreach_symbol_symtab(const struct kmod_elf *elf,
+					  int (*cb)(const char *symbol, size_t len,
+						    uint64_t crc,
+						    enum kmod_symbol_bind bind,
+						    void *data),
+					  void *data)
 {
-	uint64_t i, last, off, size;
+	uint64_t i, end, off, size;
 	const char *strings;
-	struct kmod_modversion *a;
-	size_t count, total_size;
-
-	*array = NULL;
+	size_t count;
+	int err;
 
 	off = elf->sections[KMOD_ELF_SECTION_KSYMTAB].offset;
 	size = elf->sections[KMOD_ELF_SECTION_KSYMTAB].size;
@@ -709,52 +1010,28 @@ static int kmod_elf_get_symbols_symtab(const struct kmod_elf *elf,
 		size--;
 	}
 	if (size <= 1)
-		return 0;
-
-	if (strings[size - 1] != '\0') {
-		ELFDBG(elf, "section __ksymtab_strings does not end with \\0 byte");
-		return -EINVAL;
-	}
-
-	last = 0;
-	for (i = 0, count = 0; i < size; i++) {
-		if (strings[i] == '\0') {
-			if (last == i) {
-				last = i + 1;
-				continue;
-			}
-			count++;
-			last = i + 1;
-		}
-	}
-
-	if (count > INT_MAX) {
-		ELFDBG(elf, "too many symbols: %zu\n", count);
-		return -EINVAL;
-	}
+		return 0;
 
-	/* sizeof(struct kmod_modversion) * count */
-	if (umulsz_overflow(sizeof(struct kmod_modversion), count, &total_size)) {
-		return -ENOMEM;
+	if (strings[size - 1] != '\0') {
+		ELFDBG(elf, "section __ksymtab_strings does not end with \\0 byte");
+		return -EINVAL;
 	}
 
-	*array = a = malloc(total_size);
-	if (*array == NULL)
-		return -ENOMEM;
+	for (i = 0, count = 0; i < size; i = end + 1) {
+		/* always found: the section ends with \0 */
+		end = (const char *)memchr(strings + i, '\0', size - i) - strings;
+		if (end == i)
+			continue;
 
-	last = 0;
-	for (i = 0, count = 0; i < size; i++) {
-		if (strings[i] == '\0') {
-			if (last == i) {
-				last = i + 1;
-				continue;
-			}
-			a[count].crc = 0;
-			a[count].bind = KMOD_SYMBOL_GLOBAL;
-			a[count].symbol = strings + last;
-			count++;
-			last = i + 1;
+		if (count == INT_MAX) {
+			ELFDBG(elf, "too many symbols: %zu\n", count);
+			return -EINVAL;
 		}
+
+		err = cb(strings + i, end - i, 0, KMOD_SYMBOL_GLOBAL, data);
+		if (err < 0)
+			return err;
+		count++;
 	}
 
 	return count;
@@ -803,153 +1080,34 @@ static uint64_t kmod_elf_resolve_crc(const struct kmod_elf *elf, uint64_t crc,
 	return crc;
 }
 
-/* array will be allocated with strings in a single malloc, just free *array */
-int kmod_elf_get_symbols(const struct kmod_elf *elf, struct kmod_modversion **array)
-{
-	static const char crc_str[] = "__crc_";
-	static const size_t crc_strlen = sizeof(crc_str) - 1;
-	uint64_t strtablen, symtablen, str_sec_off, sym_sec_off, str_off, sym_off;
-	struct kmod_modversion *a;
-	size_t i, count, symcount, symlen;
-
-	str_sec_off = elf->sections[KMOD_ELF_SECTION_STRTAB].offset;
-	strtablen = elf->sections[KMOD_ELF_SECTION_STRTAB].size;
-	if (str_sec_off == 0) {
-		ELFDBG(elf, "no .strtab found.\n");
-		goto fallback;
-	}
-
-	sym_sec_off = elf->sections[KMOD_ELF_SECTION_SYMTAB].offset;
-	symtablen = elf->sections[KMOD_ELF_SECTION_SYMTAB].size;
-	if (sym_sec_off == 0) {
-		ELFDBG(elf, "no .symtab found.\n");
-		goto fallback;
-	}
-
-	if (elf->x32)
-		symlen = sizeof(Elf32_Sym);
-	else
-		symlen = sizeof(Elf64_Sym);
-
-	if (symtablen % symlen != 0) {
-		ELFDBG(elf,
-		       "unexpected .symtab of length %" PRIu64
-		       ", not multiple of %zu as expected.\n",
-		       symtablen, symlen);
-		goto fallback;
-	}
-
-	symcount = symtablen / symlen;
-	count = 0;
-	str_off = str_sec_off;
-	sym_off = sym_sec_off + symlen;
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
-		const char *name;
-		uint32_t name_off;
-
-#define READV(field) \
-	elf_get_uint(elf, sym_off + offsetof(typeof(*s), field), sizeof(s->field))
-		if (elf->x32) {
-			Elf32_Sym *s;
-
-			name_off = READV(st_name);
-		} else {
-			Elf64_Sym *s;
-
-			name_off = READV(st_name);
-		}
-#undef READV
-		if (name_off >= strtablen) {
-			ELFDBG(elf,
-			       ".strtab is %" PRIu64
-			       " bytes, but .symtab entry %zu wants to access offset %" PRIu32
-			       ".\n",
-			       strtablen, i, name_off);
-			goto fallback;
-		}
-
-		name = elf_get_mem(elf, str_off + name_off);
-
-		if (!strstartswith(name, crc_str))
-			continue;
-		count++;
-	}
-
-	if (count == 0)
-		goto fallback;
-
-	*array = a = malloc(sizeof(struct kmod_modversion) * count);
-	if (*array == NULL)
-		return -ENOMEM;
-
-	count = 0;
-	str_off = str_sec_off;
-	sym_off = sym_sec_off + symlen;
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
-		const char *name;
-		uint32_t name_off;
-		uint64_t crc;
-		uint8_t info, bind;
-		uint16_t shndx;
-
-#define READV(field) \
-	elf_get_uint(elf, sym_off + offsetof(typeof(*s), field), sizeof(s->field))
-		if (elf->x32) {
-			Elf32_Sym *s;
-
-			name_off = READV(st_name);
-			crc = READV(st_value);
-			info = READV(st_info);
-			shndx = READV(st_shndx);
-		} else {
-			Elf64_Sym *s;
-
-			name_off = READV(st_name);
-			crc = READV(st_value);
-			info = READV(st_info);
-			shndx = READV(st_shndx);
-		}
-#undef READV
-		name = elf_get_mem(elf, str_off + name_off);
-		if (!strstartswith(name, crc_str))
-			continue;
-		name += crc_strlen;
-
-		if (elf->x32)
-			bind = ELF32_ST_BIND(info);
-		else
-			bind = ELF64_ST_BIND(info);
-
-		a[count].crc = kmod_elf_resolve_crc(elf, crc, shndx);
-		a[count].bind = kmod_symbol_bind_from_elf(bind);
-		a[count].symbol = name;
-		count++;
-	}
-	return count;
-
-fallback:
-	ELFDBG(elf, "Falling back to __ksymtab_strings!\n");
-	return kmod_elf_get_symbols_symtab(elf, array);
-}
-
 static int kmod_elf_crc_find(const struct kmod_elf *elf, uint64_t off,
-			     uint64_t versionslen, const char *name, uint64_t *crc)
+			     uint64_t versionslen, const char *name, size_t hint,
+			     uint64_t *crc)
 {
-	size_t namlen, verlen, crclen;
-	uint64_t i;
+	size_t namlen, verlen, crclen, vercount, n;
 
-	elf_get_modversion_lengths(elf, &verlen, &crclen, &namlen);
+	if (versionslen == 0)
+		goto notfound;
 
-	for (i = 0; i < versionslen; i += verlen) {
-		const char *symbol = elf_get_mem(elf, off + i + crclen);
+	elf_get_modversion_lengths(elf, &verlen, &crclen, &namlen);
+	vercount = versionslen / verlen;
+
+	/*
+	 * __versions is usually in the same order as the undefined symbols, so
+	 * start right after the previous match and wrap around.
+	 */
+	for (n = 0; n < vercount; n++) {
+		size_t i = (hint + n) % vercount;
+		const char *symbol = elf_get_mem(elf, off + i * verlen + crclen);
 		if (strnlen(symbol, namlen) == namlen || !streq(name, symbol)) {
-			ELFDBG(elf, "symbol name at index %" PRIu64 " too long\n", i);
+			ELFDBG(elf, "symbol name at index %zu too long\n", i);
 			continue;
 		}
-		*crc = elf_get_uint(elf, off + i, crclen);
-		return i / verlen;
+		*crc = elf_get_uint(elf, off + i * verlen, crclen);
+		return i;
 	}
 
+notfound:
 	ELFDBG(elf, "could not find crc for symbol '%s'\n", name);
 	*crc = 0;
 	return -1;
@@ -960,17 +1118,35 @@ static int kmod_elf_crc_find(const struct kmod_elf *elf, uint64_t off,
 #define STT_REGISTER 13 /* Global register reserved to app. */
 #endif
 
-/* array will be allocated with strings in a single malloc, just free *array */
-int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf,
-				    struct kmod_modversion **array)
+/*
+ * Walk .symtab once, reporting the exported symbols to @exported, like
+ * kmod_elf_foreach_symbol(), and the required ones to @required, like
+ * kmod_elf_foreach_dependency_symbol(). Either callback may be NULL.
+ *
+ * Returns the result for @exported, the one for @required is stored in
+ * @required_ret. If the latter is negative, @required may already have been
+ * called for some symbols: the caller is expected to drop them.
+ */
+int kmod_elf_foreach_symbols(const struct kmod_elf *elf,
+			     int (*exported)(const char *symbol, size_t len, uint64_t crc,
+					     enum kmod_symbol_bind bind, void *data),
+			     int (*required)(const char *symbol, size_t len, uint64_t crc,
+					     enum kmod_symbol_bind bind, void *data),
+			     void *data, int *required_ret)
 {
+	static const char crc_str[] = "__crc_";
+	static const size_t crc_strlen = sizeof(crc_str) - 1;
 	uint64_t versionslen, strtablen, symtablen, str_off, sym_off, ver_off;
 	uint64_t str_sec_off, sym_sec_off;
-	struct kmod_modversion *a;
-	size_t i, count, namlen, vercount, verlen, symcount, symlen, crclen;
-	bool handle_register_symbols;
-	uint8_t *visited_versions;
-	uint64_t *symcrcs;
+	size_t i, n_exported, n_required, namlen, vercount, verlen, symcount, symlen,
+		crclen, ver_hint;
+	bool handle_register_symbols, use_symtab;
+	uint8_t visited_buf[512];
+	_cleanup_free_ uint8_t *visited_alloc = NULL;
+	uint8_t *visited_versions = NULL;
+	int err, required_err = 0;
+
+	*required_ret = 0;
 
 	ver_off = elf->sections[KMOD_ELF_SECTION_VERSIONS].offset;
 	versionslen = elf->sections[KMOD_ELF_SECTION_VERSIONS].size;
@@ -995,14 +1171,14 @@ int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf,
 	strtablen = elf->sections[KMOD_ELF_SECTION_STRTAB].size;
 	if (str_sec_off == 0) {
 		ELFDBG(elf, "no .strtab found.\n");
-		return -EINVAL;
+		goto no_symtab;
 	}
 
 	sym_sec_off = elf->sections[KMOD_ELF_SECTION_SYMTAB].offset;
 	symtablen = elf->sections[KMOD_ELF_SECTION_SYMTAB].size;
 	if (sym_sec_off == 0) {
 		ELFDBG(elf, "no .symtab found.\n");
-		return -EINVAL;
+		goto no_symtab;
 	}
 
 	if (elf->x32)
@@ -1015,40 +1191,25 @@ int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf,
 		       "unexpected .symtab of length %" PRIu64
 		       ", not multiple of %zu as expected.\n",
 		       symtablen, symlen);
-		return -EINVAL;
+		goto no_symtab;
 	}
 
-	if (versionslen == 0) {
-		vercount = 0;
-		visited_versions = NULL;
-	} else {
-		vercount = versionslen / verlen;
-		visited_versions = calloc(vercount, sizeof(uint8_t));
-		if (visited_versions == NULL)
-			return -ENOMEM;
-	}
-
-	handle_register_symbols =
-		(elf->header.machine == EM_SPARC || elf->header.machine == EM_SPARCV9);
-
 	symcount = symtablen / symlen;
-	count = 0;
-	str_off = str_sec_off;
-	sym_off = sym_sec_off + symlen;
-
-	symcrcs = calloc(symcount, sizeof(uint64_t));
-	if (symcrcs == NULL) {
-		free(visited_versions);
-		return -ENOMEM;
+	vercount = versionslen == 0 ? 0 : versionslen / verlen;
+	if (symcount + vercount > INT_MAX) {
+		ELFDBG(elf, "too many symbols: %zu\n", symcount + vercount);
+		goto no_symtab;
 	}
 
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
-		const char *name;
-		uint64_t crc;
+	/*
+	 * Exported symbols are only taken from .symtab if all of its names are
+	 * valid: on failure we fall back to __ksymtab_strings and must not have
+	 * reported anything yet. Only st_name is needed for that.
+	 */
+	use_symtab = exported != NULL;
+	sym_off = sym_sec_off + symlen;
+	for (i = 1; use_symtab && i < symcount; i++, sym_off += symlen) {
 		uint32_t name_off;
-		uint16_t secidx;
-		uint8_t info;
-		int idx;
 
 #define READV(field) \
 	elf_get_uint(elf, sym_off + offsetof(typeof(*s), field), sizeof(s->field))
@@ -1056,114 +1217,52 @@ int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf,
 			Elf32_Sym *s;
 
 			name_off = READV(st_name);
-			secidx = READV(st_shndx);
-			info = READV(st_info);
 		} else {
 			Elf64_Sym *s;
 
 			name_off = READV(st_name);
-			secidx = READV(st_shndx);
-			info = READV(st_info);
 		}
 #undef READV
-		if (secidx != SHN_UNDEF)
-			continue;
-
-		if (handle_register_symbols) {
-			uint8_t type;
-			if (elf->x32)
-				type = ELF32_ST_TYPE(info);
-			else
-				type = ELF64_ST_TYPE(info);
-
-			/* Not really undefined: sparc gcc 3.3 creates
-			 * U references when you have global asm
-			 * variables, to avoid anyone else misusing
-			 * them.
-			 */
-			if (type == STT_REGISTER)
-				continue;
-		}
-
 		if (name_off >= strtablen) {
 			ELFDBG(elf,
 			       ".strtab is %" PRIu64
 			       " bytes, but .symtab entry %zu wants to access offset %" PRIu32
 			       ".\n",
 			       strtablen, i, name_off);
-			free(visited_versions);
-			free(symcrcs);
-			return -EINVAL;
+			use_symtab = false;
 		}
-
-		name = elf_get_mem(elf, str_off + name_off);
-		if (name[0] == '\0') {
-			ELFDBG(elf, "empty symbol name at index %zu\n", i);
-			continue;
-		}
-
-		count++;
-
-		idx = kmod_elf_crc_find(elf, ver_off, versionslen, name, &crc);
-		if (idx >= 0 && visited_versions != NULL)
-			visited_versions[idx] = 1;
-		symcrcs[i] = crc;
 	}
 
-	if (visited_versions != NULL) {
-		/* module_layout/struct_module are not visited, but needed */
-		for (i = 0; i < vercount; i++) {
-			if (visited_versions[i] == 0) {
-				const char *name;
-				size_t nlen;
-
-				name = elf_get_mem(elf, ver_off + i * verlen + crclen);
-				nlen = strnlen(name, namlen);
-
-				if (nlen == namlen) {
-					ELFDBG(elf, "symbol name at index %zu too long\n",
-					       i);
-					free(visited_versions);
-					free(symcrcs);
-					return -EINVAL;
-				}
-
-				count++;
-			}
+	if (required != NULL && vercount > 0) {
+		if (vercount <= sizeof(visited_buf)) {
+			visited_versions = visited_buf;
+			memset(visited_versions, 0, vercount);
+		} else {
+			visited_alloc = calloc(vercount, sizeof(uint8_t));
+			if (visited_alloc == NULL)
+				return -ENOMEM;
+			visited_versions = visited_alloc;
 		}
 	}
 
-	if (count > INT_MAX) {
-		ELFDBG(elf, "too many symbols: %zu\n", count);
-		free(visited_versions);
-		free(symcrcs);
-		*array = NULL;
-		return -EINVAL;
-	}
-
-	if (count == 0) {
-		free(visited_versions);
-		free(symcrcs);
-		*array = NULL;
-		return 0;
-	}
-
-	*array = a = malloc(sizeof(struct kmod_modversion) * count);
-	if (*array == NULL) {
-		free(visited_versions);
-		free(symcrcs);
-		return -ENOMEM;
-	}
+	handle_register_symbols =
+		(elf->header.machine == EM_SPARC || elf->header.machine == EM_SPARCV9);
 
-	count = 0;
+	n_exported = 0;
+	n_required = 0;
+	ver_hint = 0;
 	str_off = str_sec_off;
 	sym_off = sym_sec_off + symlen;
 	for (i = 1; i < symcount; i++, sym_off += symlen) {
 		const char *name;
 		uint64_t crc;
 		uint32_t name_off;
-		uint16_t secidx;
+		uint16_t shndx;
 		uint8_t info, bind;
+		int idx;
+
+		if (!use_symtab && (required == NULL || required_err < 0))
+			break;
 
 #define READV(field) \
 	elf_get_uint(elf, sym_off + offsetof(typeof(*s), field), sizeof(s->field))
@@ -1171,17 +1270,37 @@ int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf,
 			Elf32_Sym *s;
 
 			name_off = READV(st_name);
-			secidx = READV(st_shndx);
+			crc = READV(st_value);
 			info = READV(st_info);
+			shndx = READV(st_shndx);
 		} else {
 			Elf64_Sym *s;
 
 			name_off = READV(st_name);
-			secidx = READV(st_shndx);
+			crc = READV(st_value);
 			info = READV(st_info);
+			shndx = READV(st_shndx);
 		}
 #undef READV
-		if (secidx != SHN_UNDEF)
+		if (elf->x32)
+			bind = ELF32_ST_BIND(info);
+		else
+			bind = ELF64_ST_BIND(info);
+
+		if (use_symtab) {
+			name = elf_get_mem(elf, str_off + name_off);
+			if (strstartswith(name, crc_str)) {
+				name += crc_strlen;
+				err = exported(name, strlen(name),
+					       kmod_elf_resolve_crc(elf, crc, shndx),
+					       kmod_symbol_bind_from_elf(bind), data);
+				if (err < 0)
+					goto cb_fail;
+				n_exported++;
+			}
+		}
+
+		if (required == NULL || required_err < 0 || shndx != SHN_UNDEF)
 			continue;
 
 		if (handle_register_symbols) {
@@ -1200,54 +1319,106 @@ int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf,
 				continue;
 		}
 
+		if (name_off >= strtablen) {
+			ELFDBG(elf,
+			       ".strtab is %" PRIu64
+			       " bytes, but .symtab entry %zu wants to access offset %" PRIu32
+			       ".\n",
+			       strtablen, i, name_off);
+			required_err = -EINVAL;
+			continue;
+		}
+
 		name = elf_get_mem(elf, str_off + name_off);
 		if (name[0] == '\0') {
 			ELFDBG(elf, "empty symbol name at index %zu\n", i);
 			continue;
 		}
 
-		if (elf->x32)
-			bind = ELF32_ST_BIND(info);
-		else
-			bind = ELF64_ST_BIND(info);
-		if (bind == STB_WEAK)
-			bind = KMOD_SYMBOL_WEAK;
-		else
-			bind = KMOD_SYMBOL_UNDEF;
-
-		crc = symcrcs[i];
-
-		a[count].crc = crc;
-		a[count].bind = bind;
-		a[count].symbol = name;
+		idx = kmod_elf_crc_find(elf, ver_off, versionslen, name, ver_hint, &crc);
+		if (idx >= 0) {
+			visited_versions[idx] = 1;
+			ver_hint = idx + 1;
+		}
 
-		count++;
+		err = required(name, strlen(name), crc,
+			       bind == STB_WEAK ? KMOD_SYMBOL_WEAK : KMOD_SYMBOL_UNDEF,
+			       data);
+		if (err < 0)
+			goto cb_fail;
+		n_required++;
 	}
 
-	free(symcrcs);
-
-	if (visited_versions == NULL)
-		return count;
-
 	/* add unvisited (module_layout/struct_module) */
-	for (i = 0; i < vercount; i++) {
+	for (i = 0; visited_versions != NULL && required_err == 0 && i < vercount; i++) {
 		const char *name;
 		uint64_t crc;
+		size_t nlen;
 
 		if (visited_versions[i] != 0)
 			continue;
 
 		name = elf_get_mem(elf, ver_off + i * verlen + crclen);
-		crc = elf_get_uint(elf, ver_off + i * verlen, crclen);
+		nlen = strnlen(name, namlen);
+		if (nlen == namlen) {
+			ELFDBG(elf, "symbol name at index %zu too long\n", i);
+			required_err = -EINVAL;
+			break;
+		}
 
-		a[count].crc = crc;
-		a[count].bind = KMOD_SYMBOL_UNDEF;
-		a[count].symbol = name;
+		crc = elf_get_uint(elf, ver_off + i * verlen, crclen);
 
-		count++;
+		err = required(name, nlen, crc, KMOD_SYMBOL_UNDEF, data);
+		if (err < 0)
+			goto cb_fail;
+		n_required++;
 	}
-	free(visited_versions);
-	return count;
+
+	*required_ret = required_err < 0 ? required_err : (int)n_required;
+
+	if (exported == NULL)
+		return 0;
+	if (n_exported > 0)
+		return n_exported;
+	goto fallback;
+
+cb_fail:
+	*required_ret = err;
+	return err;
+
+no_symtab:
+	*required_ret = -EINVAL;
+	if (exported == NULL)
+		return 0;
+
+fallback:
+	ELFDBG(elf, "Falling back to __ksymtab_strings!\n");
+	return kmod_elf_foreach_symbol_symtab(elf, exported, data);
+}
+
+int kmod_elf_foreach_symbol(const struct kmod_elf *elf,
+			    int (*cb)(const char *symbol, size_t len, uint64_t crc,
+				      enum kmod_symbol_bind bind, void *data),
+			    void *data)
+{
+	int required_ret;
+
+	return kmod_elf_foreach_symbols(elf, cb, NULL, data, &required_ret);
+}
+
+int kmod_elf_foreach_dependency_symbol(const struct kmod_elf *elf,
+				       int (*cb)(const char *symbol, size_t len,
+						 uint64_t crc,
+						 enum kmod_symbol_bind bind, void *data),
+				       void *data)
+{
+	int required_ret, err;
+
+	err = kmod_elf_foreach_symbols(elf, NULL, cb, data, &required_ret);
+	if (err < 0)
+		return err;
+
+	return required_ret;
 }
 
 #ifndef NT_GNU_BUILD_ID
@@ -24,10 +24,13 @@
 #define READ_STEP (4 * 1024 * 1024)
 
 #define DL_SYMBOL_TABLE(M) \
+	M(compress2)       \
+	M(compressBound)   \
 	M(gzclose)         \
 	M(gzdopen)         \
 	M(gzerror)         \
-	M(gzread)
+	M(gzread)          \
+	M(uncompress)
 
 DL_SYMBOL_TABLE(DECLARE_SYM)
 
@@ -109,3 +112,45 @@ error:
 	sym_gzclose(gzf);
 	return ret;
 }
+
+int kmod_zlib_load(void)
+{
+	int ret = dlopen_zlib();
+
+	return ret < 0 ? ret : 0;
+}
+
+int kmod_zlib_compress(const void *src, size_t src_size, void **dst, size_t *dst_size)
+{
+	_cleanup_free_ unsigned char *p = NULL;
+	uLongf len;
+	int ret;
+
+	len = sym_compressBound(src_size);
+	p = malloc(len);
+	if (p == NULL)
+		return -ENOMEM;
+
+	ret = sym_compress2(p, &len, src, src_size, Z_DEFAULT_COMPRESSION);
+	if (ret != Z_OK)
+		return ret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+
+	*dst = TAKE_PTR(p);
+	*dst_size = len;
+
+	return 0;
+}
+
+int kmod_zlib_uncompress(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+	uLongf len = dst_size;
+	int ret;
+
+	ret = sym_uncompress(dst, &len, src, src_size);
+	if (ret == Z_MEM_ERROR)
+		return -ENOMEM;
+	if (ret != Z_OK || len != dst_size)
+		return -EINVAL;
+
+	return 0;
+}
@@ -24,7 +24,41 @@ static const char magic_zstd[] = { 0x28, 0xB5, 0x2F, 0xFD };
 static const char magic_xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
 static const char magic_zlib[] = { 0x1f, 0x8b };
 
-static int load_reg(struct kmod_file *file)
+int kmod_file_read_ranges(const struct kmod_file *file,
+			  const struct kmod_file_range *ranges, size_t count)
+{
+	size_t i;
+
+	/* submit all of them first so the reads below don't wait on each other */
+	for (i = 0; i < count; i++)
+		posix_fadvise(file->fd, ranges[i].offset, ranges[i].size,
+			      POSIX_FADV_WILLNEED);
+
+	for (i = 0; i < count; i++) {
+		uint8_t *p = (uint8_t *)file->memory + ranges[i].offset;
+		uint64_t off = ranges[i].offset;
+		uint64_t left = ranges[i].size;
+
+		while (left > 0) {
+			ssize_t r = pread(file->fd, p, left, off);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (r == 0)
+				return -EIO;
+
+			p += r;
+			off += r;
+			left -= r;
+		}
+	}
+
+	return 0;
+}
+
+static int stat_reg(struct kmod_file *file)
 {
 	struct stat st;
 
@@ -35,6 +69,47 @@ static int load_reg(struct kmod_file *file)
 	if ((uintmax_t)file->size > SIZE_MAX)
 		return -ENOMEM;
 
+	return 0;
+}
+
+/*
+ * Reserve room for the whole file without touching the disk: anonymous pages
+ * cost nothing until written. Then only read what libkmod-elf needs.
+ */
+static int load_reg_sparse(struct kmod_file *file)
+{
+	int err;
+
+	err = stat_reg(file);
+	if (err < 0)
+		return err;
+
+	file->memory = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (file->memory == MAP_FAILED) {
+		file->memory = NULL;
+		return -errno;
+	}
+
+	err = kmod_elf_read_sparse(file, file->memory, file->size);
+	if (err < 0) {
+		munmap(file->memory, file->size);
+		file->memory = NULL;
+		return err;
+	}
+
+	file->sparse = true;
+	return 0;
+}
+
+static int load_reg(struct kmod_file *file)
+{
+	int err;
+
+	err = stat_reg(file);
+	if (err < 0)
+		return err;
+
 	file->memory = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
 	if (file->memory == MAP_FAILED) {
 		file->memory = NULL;
@@ -44,6 +119,23 @@ static int load_reg(struct kmod_file *file)
 	return 0;
 }
 
+/*
+ * Replace the ranges read by load_reg_sparse() with a mapping of the whole file
+ * at the same address, so pointers into it, e.g. from a kmod_elf, stay valid.
+ */
+static int load_reg_in_place(struct kmod_file *file)
+{
+	void *p;
+
+	p = mmap(file->memory, file->size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file->fd,
+		 0);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	file->sparse = false;
+	return 0;
+}
+
 static const struct comp_type {
 	size_t magic_size;
 	enum kmod_file_compression_type compression;
@@ -119,6 +211,35 @@ int kmod_file_open(const struct kmod_ctx *ctx, const char *filename,
 int kmod_file_get_contents(const struct kmod_file *file, const void **contents,
 			   off_t *size)
 {
+	int ret = 0;
+
+	if (!file->memory)
+		ret = file->load((struct kmod_file *)file);
+	else if (file->sparse)
+		ret = load_reg_in_place((struct kmod_file *)file);
+	/*  The load functions already log possible errors. */
+	if (ret)
+		return ret;
+
+	*contents = file->memory;
+	*size = file->size;
+	return 0;
+}
+
+/*
+ * Like kmod_file_get_contents(), but for uncompressed files only the parts
+ * used by kmod_elf are read from disk, see kmod_elf_read_sparse(): everything
+ * else reads as zeros. Files that can't be parsed are read as a whole. It's
+ * meant for looking at the metadata of modules, that's all libkmod does with
+ * them besides inserting.
+ */
+int kmod_file_get_sparse_contents(const struct kmod_file *file, const void **contents,
+				  off_t *size)
+{
+	/* if it's not something we know how to pick apart, read it all below */
+	if (!file->memory && file->compression == KMOD_FILE_COMPRESSION_NONE)
+		(void)load_reg_sparse((struct kmod_file *)file);
+
 	if (!file->memory) {
 		int ret = file->load((struct kmod_file *)file);
 		/*  The load functions already log possible errors. */
@@ -130,6 +251,45 @@ int kmod_file_get_contents(const struct kmod_file *file, const void **contents,
 	return 0;
 }
 
+/*
+ * Get a private copy of the contents that can be modified. For uncompressed
+ * files it's a copy-on-write mapping of the file: only the pages actually
+ * written to are duplicated. Release it with kmod_file_put_writable_contents().
+ */
+int kmod_file_get_writable_contents(const struct kmod_file *file, void **contents,
+				    off_t *size)
+{
+	const void *mem;
+	void *p;
+	int err;
+
+	err = kmod_file_get_contents(file, &mem, size);
+	if (err)
+		return err;
+
+	if (file->compression == KMOD_FILE_COMPRESSION_NONE) {
+		p = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			 file->fd, 0);
+		if (p == MAP_FAILED)
+			return -errno;
+	} else {
+		p = memdup(mem, file->size);
+		if (p == NULL)
+			return -ENOMEM;
+	}
+
+	*contents = p;
+	return 0;
+}
+
+void kmod_file_put_writable_contents(const struct kmod_file *file, void *contents)
+{
+	if (file->compression == KMOD_FILE_COMPRESSION_NONE)
+		munmap(contents, file->size);
+	else
+		free(contents);
+}
+
 enum kmod_file_compression_type kmod_file_get_compression(const struct kmod_file *file)
 {
 	return file->compression;
@@ -140,6 +300,11 @@ int kmod_file_get_fd(const struct kmod_file *file)
 	return file->fd;
 }
 
+bool kmod_file_is_sparse(const struct kmod_file *file)
+{
+	return file->sparse;
+}
+
 void kmod_file_unref(struct kmod_file *file)
 {
 	if (file->compression == KMOD_FILE_COMPRESSION_NONE) {
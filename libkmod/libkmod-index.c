@@ -3,7 +3,9 @@
  * Copyright (C) 2011-2013  ProFUSION embedded systems
  */
 
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <endian.h>
@@ -11,6 +13,7 @@
 #include <fnmatch.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +23,7 @@
 #include <shared/util.h>
 
 #include "libkmod-internal.h"
+#include "libkmod-internal-file.h"
 #include "libkmod-index.h"
 
 /* libkmod-index.c: module index file implementation
@@ -41,7 +45,7 @@
  */
 #define INDEX_MAGIC 0xB007F457
 #define INDEX_VERSION_MAJOR 0x0002
-#define INDEX_VERSION_MINOR 0x0001
+#define INDEX_VERSION_MINOR 0x0002
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR << 16) | INDEX_VERSION_MINOR)
 
 /* The index file maps keys to values. Both keys and values are ASCII strings.
@@ -58,6 +62,13 @@
  *  uint32_t magic = INDEX_MAGIC;
  *  uint32_t version = INDEX_VERSION;
  *  uint32_t root_offset;
+ *  uint32_t hot_end; // since minor 2
+ *
+ *  Nodes may be stored in any order. Since minor version 2, the nodes closest
+ *  to the root are stored breadth-first right after the header and hot_end is
+ *  the offset where that region ends: it's what every lookup needs to touch.
+ *  Readers that don't know about it just skip the field since nodes are only
+ *  reached through offsets.
  *
  *  (node_offset & INDEX_NODE_MASK) specifies the file offset of nodes:
  *
@@ -132,6 +143,50 @@
  * child pointers at the start and end of arrays.
  */
 
+/* Container format:
+ *
+ * modules.bin holds all the indexes above in a single file so they can be
+ * opened, mapped and validated at once. Its magic ends with 'C' for container.
+ *
+ *  uint32_t magic = INDEX_CONTAINER_MAGIC;
+ *  uint32_t version = INDEX_CONTAINER_VERSION;
+ *  uint32_t section_count;
+ *  uint32_t table_crc; // CRC-32 of sections[]
+ *  struct {
+ *      uint32_t type; // enum kmod_index
+ *      uint32_t offset;
+ *      uint32_t size;
+ *      uint32_t crc; // CRC-32 of the section
+ *  } sections[section_count];
+ *
+ *  Each section is a complete index in the format above, starting at a page
+ *  boundary. Sections of unknown type are ignored.
+ */
+#define INDEX_CONTAINER_MAGIC 0xB007F45C
+#define INDEX_CONTAINER_VERSION_MAJOR 0x0001
+
+/* Compressed format:
+ *
+ * Any index above, standalone or as a container section, may also be stored
+ * compressed. It's cut in blocks compressed independently of each other, so a
+ * reader only needs to uncompress the ones a lookup goes through. Its magic
+ * ends with 'D' for deflate.
+ *
+ *  uint32_t magic = INDEX_COMPRESSED_MAGIC;
+ *  uint32_t version = INDEX_COMPRESSED_VERSION;
+ *  uint32_t compression; // INDEX_COMPRESSION_ZLIB
+ *  uint32_t block_size; // uncompressed, of every block but the last
+ *  uint32_t size; // of the uncompressed index
+ *  uint32_t block_offsets[block_count + 1];
+ *
+ *  where block_count is size / block_size, rounded up. Block i holds the
+ *  uncompressed index from i * block_size on, and is stored from
+ *  block_offsets[i] to block_offsets[i + 1], counting from the magic.
+ */
+#define INDEX_COMPRESSED_MAGIC 0xB007F45D
+#define INDEX_COMPRESSED_VERSION_MAJOR 0x0001
+#define INDEX_COMPRESSION_ZLIB 1
+
 /* Format of node offsets within index file */
 enum node_offset {
 	INDEX_NODE_FLAGS = 0xF0000000, /* Flags in high nibble */
@@ -234,11 +289,91 @@ static inline bool read_u32(FILE *in, uint32_t *l)
 	return read_u32s(in, l, 1);
 }
 
+/*
+ * Compressed indexes
+ */
+struct index_compressed {
+	const void *data; /* as stored, header included */
+	size_t data_size;
+	const void *block_offsets;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t size;
+};
+
+static inline uint32_t get_u32(const void *p)
+{
+	return be32toh(get_unaligned((const uint32_t *)p));
+}
+
+static bool index_is_compressed(const void *data, size_t size)
+{
+	return size >= sizeof(uint32_t) && get_u32(data) == INDEX_COMPRESSED_MAGIC;
+}
+
+static int index_compressed_init(struct index_compressed *c, const void *data,
+				  size_t data_size)
+{
+	const size_t hdr_size = 5 * sizeof(uint32_t);
+	const char *p = data;
+
+	if (data_size < hdr_size || get_u32(p) != INDEX_COMPRESSED_MAGIC ||
+	    get_u32(p + 4) >> 16 != INDEX_COMPRESSED_VERSION_MAJOR)
+		return -EINVAL;
+
+	if (get_u32(p + 8) != INDEX_COMPRESSION_ZLIB)
+		return -ENOTSUP;
+
+	c->block_size = get_u32(p + 12);
+	c->size = get_u32(p + 16);
+	if (c->block_size == 0 || c->size == 0)
+		return -EINVAL;
+
+	c->block_count = c->size / c->block_size + (c->size % c->block_size != 0);
+	if (((size_t)c->block_count + 1) * sizeof(uint32_t) > data_size - hdr_size)
+		return -EINVAL;
+
+	c->data = data;
+	c->data_size = data_size;
+	c->block_offsets = p + hdr_size;
+
+	return 0;
+}
+
+/*
+ * Guards the registry of mmap'ed indexes. It's also taken to resolve the codec
+ * of compressed indexes, see index_compressed_load().
+ */
+static pthread_mutex_t index_mm_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with index_mm_registry_lock held */
+static int index_compressed_load(void)
+{
+	/* index_compressed_init() only accepts zlib */
+	return kmod_zlib_load();
+}
+
+/* uncompress block @i, all of it, to @dst */
+static int index_compressed_read_block(const struct index_compressed *c, uint32_t i,
+				       void *dst)
+{
+	const char *offsets = c->block_offsets;
+	uint32_t start = get_u32(offsets + i * sizeof(uint32_t));
+	uint32_t end = get_u32(offsets + (i + 1) * sizeof(uint32_t));
+	size_t len = MIN(c->block_size, c->size - (size_t)i * c->block_size);
+
+	if (start > end || end > c->data_size)
+		return -EINVAL;
+
+	return kmod_zlib_uncompress((const char *)c->data + start, end - start, dst, len);
+}
+
 /*
  * Index file searching
  */
 struct index_file {
 	FILE *file;
+	void *buf; /* a compressed index, uncompressed */
 	uint32_t root_offset;
 	char *tmp;
 	size_t tmp_size;
@@ -340,17 +475,84 @@ static void index_close(struct index_node_f *node)
 	free(node);
 }
 
+/*
+ * This reader is for one-off lookups: rather than going through the blocks of
+ * a compressed index as needed, uncompress it all and read it from memory.
+ * @file is closed and replaced.
+ */
+static FILE *index_file_uncompress(FILE *file, void **pbuf)
+{
+	struct index_compressed c;
+	struct stat st;
+	void *data, *buf = NULL;
+	FILE *ret = NULL;
+	uint32_t i;
+	int err;
+
+	if (fstat(fileno(file), &st) < 0 || (uintmax_t)st.st_size > SIZE_MAX)
+		goto out;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (data == MAP_FAILED)
+		goto out;
+
+	if (index_compressed_init(&c, data, st.st_size) < 0)
+		goto unmap;
+
+	pthread_mutex_lock(&index_mm_registry_lock);
+	err = index_compressed_load();
+	pthread_mutex_unlock(&index_mm_registry_lock);
+	if (err < 0)
+		goto unmap;
+
+	buf = malloc(c.size);
+	if (buf == NULL)
+		goto unmap;
+
+	for (i = 0; i < c.block_count; i++) {
+		if (index_compressed_read_block(&c, i,
+						(char *)buf + (size_t)i * c.block_size) < 0)
+			goto unmap;
+	}
+
+	ret = fmemopen(buf, c.size, "r");
+
+unmap:
+	munmap(data, st.st_size);
+out:
+	fclose(file);
+	if (ret == NULL)
+		free(buf);
+	else
+		*pbuf = buf;
+
+	return ret;
+}
+
 struct index_file *index_file_open(const char *filename)
 {
 	FILE *file;
 	uint32_t magic, version;
 	struct index_file *new;
+	void *buf = NULL;
 
 	file = fopen(filename, "re");
 	if (!file)
 		return NULL;
 
-	if (!read_u32(file, &magic) || magic != INDEX_MAGIC)
+	if (!read_u32(file, &magic))
+		goto err;
+
+	if (magic == INDEX_COMPRESSED_MAGIC) {
+		file = index_file_uncompress(file, &buf);
+		if (file == NULL)
+			return NULL;
+
+		if (!read_u32(file, &magic))
+			goto err;
+	}
+
+	if (magic != INDEX_MAGIC)
 		goto err;
 
 	if (!read_u32(file, &version) || version >> 16 != INDEX_VERSION_MAJOR)
@@ -365,18 +567,21 @@ struct index_file *index_file_open(const char *filename)
 		free(new);
 		goto err;
 	}
+	new->buf = buf;
 	new->tmp = NULL;
 	new->tmp_size = 0;
 
 	return new;
 err:
 	fclose(file);
+	free(buf);
 	return NULL;
 }
 
 void index_file_close(struct index_file *idx)
 {
 	fclose(idx->file);
+	free(idx->buf);
 	free(idx->tmp);
 	free(idx);
 }
@@ -626,17 +831,90 @@ struct index_value *index_searchwild(struct index_file *in, const char *key)
  * Alternative implementation, using mmap to map all the file to memory when
  * starting
  */
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <unistd.h>
 
-struct index_mm {
-	const struct kmod_ctx *ctx;
+/*
+ * Mappings are shared by all the contexts in the process: a file, identified
+ * by its device, inode, modification time and size, is only mapped once and
+ * is kept around while any context holds a reference to an index in it. All
+ * the indexes of a modules.bin container share the same mapping.
+ */
+struct index_mm_file {
+	int refcount;
 	void *mm;
+	size_t size;
+};
+
+/*
+ * A compressed index is uncompressed into an anonymous mapping, one block at a
+ * time as lookups reach it. The blocks never reached read as zeros and take no
+ * memory.
+ */
+enum index_mm_block_state {
+	INDEX_MM_BLOCK_UNREAD = 0,
+	INDEX_MM_BLOCK_READ,
+	INDEX_MM_BLOCK_BAD,
+};
+
+struct index_mm_blocks {
+	struct index_compressed c;
+	pthread_mutex_t lock; /* taken to uncompress a block */
+	uint32_t bad_block; /* 1 + the last block found corrupted, until reported */
+	void *mm;
+	uint8_t state[]; /* enum index_mm_block_state, per block */
+};
+
+struct index_mm {
+	struct index_mm *next;
+	int refcount;
+	dev_t dev;
+	ino_t ino;
+	unsigned long long stamp;
+	struct index_mm_file *file;
+	size_t offset; /* of the index within the file */
+	const void *mm; /* the index, uncompressed if need be */
 	uint32_t root_offset;
 	size_t size;
+	struct index_mm_blocks *blocks; /* for a compressed index */
+	bool has_crc;
+	uint32_t crc;
 };
 
+static struct index_mm *index_mm_registry;
+
+static bool index_mm_is_file(const struct index_mm *idx, const struct stat *st)
+{
+	return idx->dev == st->st_dev && idx->ino == st->st_ino &&
+	       idx->stamp == stat_mstamp(st) && idx->file->size == (size_t)st->st_size;
+}
+
+/* must be called with index_mm_registry_lock held */
+static struct index_mm *index_mm_registry_find(const struct stat *st, size_t offset)
+{
+	struct index_mm *idx;
+
+	for (idx = index_mm_registry; idx != NULL; idx = idx->next) {
+		if (index_mm_is_file(idx, st) && idx->offset == offset)
+			return idx;
+	}
+
+	return NULL;
+}
+
+/* must be called with index_mm_registry_lock held */
+static void index_mm_registry_remove(struct index_mm *idx)
+{
+	struct index_mm **p;
+
+	for (p = &index_mm_registry; *p != NULL; p = &(*p)->next) {
+		if (*p == idx) {
+			*p = idx->next;
+			break;
+		}
+	}
+	idx->next = NULL;
+}
+
 struct index_mm_value {
 	uint32_t priority;
 	size_t len;
@@ -687,6 +965,119 @@ static inline void read_value_mm(const void **p, struct index_mm_value *v)
 	v->value = read_chars_mm(p, &v->len);
 }
 
+/*
+ * Make sure bytes [@start, @start + @len) of the index can be read, i.e. that
+ * the blocks they are in are uncompressed.
+ */
+static bool index_mm_load(const struct index_mm *idx, size_t start, size_t len)
+{
+	struct index_mm_blocks *b = idx->blocks;
+	size_t i, last;
+
+	if (start > idx->size || len > idx->size - start)
+		return false;
+
+	if (b == NULL || len == 0)
+		return true;
+
+	last = (start + len - 1) / b->c.block_size;
+	for (i = start / b->c.block_size; i <= last; i++) {
+		uint8_t state = __atomic_load_n(&b->state[i], __ATOMIC_ACQUIRE);
+
+		if (state == INDEX_MM_BLOCK_UNREAD) {
+			pthread_mutex_lock(&b->lock);
+			state = b->state[i];
+			if (state == INDEX_MM_BLOCK_UNREAD) {
+				void *dst = (char *)b->mm + i * b->c.block_size;
+
+				if (index_compressed_read_block(&b->c, i, dst) < 0) {
+					state = INDEX_MM_BLOCK_BAD;
+					__atomic_store_n(&b->bad_block, i + 1,
+							 __ATOMIC_RELAXED);
+				} else {
+					state = INDEX_MM_BLOCK_READ;
+				}
+				__atomic_store_n(&b->state[i], state, __ATOMIC_RELEASE);
+			}
+			pthread_mutex_unlock(&b->lock);
+		}
+
+		if (state != INDEX_MM_BLOCK_READ)
+			return false;
+	}
+
+	return true;
+}
+
+/* index_mm_load() the nul terminated string at *@pos and move past it */
+static bool index_mm_load_str(const struct index_mm *idx, size_t *pos)
+{
+	size_t block_size = idx->blocks->c.block_size;
+	size_t p = *pos;
+
+	while (p < idx->size) {
+		size_t end = MIN((p / block_size + 1) * block_size, idx->size);
+		size_t len;
+
+		if (!index_mm_load(idx, p, end - p))
+			return false;
+
+		len = strnlen((const char *)idx->mm + p, end - p);
+		p += len;
+		if (p < end) {
+			*pos = p + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* index_mm_load() all of the node at @offset, which may span several blocks */
+static bool index_mm_load_node(const struct index_mm *idx, uint32_t offset)
+{
+	size_t pos = offset & INDEX_NODE_MASK;
+
+	if ((offset & INDEX_NODE_PREFIX) && !index_mm_load_str(idx, &pos))
+		return false;
+
+	if (offset & INDEX_NODE_CHILDS) {
+		const uint8_t *range;
+		size_t child_count;
+
+		if (!index_mm_load(idx, pos, 2))
+			return false;
+		range = (const uint8_t *)idx->mm + pos;
+		if (range[0] > range[1])
+			return false;
+		pos += 2;
+
+		child_count = range[1] - range[0] + 1;
+		if (!index_mm_load(idx, pos, sizeof(uint32_t) * child_count))
+			return false;
+		pos += sizeof(uint32_t) * child_count;
+	}
+
+	if (offset & INDEX_NODE_VALUES) {
+		uint32_t value_count;
+
+		if (!index_mm_load(idx, pos, sizeof(uint32_t)))
+			return false;
+		value_count = get_u32((const char *)idx->mm + pos);
+		pos += sizeof(uint32_t);
+
+		while (value_count--) {
+			if (!index_mm_load(idx, pos, sizeof(uint32_t)))
+				return false;
+			pos += sizeof(uint32_t);
+			if (!index_mm_load_str(idx, &pos))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 /* reads node into given node struct and returns its address on success or NULL on error. */
 static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 						uint32_t offset,
@@ -697,6 +1088,9 @@ static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 	if ((offset & INDEX_NODE_MASK) == 0 || (offset & INDEX_NODE_MASK) >= idx->size)
 		return NULL;
 
+	if (idx->blocks != NULL && !index_mm_load_node(idx, offset))
+		return NULL;
+
 	p = (const char *)idx->mm + (offset & INDEX_NODE_MASK);
 
 	if (offset & INDEX_NODE_PREFIX) {
@@ -739,22 +1133,135 @@ static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 	return node;
 }
 
-int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
-		  unsigned long long *stamp, struct index_mm **pidx)
+/*
+ * Map @fd, or reuse an existing mapping of the same file. Returns it with a
+ * reference taken. Must be called with index_mm_registry_lock held.
+ */
+static struct index_mm_file *index_mm_file_get(const struct kmod_ctx *ctx, int fd,
+					       const struct stat *st)
+{
+	struct index_mm_file *file;
+	struct index_mm *idx;
+
+	for (idx = index_mm_registry; idx != NULL; idx = idx->next) {
+		if (index_mm_is_file(idx, st)) {
+			idx->file->refcount++;
+			return idx->file;
+		}
+	}
+
+	file = malloc(sizeof(*file));
+	if (file == NULL) {
+		ERR(ctx, "malloc: %m\n");
+		return NULL;
+	}
+
+	file->mm = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file->mm == MAP_FAILED) {
+		ERR(ctx, "mmap(NULL, %" PRIu64 ", PROT_READ, MAP_PRIVATE, %d, 0): %m\n",
+		    (uint64_t)st->st_size, fd);
+		free(file);
+		return NULL;
+	}
+
+	file->refcount = 1;
+	file->size = st->st_size;
+
+	return file;
+}
+
+/* must be called with index_mm_registry_lock held */
+static void index_mm_file_put(struct index_mm_file *file)
+{
+	if (--file->refcount > 0)
+		return;
+
+	munmap(file->mm, file->size);
+	free(file);
+}
+
+/* must be called with index_mm_registry_lock held */
+static int index_mm_blocks_new(const struct kmod_ctx *ctx, const void *data, size_t size,
+			       struct index_mm_blocks **pblocks)
+{
+	struct index_compressed c;
+	struct index_mm_blocks *b;
+	int err;
+
+	err = index_compressed_init(&c, data, size);
+	if (err < 0) {
+		ERR(ctx, "invalid compressed index: %s\n", strerror(-err));
+		return err;
+	}
+
+	err = index_compressed_load();
+	if (err < 0) {
+		ERR(ctx, "zlib: can't load and resolve symbols (%s)\n", strerror(-err));
+		return err;
+	}
+
+	b = calloc(1, sizeof(*b) + c.block_count);
+	if (b == NULL) {
+		ERR(ctx, "malloc: %m\n");
+		return -ENOMEM;
+	}
+
+	b->mm = mmap(NULL, c.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		     -1, 0);
+	if (b->mm == MAP_FAILED) {
+		ERR(ctx, "mmap(NULL, %" PRIu32 ", PROT_READ|PROT_WRITE, "
+			 "MAP_PRIVATE|MAP_ANONYMOUS, -1, 0): %m\n",
+		    c.size);
+		free(b);
+		return -ENOMEM;
+	}
+
+	b->c = c;
+	pthread_mutex_init(&b->lock, NULL);
+	*pblocks = b;
+
+	return 0;
+}
+
+static void index_mm_blocks_free(struct index_mm_blocks *b)
+{
+	if (b == NULL)
+		return;
+
+	munmap(b->mm, b->c.size);
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+}
+
+/* must be called with index_mm_registry_lock held */
+static void index_mm_put(struct index_mm *idx)
+{
+	if (--idx->refcount > 0)
+		return;
+
+	index_mm_registry_remove(idx);
+	index_mm_file_put(idx->file);
+	index_mm_blocks_free(idx->blocks);
+	free(idx);
+}
+
+/*
+ * Create the index stored at @offset of @file and add it to the registry.
+ * Must be called with index_mm_registry_lock held.
+ */
+static int index_mm_new(const struct kmod_ctx *ctx, const struct stat *st,
+			struct index_mm_file *file, size_t offset, size_t size,
+			struct index_mm **pidx)
 {
-	int fd, err;
-	struct stat st;
 	struct index_mm *idx;
 	struct {
 		uint32_t magic;
 		uint32_t version;
 		uint32_t root_offset;
+		uint32_t hot_end;
 	} hdr;
 	const void *p;
-
-	assert(pidx != NULL);
-
-	DBG(ctx, "file=%s\n", filename);
+	int err = -EINVAL;
 
 	idx = malloc(sizeof(*idx));
 	if (idx == NULL) {
@@ -762,71 +1269,339 @@ int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 		return -ENOMEM;
 	}
 
-	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
-		err = -errno;
-		DBG(ctx, "open(%s, O_RDONLY|O_CLOEXEC): %m\n", filename);
-		goto fail_open;
-	}
-
-	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hdr)) {
+	idx->refcount = 1;
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->stamp = stat_mstamp(st);
+	idx->file = file;
+	idx->offset = offset;
+	idx->mm = (const char *)file->mm + offset;
+	idx->size = size;
+	idx->blocks = NULL;
+	idx->has_crc = false;
+	idx->crc = 0;
+
+	if (index_is_compressed(idx->mm, size)) {
+		err = index_mm_blocks_new(ctx, idx->mm, size, &idx->blocks);
+		if (err < 0)
+			goto fail;
+		idx->mm = idx->blocks->mm;
+		idx->size = idx->blocks->c.size;
 		err = -EINVAL;
-		goto fail_nommap;
 	}
 
-	if ((uintmax_t)st.st_size > SIZE_MAX) {
-		err = -ENOMEM;
-		goto fail_nommap;
+	if (!index_mm_load(idx, 0, MIN(idx->size, 4 * sizeof(uint32_t)))) {
+		if (idx->blocks != NULL)
+			ERR(ctx, "could not uncompress index\n");
+		goto fail;
 	}
 
-	idx->mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (idx->mm == MAP_FAILED) {
-		err = -errno;
-		ERR(ctx, "mmap(NULL, %" PRIu64 ", PROT_READ, MAP_PRIVATE, %d, 0): %m\n",
-		    (uint64_t)st.st_size, fd);
-		goto fail_nommap;
-	}
+	if (idx->size < 3 * sizeof(uint32_t))
+		goto fail;
 
 	p = idx->mm;
 	hdr.magic = read_u32_mm(&p);
 	hdr.version = read_u32_mm(&p);
 	hdr.root_offset = read_u32_mm(&p);
+	hdr.hot_end = 0;
 
 	if (hdr.magic != INDEX_MAGIC) {
 		ERR(ctx, "magic check fail: %x instead of %x\n", hdr.magic, INDEX_MAGIC);
-		err = -EINVAL;
 		goto fail;
 	}
 
 	if (hdr.version >> 16 != INDEX_VERSION_MAJOR) {
 		ERR(ctx, "major version check fail: %u instead of %u\n",
 		    hdr.version >> 16, INDEX_VERSION_MAJOR);
-		err = -EINVAL;
 		goto fail;
 	}
 
+	if ((hdr.version & 0xffff) >= 2) {
+		if (idx->size < 4 * sizeof(uint32_t))
+			goto fail;
+		hdr.hot_end = read_u32_mm(&p);
+	}
+
 	idx->root_offset = hdr.root_offset;
-	idx->size = st.st_size;
-	idx->ctx = ctx;
+
+	/*
+	 * Let the kernel read ahead the pages every lookup goes through; the
+	 * rest is faulted in on demand. A compressed index is uncompressed as
+	 * lookups go anyway.
+	 */
+	if (hdr.hot_end > 0 && idx->blocks == NULL) {
+		uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+		uintptr_t start = (uintptr_t)idx->mm & ~page_mask;
+		size_t len = MIN((size_t)hdr.hot_end, size);
+
+		len += (uintptr_t)idx->mm - start;
+		if (madvise((void *)start, len, MADV_WILLNEED) < 0)
+			DBG(ctx, "madvise(MADV_WILLNEED): %m\n");
+	}
+
+	file->refcount++;
+	idx->next = index_mm_registry;
+	index_mm_registry = idx;
+	*pidx = idx;
+
+	return 0;
+
+fail:
+	index_mm_blocks_free(idx->blocks);
+	free(idx);
+	return err;
+}
+
+static int index_mm_open_fd(const struct kmod_ctx *ctx, const char *filename,
+			    struct stat *st)
+{
+	int fd;
+
+	DBG(ctx, "file=%s\n", filename);
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+		int err = -errno;
+		DBG(ctx, "open(%s, O_RDONLY|O_CLOEXEC): %m\n", filename);
+		return err;
+	}
+
+	if (fstat(fd, st) < 0 || st->st_size < (off_t)(3 * sizeof(uint32_t))) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	if ((uintmax_t)st->st_size > SIZE_MAX) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	return fd;
+}
+
+int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
+		  unsigned long long *stamp, struct index_mm **pidx)
+{
+	struct index_mm_file *file;
+	struct index_mm *idx;
+	struct stat st;
+	int fd, err = 0;
+
+	assert(pidx != NULL);
+
+	fd = index_mm_open_fd(ctx, filename, &st);
+	if (fd < 0)
+		return fd;
+
+	pthread_mutex_lock(&index_mm_registry_lock);
+
+	idx = index_mm_registry_find(&st, 0);
+	if (idx != NULL) {
+		DBG(ctx, "reusing mapping of %s\n", filename);
+		idx->refcount++;
+		goto done;
+	}
+
+	file = index_mm_file_get(ctx, fd, &st);
+	if (file == NULL) {
+		err = -ENOMEM;
+		goto done;
+	}
+
+	err = index_mm_new(ctx, &st, file, 0, st.st_size, &idx);
+	index_mm_file_put(file);
+
+done:
+	pthread_mutex_unlock(&index_mm_registry_lock);
 	close(fd);
 
-	*stamp = stat_mstamp(&st);
+	if (err < 0)
+		return err;
+
+	*stamp = idx->stamp;
 	*pidx = idx;
 
 	return 0;
+}
+
+int index_mm_open_container(const struct kmod_ctx *ctx, const char *filename,
+			    unsigned long long *stamp, struct index_mm **pidx,
+			    size_t n_indexes)
+{
+	struct index_mm_file *file;
+	struct stat st;
+	uint32_t magic, version, n_sections, crc;
+	const void *p, *table;
+	size_t i;
+	int fd, err = 0;
+
+	fd = index_mm_open_fd(ctx, filename, &st);
+	if (fd < 0)
+		return fd;
+
+	pthread_mutex_lock(&index_mm_registry_lock);
+
+	file = index_mm_file_get(ctx, fd, &st);
+	if (file == NULL) {
+		err = -ENOMEM;
+		goto done;
+	}
+
+	if (file->size < 4 * sizeof(uint32_t)) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	p = file->mm;
+	magic = read_u32_mm(&p);
+	version = read_u32_mm(&p);
+	n_sections = read_u32_mm(&p);
+	crc = read_u32_mm(&p);
+	table = p;
+
+	if (magic != INDEX_CONTAINER_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", magic,
+		    INDEX_CONTAINER_MAGIC);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (version >> 16 != INDEX_CONTAINER_VERSION_MAJOR) {
+		ERR(ctx, "major version check fail: %u instead of %u\n", version >> 16,
+		    INDEX_CONTAINER_VERSION_MAJOR);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (n_sections > (file->size - 4 * sizeof(uint32_t)) / (4 * sizeof(uint32_t)) ||
+	    crc32_update(0, table, n_sections * 4 * sizeof(uint32_t)) != crc) {
+		ERR(ctx, "corrupted section table in %s\n", filename);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	for (i = 0; i < n_sections; i++) {
+		uint32_t type, offset, size;
+		struct index_mm *idx;
+
+		type = read_u32_mm(&p);
+		offset = read_u32_mm(&p);
+		size = read_u32_mm(&p);
+		crc = read_u32_mm(&p);
+
+		if (type >= n_indexes || pidx[type] != NULL)
+			continue;
+
+		if (offset > file->size || size > file->size - offset) {
+			ERR(ctx, "section %u out of bounds in %s\n", type, filename);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		idx = index_mm_registry_find(&st, offset);
+		if (idx != NULL) {
+			idx->refcount++;
+		} else {
+			err = index_mm_new(ctx, &st, file, offset, size, &idx);
+			if (err < 0)
+				goto fail;
+			idx->has_crc = true;
+			idx->crc = crc;
+		}
+
+		pidx[type] = idx;
+	}
+
+	*stamp = stat_mstamp(&st);
 
 fail:
-	munmap(idx->mm, st.st_size);
-fail_nommap:
+	if (err < 0) {
+		for (i = 0; i < n_indexes; i++) {
+			if (pidx[i] != NULL)
+				index_mm_put(pidx[i]);
+			pidx[i] = NULL;
+		}
+	}
+	index_mm_file_put(file);
+done:
+	pthread_mutex_unlock(&index_mm_registry_lock);
 	close(fd);
-fail_open:
-	free(idx);
+
 	return err;
 }
 
 void index_mm_close(struct index_mm *idx)
 {
-	munmap(idx->mm, idx->size);
-	free(idx);
+	pthread_mutex_lock(&index_mm_registry_lock);
+	index_mm_put(idx);
+	pthread_mutex_unlock(&index_mm_registry_lock);
+}
+
+void index_mm_invalidate(struct index_mm *idx)
+{
+	pthread_mutex_lock(&index_mm_registry_lock);
+	index_mm_registry_remove(idx);
+	pthread_mutex_unlock(&index_mm_registry_lock);
+}
+
+int index_mm_verify(const struct index_mm *idx)
+{
+	const void *data = (const char *)idx->file->mm + idx->offset;
+	size_t size = idx->blocks != NULL ? idx->blocks->c.data_size : idx->size;
+
+	if (idx->has_crc && crc32_update(0, data, size) != idx->crc)
+		return -EBADMSG;
+
+	if (!index_mm_load(idx, 0, idx->size))
+		return -EBADMSG;
+
+	return 0;
+}
+
+/*
+ * Return a block of @idx found to be corrupted since the last call, or -1 if
+ * there's none, so that the caller logs each of them once
+ */
+long index_mm_get_bad_block(const struct index_mm *idx)
+{
+	if (idx->blocks == NULL)
+		return -1;
+
+	return (long)__atomic_exchange_n(&idx->blocks->bad_block, 0, __ATOMIC_RELAXED) - 1;
+}
+
+/*
+ * Check whether the container section @idx was written from the same index as
+ * the standalone file @filename, using the CRC-32 recorded in the section table
+ */
+bool index_mm_matches_file(const struct index_mm *idx, const char *filename)
+{
+	size_t size = idx->blocks != NULL ? idx->blocks->c.data_size : idx->size;
+	struct stat st;
+	bool matches;
+	void *mm;
+	int fd;
+
+	if (!idx->has_crc)
+		return false;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || (uintmax_t)st.st_size != size) {
+		close(fd);
+		return false;
+	}
+
+	mm = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mm == MAP_FAILED)
+		return false;
+
+	matches = crc32_update(0, mm, size) == idx->crc;
+	munmap(mm, size);
+
+	return matches;
 }
 
 static struct index_mm_node *index_mm_readroot(const struct index_mm *idx,
@@ -28,7 +28,14 @@ void index_values_free(struct index_value *values);
 struct index_mm;
 int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 		  unsigned long long *stamp, struct index_mm **pidx);
+int index_mm_open_container(const struct kmod_ctx *ctx, const char *filename,
+			    unsigned long long *stamp, struct index_mm **pidx,
+			    size_t n_indexes);
 void index_mm_close(struct index_mm *index);
+void index_mm_invalidate(struct index_mm *index);
+int index_mm_verify(const struct index_mm *idx);
+long index_mm_get_bad_block(const struct index_mm *idx);
+bool index_mm_matches_file(const struct index_mm *idx, const char *filename);
 char *index_mm_search(const struct index_mm *idx, const char *key);
 struct index_value *index_mm_searchwild(const struct index_mm *idx, const char *key);
 void index_mm_dump(const struct index_mm *idx, int fd, bool alias_prefix);
@@ -12,6 +12,7 @@ struct kmod_file {
 	enum kmod_file_compression_type compression;
 	off_t size;
 	void *memory;
+	bool sparse; /* memory only has the ranges read by kmod_elf_read_sparse() */
 	int (*load)(struct kmod_file *file);
 	const struct kmod_ctx *ctx;
 };
@@ -27,11 +28,40 @@ static inline int kmod_file_load_xz(_maybe_unused_ struct kmod_file *file)
 
 #if ENABLE_ZLIB
 int kmod_file_load_zlib(struct kmod_file *file);
+/*
+ * One-shot zlib (de)compression of a buffer. The compressed buffer is
+ * allocated and returned in @dst; when uncompressing, @dst_size has to be the
+ * exact size of the result.
+ *
+ * kmod_zlib_load() resolves the zlib symbols they use and must have succeeded
+ * before. It isn't thread-safe, so it's up to the caller to serialize it.
+ */
+int kmod_zlib_load(void);
+int kmod_zlib_compress(const void *src, size_t src_size, void **dst, size_t *dst_size);
+int kmod_zlib_uncompress(const void *src, size_t src_size, void *dst, size_t dst_size);
 #else
 static inline int kmod_file_load_zlib(_maybe_unused_ struct kmod_file *file)
 {
 	return -ENOSYS;
 }
+static inline int kmod_zlib_load(void)
+{
+	return -ENOSYS;
+}
+static inline int kmod_zlib_compress(_maybe_unused_ const void *src,
+				     _maybe_unused_ size_t src_size,
+				     _maybe_unused_ void **dst,
+				     _maybe_unused_ size_t *dst_size)
+{
+	return -ENOSYS;
+}
+static inline int kmod_zlib_uncompress(_maybe_unused_ const void *src,
+				       _maybe_unused_ size_t src_size,
+				       _maybe_unused_ void *dst,
+				       _maybe_unused_ size_t dst_size)
+{
+	return -ENOSYS;
+}
 #endif
 
 #if ENABLE_ZSTD
@@ -68,6 +68,13 @@ _must_check_ struct kmod_list *kmod_list_append_list(struct kmod_list *list1, st
 	}
 
 /* libkmod.c */
+/*
+ * With depmod --atomic the indexes live in a KMOD_INDEX_GENERATION-prefixed
+ * directory and KMOD_INDEX_CURRENT is a symlink to the one currently published
+ */
+#define KMOD_INDEX_CURRENT "modules.current"
+#define KMOD_INDEX_GENERATION "modules.gen."
+
 _nonnull_all_ int kmod_lookup_alias_from_config(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ int kmod_lookup_alias_from_symbols_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
@@ -76,11 +83,20 @@ _nonnull_all_ int kmod_lookup_alias_from_kernel_builtin_file(struct kmod_ctx *ct
 _nonnull_all_ int kmod_lookup_alias_from_builtin_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ bool kmod_lookup_alias_is_builtin(struct kmod_ctx *ctx, const char *name);
 _nonnull_all_ int kmod_lookup_alias_from_commands(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
-_nonnull_(1) void kmod_set_modules_visited(struct kmod_ctx *ctx, bool visited);
-_nonnull_(1) void kmod_set_modules_required(struct kmod_ctx *ctx, bool required);
 
 _nonnull_all_ char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name);
 
+_nonnull_all_ bool kmod_stats_enabled(const struct kmod_ctx *ctx);
+_nonnull_all_ void kmod_stats_add(struct kmod_ctx *ctx, enum kmod_lookup_source source, bool hit, unsigned long long usec);
+
+_nonnull_all_ void kmod_lock(struct kmod_ctx *ctx);
+_nonnull_all_ void kmod_unlock(struct kmod_ctx *ctx);
+
+_nonnull_all_ bool kmod_negative_lookups_find(struct kmod_ctx *ctx, const char *alias);
+_nonnull_all_ void kmod_negative_lookups_add(struct kmod_ctx *ctx, const char *alias);
+
+_nonnull_all_ void kmod_pool_lock(struct kmod_ctx *ctx, const char *key);
+_nonnull_all_ void kmod_pool_unlock(struct kmod_ctx *ctx, const char *key);
 _nonnull_all_ struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx, const char *key);
 _nonnull_all_ int kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key);
 _nonnull_all_ void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key);
@@ -129,35 +145,50 @@ int kmod_module_new_from_alias(struct kmod_ctx *ctx, const char *alias, const ch
 _nonnull_all_ void kmod_module_parse_depline(struct kmod_module *mod, char *line);
 _nonnull_(1) void kmod_module_set_install_commands(struct kmod_module *mod, const char *cmd);
 _nonnull_(1) void kmod_module_set_remove_commands(struct kmod_module *mod, const char *cmd);
-_nonnull_(1)void kmod_module_set_visited(struct kmod_module *mod, bool visited);
 _nonnull_(1) void kmod_module_set_builtin(struct kmod_module *mod, bool builtin);
-_nonnull_(1) void kmod_module_set_required(struct kmod_module *mod, bool required);
 _nonnull_all_ bool kmod_module_is_builtin(struct kmod_module *mod);
 
+struct kmod_module_extract {
+	unsigned int info_keys;
+	int (*info)(const char *key, size_t keylen, const char *value, size_t valuelen, void *data);
+	int (*symbol)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data);
+	int (*dependency_symbol)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data);
+	void *data;
+	int info_ret;
+	int symbol_ret;
+	int dependency_symbol_ret;
+};
+_must_check_ _nonnull_all_ int kmod_module_extract(const struct kmod_module *mod, struct kmod_module_extract *ex);
+
 /* libkmod-file.c */
 struct kmod_file;
+struct kmod_file_range {
+	uint64_t offset;
+	uint64_t size;
+};
 _must_check_ _nonnull_all_ int kmod_file_open(const struct kmod_ctx *ctx, const char *filename, struct kmod_file **file);
 _must_check_ _nonnull_all_ int kmod_file_get_contents(const struct kmod_file *file, const void **contents, off_t *size);
+_must_check_ _nonnull_all_ int kmod_file_get_sparse_contents(const struct kmod_file *file, const void **contents, off_t *size);
+_must_check_ _nonnull_all_ int kmod_file_get_writable_contents(const struct kmod_file *file, void **contents, off_t *size);
+_nonnull_all_ void kmod_file_put_writable_contents(const struct kmod_file *file, void *contents);
 _must_check_ _nonnull_all_ enum kmod_file_compression_type kmod_file_get_compression(const struct kmod_file *file);
 _must_check_ _nonnull_all_ int kmod_file_get_fd(const struct kmod_file *file);
+_must_check_ _nonnull_all_ bool kmod_file_is_sparse(const struct kmod_file *file);
+_must_check_ _nonnull_(1) int kmod_file_read_ranges(const struct kmod_file *file, const struct kmod_file_range *ranges, size_t count);
 _nonnull_all_ void kmod_file_unref(struct kmod_file *file);
 
 /* libkmod-elf.c */
-struct kmod_modversion {
-	uint64_t crc;
-	enum kmod_symbol_bind bind;
-	const char *symbol;
-};
-
 struct kmod_elf;
-_must_check_ _nonnull_all_ int kmod_elf_new(const void *memory, off_t size, struct kmod_elf **elf);
+_must_check_ _nonnull_all_ int kmod_elf_new(const void *memory, off_t size, bool sparse, struct kmod_elf **elf);
 _nonnull_all_ void kmod_elf_unref(struct kmod_elf *elf);
-_must_check_ _nonnull_all_ int kmod_elf_get_modinfo_strings(const struct kmod_elf *elf, char ***array);
-_must_check_ _nonnull_all_ int kmod_elf_get_modversions(const struct kmod_elf *elf, struct kmod_modversion **array);
-_must_check_ _nonnull_all_ int kmod_elf_get_symbols(const struct kmod_elf *elf, struct kmod_modversion **array);
-_must_check_ _nonnull_all_ int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf, struct kmod_modversion **array);
+_nonnull_(1, 2) int kmod_elf_foreach_modinfo_string(const struct kmod_elf *elf, int (*cb)(const char *str, size_t len, size_t keylen, void *data), void *data);
+_nonnull_(1, 2) int kmod_elf_foreach_modversion(const struct kmod_elf *elf, int (*cb)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data), void *data);
+_nonnull_(1, 2) int kmod_elf_foreach_symbol(const struct kmod_elf *elf, int (*cb)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data), void *data);
+_nonnull_(1, 2) int kmod_elf_foreach_dependency_symbol(const struct kmod_elf *elf, int (*cb)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data), void *data);
+_nonnull_(1, 5) int kmod_elf_foreach_symbols(const struct kmod_elf *elf, int (*exported)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data), int (*required)(const char *symbol, size_t len, uint64_t crc, enum kmod_symbol_bind bind, void *data), void *data, int *required_ret);
 _must_check_ _nonnull_all_ int kmod_elf_get_build_id(const struct kmod_elf *elf, const void **hash, size_t *hash_len);
-_must_check_ _nonnull_all_ int kmod_elf_strip(const struct kmod_elf *elf, unsigned int flags, const void **stripped);
+_must_check_ _nonnull_all_ int kmod_elf_read_sparse(const struct kmod_file *file, const void *memory, uint64_t size);
+_must_check_ _nonnull_all_ int kmod_elf_strip(const struct kmod_elf *elf, unsigned int flags, void *changed);
 
 /*
  * Debug mock lib need to find section ".gnu.linkonce.this_module" in order to
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <shared/hash.h>
 #include <shared/strbuf.h>
 #include <shared/util.h>
 
@@ -47,11 +48,18 @@ struct kmod_module {
 	struct kmod_file *file;
 	struct kmod_elf *elf;
 	int refcount;
+
+	/*
+	 * Lazily initialized fields are filled once, under the context lock,
+	 * and then published by setting their flag with module_init_publish().
+	 * Once module_init_done() returns true they can be read without
+	 * taking the lock.
+	 */
 	struct {
-		bool dep : 1;
-		bool options : 1;
-		bool install_commands : 1;
-		bool remove_commands : 1;
+		bool dep;
+		bool options;
+		bool install_commands;
+		bool remove_commands;
 	} init;
 
 	/*
@@ -60,26 +68,17 @@ struct kmod_module {
 	 * about it, i.e. the module was created from builtin lookup.
 	 */
 	enum kmod_module_builtin builtin;
+};
 
-	/*
-	 * private field used by kmod_module_get_probe_list() to detect
-	 * dependency loops
-	 */
-	bool visited : 1;
-
-	/*
-	 * set by kmod_module_get_probe_list: indicates for probe_insert()
-	 * whether the module's command and softdep should be ignored
-	 */
-	bool ignorecmd : 1;
+static inline bool module_init_done(const bool *init)
+{
+	return __atomic_load_n(init, __ATOMIC_ACQUIRE);
+}
 
-	/*
-	 * set by kmod_module_get_probe_list: indicates whether this is the
-	 * module the user asked for or its dependency, or whether this
-	 * is a softdep only
-	 */
-	bool required : 1;
-};
+static inline void module_init_publish(bool *init)
+{
+	__atomic_store_n(init, true, __ATOMIC_RELEASE);
+}
 
 static inline const char *path_join(const char *path, size_t prefixlen, char buf[PATH_MAX])
 {
@@ -96,6 +95,26 @@ static inline const char *path_join(const char *path, size_t prefixlen, char buf
 	return buf;
 }
 
+/* open mod->file, with the context lock held */
+static int __kmod_module_open_file(struct kmod_module *mod, const char *path)
+{
+	struct kmod_file *file;
+	int err;
+
+	if (mod->file != NULL)
+		return 0;
+
+	err = kmod_file_open(mod->ctx, path, &file);
+	if (err)
+		return err;
+
+	__atomic_store_n(&mod->file, file, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int kmod_module_load_elf(const struct kmod_module *mod);
+
 static inline bool module_is_inkernel(struct kmod_module *mod)
 {
 	int state = kmod_module_get_initstate(mod);
@@ -106,7 +125,7 @@ static inline bool module_is_inkernel(struct kmod_module *mod)
 	return false;
 }
 
-void kmod_module_parse_depline(struct kmod_module *mod, char *line)
+static void __kmod_module_parse_depline(struct kmod_module *mod, char *line)
 {
 	struct kmod_ctx *ctx = mod->ctx;
 	struct kmod_list *list = NULL;
@@ -116,20 +135,19 @@ void kmod_module_parse_depline(struct kmod_module *mod, char *line)
 	size_t n = 0;
 	size_t dirnamelen;
 
-	if (mod->init.dep)
+	if (module_init_done(&mod->init.dep))
 		return;
 	assert(mod->dep == NULL);
-	mod->init.dep = true;
 
 	p = strchr(line, ':');
 	if (p == NULL)
-		return;
+		goto done;
 
 	*p = '\0';
 	dirname = kmod_get_dirname(mod->ctx);
 	dirnamelen = strlen(dirname);
 	if (dirnamelen + 2 >= sizeof(buf))
-		return;
+		goto done;
 
 	memcpy(buf, dirname, dirnamelen);
 	buf[dirnamelen] = '/';
@@ -138,11 +156,14 @@ void kmod_module_parse_depline(struct kmod_module *mod, char *line)
 
 	if (mod->path == NULL) {
 		const char *str = path_join(line, dirnamelen, buf);
+		char *path;
+
 		if (str == NULL)
-			return;
-		mod->path = strdup(str);
-		if (mod->path == NULL)
-			return;
+			goto done;
+		path = strdup(str);
+		if (path == NULL)
+			goto done;
+		__atomic_store_n(&mod->path, path, __ATOMIC_RELEASE);
 	}
 
 	p++;
@@ -179,36 +200,47 @@ void kmod_module_parse_depline(struct kmod_module *mod, char *line)
 	DBG(ctx, "%zu dependencies for %s\n", n, mod->name);
 
 	mod->dep = list;
+done:
+	module_init_publish(&mod->init.dep);
 	return;
 
 fail:
 	kmod_module_unref_list(list);
-	mod->init.dep = false;
 }
 
-void kmod_module_set_visited(struct kmod_module *mod, bool visited)
+void kmod_module_parse_depline(struct kmod_module *mod, char *line)
 {
-	mod->visited = visited;
-}
+	if (module_init_done(&mod->init.dep))
+		return;
 
-void kmod_module_set_builtin(struct kmod_module *mod, bool builtin)
-{
-	mod->builtin = builtin ? KMOD_MODULE_BUILTIN_YES : KMOD_MODULE_BUILTIN_NO;
+	kmod_lock(mod->ctx);
+	__kmod_module_parse_depline(mod, line);
+	kmod_unlock(mod->ctx);
 }
 
-void kmod_module_set_required(struct kmod_module *mod, bool required)
+void kmod_module_set_builtin(struct kmod_module *mod, bool builtin)
 {
-	mod->required = required;
+	__atomic_store_n(&mod->builtin,
+			 builtin ? KMOD_MODULE_BUILTIN_YES : KMOD_MODULE_BUILTIN_NO,
+			 __ATOMIC_RELEASE);
 }
 
 bool kmod_module_is_builtin(struct kmod_module *mod)
 {
-	if (mod->builtin == KMOD_MODULE_BUILTIN_UNKNOWN) {
-		kmod_module_set_builtin(mod, kmod_lookup_alias_is_builtin(mod->ctx,
-									  mod->name));
+	enum kmod_module_builtin builtin;
+
+	builtin = __atomic_load_n(&mod->builtin, __ATOMIC_ACQUIRE);
+	if (builtin == KMOD_MODULE_BUILTIN_UNKNOWN) {
+		kmod_lock(mod->ctx);
+		if (mod->builtin == KMOD_MODULE_BUILTIN_UNKNOWN) {
+			kmod_module_set_builtin(
+				mod, kmod_lookup_alias_is_builtin(mod->ctx, mod->name));
+		}
+		builtin = mod->builtin;
+		kmod_unlock(mod->ctx);
 	}
 
-	return mod->builtin == KMOD_MODULE_BUILTIN_YES;
+	return builtin == KMOD_MODULE_BUILTIN_YES;
 }
 /*
  * Memory layout with alias:
@@ -241,12 +273,14 @@ static int kmod_module_new(struct kmod_ctx *ctx, const char *key,
 {
 	struct kmod_module *m;
 	size_t keylen;
-	int err;
+	int err = 0;
+
+	kmod_pool_lock(ctx, key);
 
 	m = kmod_pool_get_module(ctx, key);
 	if (m != NULL) {
 		*mod = kmod_module_ref(m);
-		return 0;
+		goto out;
 	}
 
 	if (alias == NULL)
@@ -255,8 +289,10 @@ static int kmod_module_new(struct kmod_ctx *ctx, const char *key,
 		keylen = namelen + aliaslen + 1;
 
 	m = malloc(sizeof(*m) + (alias == NULL ? 1 : 2) * (keylen + 1));
-	if (m == NULL)
-		return -ENOMEM;
+	if (m == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
 
 	memset(m, 0, sizeof(*m));
 
@@ -276,12 +312,15 @@ static int kmod_module_new(struct kmod_ctx *ctx, const char *key,
 	m->refcount = 1;
 	err = kmod_pool_add_module(ctx, m, m->hashkey);
 	if (err < 0) {
+		kmod_unref(ctx);
 		free(m);
-		return err;
+		goto out;
 	}
 	*mod = m;
 
-	return 0;
+out:
+	kmod_pool_unlock(ctx, key);
+	return err;
 }
 
 KMOD_EXPORT int kmod_module_new_from_name(struct kmod_ctx *ctx, const char *name,
@@ -353,20 +392,23 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx, const char *path
 		free(abspath);
 		return err;
 	}
+	kmod_lock(ctx);
 	if (m->path == NULL)
-		m->path = abspath;
+		__atomic_store_n(&m->path, abspath, __ATOMIC_RELEASE);
 	else if (streq(m->path, abspath))
 		free(abspath);
 	else {
-		kmod_module_unref(m);
 		ERR(ctx,
 		    "kmod_module '%s' already exists with different path: new-path='%s' old-path='%s'\n",
 		    name, abspath, m->path);
+		kmod_unlock(ctx);
+		kmod_module_unref(m);
 		free(abspath);
 		return -EEXIST;
 	}
 
-	m->builtin = KMOD_MODULE_BUILTIN_NO;
+	kmod_module_set_builtin(m, false);
+	kmod_unlock(ctx);
 	*mod = m;
 
 	return 0;
@@ -377,12 +419,20 @@ KMOD_EXPORT struct kmod_module *kmod_module_unref(struct kmod_module *mod)
 	if (mod == NULL)
 		return NULL;
 
-	if (--mod->refcount > 0)
+	/*
+	 * Hold the pool lock so a concurrent lookup can't take a new reference
+	 * to a module that is about to be released
+	 */
+	kmod_pool_lock(mod->ctx, mod->hashkey);
+	if (__atomic_sub_fetch(&mod->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+		kmod_pool_unlock(mod->ctx, mod->hashkey);
 		return mod;
+	}
 
 	DBG(mod->ctx, "kmod_module %p released\n", mod);
 
 	kmod_pool_del_module(mod->ctx, mod, mod->hashkey);
+	kmod_pool_unlock(mod->ctx, mod->hashkey);
 	kmod_module_unref_list(mod->dep);
 
 	if (mod->elf)
@@ -403,7 +453,7 @@ KMOD_EXPORT struct kmod_module *kmod_module_ref(struct kmod_module *mod)
 	if (mod == NULL)
 		return NULL;
 
-	mod->refcount++;
+	__atomic_add_fetch(&mod->refcount, 1, __ATOMIC_RELAXED);
 
 	return mod;
 }
@@ -411,16 +461,28 @@ KMOD_EXPORT struct kmod_module *kmod_module_ref(struct kmod_module *mod)
 typedef _nonnull_all_ int (*lookup_func)(struct kmod_ctx *ctx, const char *name,
 					 struct kmod_list **list);
 
-static int __kmod_module_new_from_lookup(struct kmod_ctx *ctx, const lookup_func lookup[],
+struct lookup_source {
+	enum kmod_lookup_source source;
+	lookup_func func;
+};
+
+static int __kmod_module_new_from_lookup(struct kmod_ctx *ctx,
+					 const struct lookup_source lookup[],
 					 size_t lookup_count, const char *s,
 					 struct kmod_list **list)
 {
+	bool stats = kmod_stats_enabled(ctx);
 	unsigned int i;
 
 	for (i = 0; i < lookup_count; i++) {
+		unsigned long long t0 = stats ? now_usec() : 0;
 		int err;
 
-		err = lookup[i](ctx, s, list);
+		err = lookup[i].func(ctx, s, list);
+		if (stats)
+			kmod_stats_add(ctx, lookup[i].source, err >= 0 && *list != NULL,
+				       now_usec() - t0);
+
 		if (err < 0 && err != -ENOSYS)
 			return err;
 		else if (*list != NULL)
@@ -430,18 +492,47 @@ static int __kmod_module_new_from_lookup(struct kmod_ctx *ctx, const lookup_func
 	return 0;
 }
 
+#define LOOKUP_CONFIG { KMOD_LOOKUP_CONFIG, kmod_lookup_alias_from_config }
+#define LOOKUP_DEP { KMOD_LOOKUP_DEP, kmod_lookup_alias_from_moddep_file }
+#define LOOKUP_SYMBOLS { KMOD_LOOKUP_SYMBOLS, kmod_lookup_alias_from_symbols_file }
+#define LOOKUP_COMMANDS { KMOD_LOOKUP_COMMANDS, kmod_lookup_alias_from_commands }
+#define LOOKUP_ALIASES { KMOD_LOOKUP_ALIASES, kmod_lookup_alias_from_aliases_file }
+#define LOOKUP_BUILTIN { KMOD_LOOKUP_BUILTIN, kmod_lookup_alias_from_builtin_file }
+#define LOOKUP_BUILTIN_ALIASES \
+	{ KMOD_LOOKUP_BUILTIN_ALIASES, kmod_lookup_alias_from_kernel_builtin_file }
+
 KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx, const char *given_alias,
 					    struct kmod_list **list)
 {
-	static const lookup_func lookup[] = {
-		kmod_lookup_alias_from_config,
-		kmod_lookup_alias_from_moddep_file,
-		kmod_lookup_alias_from_symbols_file,
-		kmod_lookup_alias_from_commands,
-		kmod_lookup_alias_from_aliases_file,
-		kmod_lookup_alias_from_builtin_file,
-		kmod_lookup_alias_from_kernel_builtin_file,
+	/*
+	 * The sources are always consulted in the same order, but the ones that
+	 * can't possibly match the kind of key are left out: module names never
+	 * contain ':' and only keys starting with "symbol:" are in
+	 * modules.symbols.
+	 */
+	static const struct lookup_source lookup_name[] = {
+		LOOKUP_CONFIG,
+		LOOKUP_DEP,
+		LOOKUP_COMMANDS,
+		LOOKUP_ALIASES,
+		LOOKUP_BUILTIN,
+		LOOKUP_BUILTIN_ALIASES,
+	};
+	static const struct lookup_source lookup_modalias[] = {
+		LOOKUP_CONFIG,
+		LOOKUP_COMMANDS,
+		LOOKUP_ALIASES,
+		LOOKUP_BUILTIN_ALIASES,
+	};
+	static const struct lookup_source lookup_symbol[] = {
+		LOOKUP_CONFIG,
+		LOOKUP_SYMBOLS,
+		LOOKUP_COMMANDS,
+		LOOKUP_ALIASES,
+		LOOKUP_BUILTIN_ALIASES,
 	};
+	const struct lookup_source *lookup;
+	size_t lookup_count;
 	char alias[PATH_MAX];
 	int err;
 
@@ -460,13 +551,31 @@ KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx, const char *gi
 
 	DBG(ctx, "input alias=%s, normalized=%s\n", given_alias, alias);
 
-	err = __kmod_module_new_from_lookup(ctx, lookup, ARRAY_SIZE(lookup), alias, list);
+	if (kmod_negative_lookups_find(ctx, alias)) {
+		DBG(ctx, "lookup=%s found=0 (cached)\n", alias);
+		return 0;
+	}
+
+	if (strstartswith(alias, "symbol:")) {
+		lookup = lookup_symbol;
+		lookup_count = ARRAY_SIZE(lookup_symbol);
+	} else if (strchr(alias, ':') != NULL) {
+		lookup = lookup_modalias;
+		lookup_count = ARRAY_SIZE(lookup_modalias);
+	} else {
+		lookup = lookup_name;
+		lookup_count = ARRAY_SIZE(lookup_name);
+	}
+
+	err = __kmod_module_new_from_lookup(ctx, lookup, lookup_count, alias, list);
 
 	DBG(ctx, "lookup=%s found=%d\n", alias, err >= 0 && *list);
 
 	if (err < 0) {
 		kmod_module_unref_list(*list);
 		*list = NULL;
+	} else if (*list == NULL) {
+		kmod_negative_lookups_add(ctx, alias);
 	}
 
 	return err;
@@ -476,10 +585,10 @@ KMOD_EXPORT int kmod_module_new_from_name_lookup(struct kmod_ctx *ctx,
 						 const char *modname,
 						 struct kmod_module **mod)
 {
-	static const lookup_func lookup[] = {
-		kmod_lookup_alias_from_moddep_file,
-		kmod_lookup_alias_from_builtin_file,
-		kmod_lookup_alias_from_kernel_builtin_file,
+	static const struct lookup_source lookup[] = {
+		LOOKUP_DEP,
+		LOOKUP_BUILTIN,
+		LOOKUP_BUILTIN_ALIASES,
 	};
 	char name_norm[PATH_MAX];
 	struct kmod_list *list = NULL;
@@ -521,7 +630,11 @@ KMOD_EXPORT int kmod_module_get_filtered_blacklist(const struct kmod_ctx *ctx,
 
 static void module_get_dependencies_noref(struct kmod_module *mod)
 {
-	if (!mod->init.dep) {
+	if (module_init_done(&mod->init.dep))
+		return;
+
+	kmod_lock(mod->ctx);
+	if (!module_init_done(&mod->init.dep)) {
 		/* lazy init */
 		char *line = kmod_search_moddep(mod->ctx, mod->name);
 
@@ -530,6 +643,7 @@ static void module_get_dependencies_noref(struct kmod_module *mod)
 			free(line);
 		}
 	}
+	kmod_unlock(mod->ctx);
 }
 
 KMOD_EXPORT struct kmod_list *kmod_module_get_dependencies(const struct kmod_module *mod)
@@ -540,6 +654,8 @@ KMOD_EXPORT struct kmod_list *kmod_module_get_dependencies(const struct kmod_mod
 		return NULL;
 
 	module_get_dependencies_noref((struct kmod_module *)mod);
+	if (!module_init_done(&mod->init.dep))
+		return NULL;
 
 	kmod_list_foreach(l, mod->dep) {
 		l_new = kmod_list_append(list_new, kmod_module_ref(l->data));
@@ -577,20 +693,21 @@ KMOD_EXPORT const char *kmod_module_get_name(const struct kmod_module *mod)
 
 KMOD_EXPORT const char *kmod_module_get_path(const struct kmod_module *mod)
 {
+	const char *path;
+
 	if (mod == NULL)
 		return NULL;
 
-	DBG(mod->ctx, "name='%s' path='%s'\n", mod->name, mod->path);
+	/* lazy init, the path is final once the dependencies are */
+	if (!module_init_done(&mod->init.dep) &&
+	    __atomic_load_n(&mod->path, __ATOMIC_ACQUIRE) == NULL)
+		module_get_dependencies_noref((struct kmod_module *)mod);
 
-	if (mod->path != NULL)
-		return mod->path;
-	if (mod->init.dep)
-		return NULL;
+	path = __atomic_load_n(&mod->path, __ATOMIC_ACQUIRE);
 
-	/* lazy init */
-	module_get_dependencies_noref((struct kmod_module *)mod);
+	DBG(mod->ctx, "name='%s' path='%s'\n", mod->name, path);
 
-	return mod->path;
+	return path;
 }
 
 extern long delete_module(const char *name, unsigned int flags);
@@ -655,35 +772,45 @@ static int do_finit_module(struct kmod_module *mod, unsigned int flags, const ch
 
 static int do_init_module(struct kmod_module *mod, unsigned int flags, const char *args)
 {
-	_cleanup_free_ const void *stripped = NULL;
+	void *copy = NULL;
 	const void *mem;
 	off_t size;
 	int err;
 
+	if (flags & (KMOD_INSERT_FORCE_VERMAGIC | KMOD_INSERT_FORCE_MODVERSION)) {
+		err = kmod_module_load_elf(mod);
+		if (err)
+			return err;
+	}
+
+	kmod_lock(mod->ctx);
 	err = kmod_file_get_contents(mod->file, &mem, &size);
+	kmod_unlock(mod->ctx);
 	if (err)
 		return err;
 
 	if (flags & (KMOD_INSERT_FORCE_VERMAGIC | KMOD_INSERT_FORCE_MODVERSION)) {
-		if (mod->elf == NULL) {
-			err = kmod_elf_new(mem, size, &mod->elf);
-			if (err)
-				return err;
-		}
+		err = kmod_file_get_writable_contents(mod->file, &copy, &size);
+		if (err)
+			return err;
 
-		err = kmod_elf_strip(mod->elf, flags, &stripped);
+		err = kmod_elf_strip(mod->elf, flags, copy);
 		if (err) {
 			ERR(mod->ctx, "Failed to strip version information: %s\n",
 			    strerror(-err));
+			kmod_file_put_writable_contents(mod->file, copy);
 			return err;
 		}
-		mem = stripped;
+		mem = copy;
 	}
 
 	err = init_module(mem, size, args);
 	if (err < 0)
 		err = -errno;
 
+	if (copy != NULL)
+		kmod_file_put_writable_contents(mod->file, copy);
+
 	return err;
 }
 
@@ -703,8 +830,10 @@ KMOD_EXPORT int kmod_module_insert_module(struct kmod_module *mod, unsigned int
 		return -ENOENT;
 	}
 
-	if (!mod->file) {
-		err = kmod_file_open(mod->ctx, path, &mod->file);
+	if (__atomic_load_n(&mod->file, __ATOMIC_ACQUIRE) == NULL) {
+		kmod_lock(mod->ctx);
+		err = __kmod_module_open_file(mod, path);
+		kmod_unlock(mod->ctx);
 		if (err)
 			return err;
 	}
@@ -882,15 +1011,75 @@ static char *module_options_concat(const char *opt, const char *xopt)
 	return r;
 }
 
-static int __kmod_module_get_probe_list(struct kmod_module *mod, bool required,
-					bool ignorecmd, struct kmod_list **list);
+/*
+ * State of the modules visited by kmod_module_get_probe_list(). It's kept
+ * per call rather than in the modules so probe lists can be built
+ * concurrently in a thread-safe context.
+ */
+struct probe_state {
+	struct kmod_module *mod; /* reference held while in the states hash */
+
+	/* to detect dependency loops */
+	bool visited : 1;
+
+	/*
+	 * indicates for probe_insert() whether the module's command and
+	 * softdep should be ignored
+	 */
+	bool ignorecmd : 1;
+
+	/*
+	 * indicates whether this is the module the user asked for or its
+	 * dependency, or whether this is a softdep only
+	 */
+	bool required : 1;
+};
+
+static void probe_state_free(void *data)
+{
+	struct probe_state *st = data;
+
+	kmod_module_unref(st->mod);
+	free(st);
+}
+
+static struct probe_state *probe_state_get(struct hash *states, struct kmod_module *mod)
+{
+	struct probe_state *st;
+
+	st = hash_find(states, mod->hashkey);
+	if (st != NULL)
+		return st;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		return NULL;
+
+	st->mod = kmod_module_ref(mod);
+	if (hash_add(states, mod->hashkey, st) < 0) {
+		probe_state_free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+static int __kmod_module_get_probe_list(struct hash *states, struct kmod_module *mod,
+					bool required, bool ignorecmd,
+					struct kmod_list **list);
 
 /* re-entrant */
-static int __kmod_module_fill_softdep(struct kmod_module *mod, struct kmod_list **list)
+static int __kmod_module_fill_softdep(struct hash *states, struct kmod_module *mod,
+				      struct kmod_list **list)
 {
+	struct probe_state *st;
 	struct kmod_list *pre = NULL, *post = NULL, *l;
 	int err;
 
+	st = probe_state_get(states, mod);
+	if (st == NULL)
+		return -ENOMEM;
+
 	err = kmod_module_get_softdeps(mod, &pre, &post);
 	if (err < 0) {
 		ERR(mod->ctx, "could not get softdep: %s\n", strerror(-err));
@@ -899,7 +1088,7 @@ static int __kmod_module_fill_softdep(struct kmod_module *mod, struct kmod_list
 
 	kmod_list_foreach(l, pre) {
 		struct kmod_module *m = l->data;
-		err = __kmod_module_get_probe_list(m, false, false, list);
+		err = __kmod_module_get_probe_list(states, m, false, false, list);
 		if (err < 0)
 			goto fail;
 	}
@@ -911,11 +1100,11 @@ static int __kmod_module_fill_softdep(struct kmod_module *mod, struct kmod_list
 		goto fail;
 	}
 	*list = l;
-	mod->ignorecmd = (pre != NULL || post != NULL);
+	st->ignorecmd = (pre != NULL || post != NULL);
 
 	kmod_list_foreach(l, post) {
 		struct kmod_module *m = l->data;
-		err = __kmod_module_get_probe_list(m, false, false, list);
+		err = __kmod_module_get_probe_list(states, m, false, false, list);
 		if (err < 0)
 			goto fail;
 	}
@@ -928,17 +1117,23 @@ fail:
 }
 
 /* re-entrant */
-static int __kmod_module_get_probe_list(struct kmod_module *mod, bool required,
-					bool ignorecmd, struct kmod_list **list)
+static int __kmod_module_get_probe_list(struct hash *states, struct kmod_module *mod,
+					bool required, bool ignorecmd,
+					struct kmod_list **list)
 {
+	struct probe_state *st;
 	struct kmod_list *dep, *l;
 	int err = 0;
 
-	if (mod->visited) {
+	st = probe_state_get(states, mod);
+	if (st == NULL)
+		return -ENOMEM;
+
+	if (st->visited) {
 		DBG(mod->ctx, "Ignore module '%s': already visited\n", mod->name);
 		return 0;
 	}
-	mod->visited = true;
+	st->visited = true;
 
 	dep = kmod_module_get_dependencies(mod);
 	if (required) {
@@ -947,16 +1142,20 @@ static int __kmod_module_get_probe_list(struct kmod_module *mod, bool required,
 		 * ->required flag on mod and all its dependencies before
 		 * they are possibly visited through some softdeps.
 		 */
-		mod->required = true;
+		st->required = true;
 		kmod_list_foreach(l, dep) {
-			struct kmod_module *m = l->data;
-			m->required = true;
+			struct probe_state *dst = probe_state_get(states, l->data);
+			if (dst == NULL) {
+				err = -ENOMEM;
+				goto finish;
+			}
+			dst->required = true;
 		}
 	}
 
 	kmod_list_foreach(l, dep) {
 		struct kmod_module *m = l->data;
-		err = __kmod_module_fill_softdep(m, list);
+		err = __kmod_module_fill_softdep(states, m, list);
 		if (err < 0)
 			goto finish;
 	}
@@ -969,9 +1168,9 @@ static int __kmod_module_get_probe_list(struct kmod_module *mod, bool required,
 			goto finish;
 		}
 		*list = l;
-		mod->ignorecmd = true;
+		st->ignorecmd = true;
 	} else
-		err = __kmod_module_fill_softdep(mod, list);
+		err = __kmod_module_fill_softdep(states, mod, list);
 
 finish:
 	kmod_module_unref_list(dep);
@@ -979,20 +1178,14 @@ finish:
 }
 
 static int kmod_module_get_probe_list(struct kmod_module *mod, bool ignorecmd,
-				      struct kmod_list **list)
+				      struct hash *states, struct kmod_list **list)
 {
 	int err;
 
 	assert(mod != NULL);
 	assert(list != NULL && *list == NULL);
 
-	/*
-	 * Make sure we don't get screwed by previous calls to this function
-	 */
-	kmod_set_modules_visited(mod->ctx, false);
-	kmod_set_modules_required(mod->ctx, false);
-
-	err = __kmod_module_get_probe_list(mod, true, ignorecmd, list);
+	err = __kmod_module_get_probe_list(states, mod, true, ignorecmd, list);
 	if (err < 0) {
 		kmod_module_unref_list(*list);
 		*list = NULL;
@@ -1009,6 +1202,7 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 {
 	struct kmod_list *list = NULL, *l;
 	struct probe_insert_cb cb;
+	struct hash *states;
 	int err;
 
 	if (mod == NULL)
@@ -1032,10 +1226,14 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 			return KMOD_PROBE_APPLY_BLACKLIST;
 	}
 
+	states = hash_new(16, probe_state_free);
+	if (states == NULL)
+		return -ENOMEM;
+
 	err = kmod_module_get_probe_list(mod, !!(flags & KMOD_PROBE_IGNORE_COMMAND),
-					 &list);
+					 states, &list);
 	if (err < 0)
-		return err;
+		goto finish;
 
 	if (flags & KMOD_PROBE_APPLY_BLACKLIST_ALL) {
 		struct kmod_list *filtered = NULL;
@@ -1043,13 +1241,14 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 		err = kmod_module_apply_filter(mod->ctx, KMOD_FILTER_BLACKLIST, list,
 					       &filtered);
 		if (err < 0)
-			return err;
+			goto finish;
 
 		kmod_module_unref_list(list);
-		if (filtered == NULL)
-			return KMOD_PROBE_APPLY_BLACKLIST_ALL;
-
 		list = filtered;
+		if (list == NULL) {
+			err = KMOD_PROBE_APPLY_BLACKLIST_ALL;
+			goto finish;
+		}
 	}
 
 	cb.run_install = run_install;
@@ -1057,6 +1256,7 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 
 	kmod_list_foreach(l, list) {
 		struct kmod_module *m = l->data;
+		const struct probe_state *st = hash_find(states, m->hashkey);
 		const char *moptions = kmod_module_get_options(m);
 		const char *cmd = kmod_module_get_install_commands(m);
 		char *options;
@@ -1070,7 +1270,7 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 		options =
 			module_options_concat(moptions, m == mod ? extra_options : NULL);
 
-		if (cmd != NULL && !m->ignorecmd) {
+		if (cmd != NULL && !st->ignorecmd) {
 			if (print_action != NULL)
 				print_action(m, true, options ?: "");
 
@@ -1103,23 +1303,31 @@ finish_module:
 		/*
 		 * Ignore errors from softdeps
 		 */
-		if (err == -EEXIST || !m->required)
+		if (err == -EEXIST || !st->required)
 			err = 0;
 
 		else if (err < 0)
 			break;
 	}
 
+finish:
 	kmod_module_unref_list(list);
+	hash_free(states);
 	return err;
 }
 
 KMOD_EXPORT const char *kmod_module_get_options(const struct kmod_module *mod)
 {
+	const char *options;
+
 	if (mod == NULL)
 		return NULL;
 
-	if (!mod->init.options) {
+	if (module_init_done(&mod->init.options))
+		return mod->options;
+
+	kmod_lock(mod->ctx);
+	if (!module_init_done(&mod->init.options)) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
 		const struct kmod_list *l;
@@ -1166,23 +1374,32 @@ KMOD_EXPORT const char *kmod_module_get_options(const struct kmod_module *mod)
 			opts[optslen] = '\0';
 		}
 
-		m->init.options = true;
 		m->options = opts;
+		module_init_publish(&m->init.options);
 	}
+	options = mod->options;
+	kmod_unlock(mod->ctx);
 
-	return mod->options;
+	return options;
 
 failed:
+	kmod_unlock(mod->ctx);
 	ERR(mod->ctx, "out of memory\n");
 	return NULL;
 }
 
 KMOD_EXPORT const char *kmod_module_get_install_commands(const struct kmod_module *mod)
 {
+	const char *commands;
+
 	if (mod == NULL)
 		return NULL;
 
-	if (!mod->init.install_commands) {
+	if (module_init_done(&mod->init.install_commands))
+		return __atomic_load_n(&mod->install_commands, __ATOMIC_RELAXED);
+
+	kmod_lock(mod->ctx);
+	if (!module_init_done(&mod->init.install_commands)) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
 		const struct kmod_list *l;
@@ -1196,7 +1413,8 @@ KMOD_EXPORT const char *kmod_module_get_install_commands(const struct kmod_modul
 			if (fnmatch(modname, mod->name, 0) != 0)
 				continue;
 
-			m->install_commands = kmod_command_get_command(l);
+			__atomic_store_n(&m->install_commands, kmod_command_get_command(l),
+					 __ATOMIC_RELAXED);
 
 			/*
 			 * find only the first command, as modprobe from
@@ -1205,16 +1423,19 @@ KMOD_EXPORT const char *kmod_module_get_install_commands(const struct kmod_modul
 			break;
 		}
 
-		m->init.install_commands = true;
+		module_init_publish(&m->init.install_commands);
 	}
+	commands = __atomic_load_n(&mod->install_commands, __ATOMIC_RELAXED);
+	kmod_unlock(mod->ctx);
 
-	return mod->install_commands;
+	return commands;
 }
 
 void kmod_module_set_install_commands(struct kmod_module *mod, const char *cmd)
 {
-	mod->init.install_commands = true;
-	mod->install_commands = cmd;
+	/* may replace a command already published, either one is fine to read */
+	__atomic_store_n(&mod->install_commands, cmd, __ATOMIC_RELAXED);
+	module_init_publish(&mod->init.install_commands);
 }
 
 static struct kmod_list *lookup_dep(struct kmod_ctx *ctx, const char *const *array,
@@ -1312,10 +1533,16 @@ KMOD_EXPORT int kmod_module_get_weakdeps(const struct kmod_module *mod,
 
 KMOD_EXPORT const char *kmod_module_get_remove_commands(const struct kmod_module *mod)
 {
+	const char *commands;
+
 	if (mod == NULL)
 		return NULL;
 
-	if (!mod->init.remove_commands) {
+	if (module_init_done(&mod->init.remove_commands))
+		return __atomic_load_n(&mod->remove_commands, __ATOMIC_RELAXED);
+
+	kmod_lock(mod->ctx);
+	if (!module_init_done(&mod->init.remove_commands)) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
 		const struct kmod_list *l;
@@ -1329,7 +1556,8 @@ KMOD_EXPORT const char *kmod_module_get_remove_commands(const struct kmod_module
 			if (fnmatch(modname, mod->name, 0) != 0)
 				continue;
 
-			m->remove_commands = kmod_command_get_command(l);
+			__atomic_store_n(&m->remove_commands, kmod_command_get_command(l),
+					 __ATOMIC_RELAXED);
 
 			/*
 			 * find only the first command, as modprobe from
@@ -1338,16 +1566,19 @@ KMOD_EXPORT const char *kmod_module_get_remove_commands(const struct kmod_module
 			break;
 		}
 
-		m->init.remove_commands = true;
+		module_init_publish(&m->init.remove_commands);
 	}
+	commands = __atomic_load_n(&mod->remove_commands, __ATOMIC_RELAXED);
+	kmod_unlock(mod->ctx);
 
-	return mod->remove_commands;
+	return commands;
 }
 
 void kmod_module_set_remove_commands(struct kmod_module *mod, const char *cmd)
 {
-	mod->init.remove_commands = true;
-	mod->remove_commands = cmd;
+	/* may replace a command already published, either one is fine to read */
+	__atomic_store_n(&mod->remove_commands, cmd, __ATOMIC_RELAXED);
+	module_init_publish(&mod->init.remove_commands);
 }
 
 KMOD_EXPORT int kmod_module_new_from_loaded(struct kmod_ctx *ctx, struct kmod_list **list)
@@ -1737,35 +1968,54 @@ KMOD_EXPORT void kmod_module_section_free_list(struct kmod_list *list)
 	kmod_list_release(list, kmod_module_section_free);
 }
 
-static int kmod_module_load_elf(const struct kmod_module *mod)
+static int __kmod_module_load_elf(struct kmod_module *mod)
 {
+	struct kmod_elf *elf;
+	const void *mem;
+	off_t size;
+	int err;
+
+	if (mod->elf != NULL)
+		return 0;
+
 	if (mod->file == NULL) {
 		const char *path = kmod_module_get_path(mod);
-		int ret;
 
 		if (path == NULL)
 			return -ENOENT;
 
-		ret = kmod_file_open(mod->ctx, path, &((struct kmod_module *)mod)->file);
-		if (ret)
-			return ret;
-	}
-
-	if (mod->elf == NULL) {
-		const void *mem;
-		off_t size;
-		int err = kmod_file_get_contents(mod->file, &mem, &size);
-		if (err)
-			return err;
-
-		err = kmod_elf_new(mem, size, &((struct kmod_module *)mod)->elf);
+		err = __kmod_module_open_file(mod, path);
 		if (err)
 			return err;
 	}
 
+	err = kmod_file_get_sparse_contents(mod->file, &mem, &size);
+	if (err)
+		return err;
+
+	err = kmod_elf_new(mem, size, kmod_file_is_sparse(mod->file), &elf);
+	if (err)
+		return err;
+
+	__atomic_store_n(&mod->elf, elf, __ATOMIC_RELEASE);
+
 	return 0;
 }
 
+static int kmod_module_load_elf(const struct kmod_module *mod)
+{
+	int err;
+
+	if (__atomic_load_n(&mod->elf, __ATOMIC_ACQUIRE) != NULL)
+		return 0;
+
+	kmod_lock(mod->ctx);
+	err = __kmod_module_load_elf((struct kmod_module *)mod);
+	kmod_unlock(mod->ctx);
+
+	return err;
+}
+
 struct kmod_module_info {
 	char *key;
 	char value[];
@@ -1834,152 +2084,226 @@ static bool kmod_module_strbuf_pushhex(struct strbuf *sbuf, const char *hex, siz
 	return true;
 }
 
-static struct kmod_list *kmod_module_info_append_hex(struct kmod_list **list,
-						     const char *key, size_t keylen,
-						     const char *value, size_t valuelen)
+struct kmod_module_info_iter {
+	unsigned int keys;
+	int (*cb)(const char *key, size_t keylen, const char *value, size_t valuelen,
+		  void *data);
+	void *data;
+	int count;
+};
+
+static unsigned int kmod_module_info_key_type(const char *key, size_t keylen)
+{
+	static const struct {
+		const char *name;
+		size_t len;
+		unsigned int type;
+	} keys[] = {
+		// clang-format off
+		{ "alias", sizeof("alias") - 1, KMOD_MODULE_INFO_ALIAS },
+		{ "softdep", sizeof("softdep") - 1, KMOD_MODULE_INFO_SOFTDEP },
+		{ "weakdep", sizeof("weakdep") - 1, KMOD_MODULE_INFO_WEAKDEP },
+		{ "depends", sizeof("depends") - 1, KMOD_MODULE_INFO_DEPENDS },
+		{ "firmware", sizeof("firmware") - 1, KMOD_MODULE_INFO_FIRMWARE },
+		// clang-format on
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(keys); i++) {
+		if (keylen == keys[i].len && memcmp(key, keys[i].name, keylen) == 0)
+			return keys[i].type;
+	}
+
+	return KMOD_MODULE_INFO_OTHER;
+}
+
+static int kmod_module_info_iter_emit(struct kmod_module_info_iter *iter,
+				      const char *key, size_t keylen,
+				      const char *value, size_t valuelen)
 {
-	struct kmod_list *n;
+	int err;
 
-	if (valuelen > 0) {
-		DECLARE_STRBUF_WITH_STACK(sbuf, 512);
-		const char *hex;
+	err = iter->cb(key, keylen, value, valuelen, iter->data);
+	if (err < 0)
+		return err;
+
+	iter->count++;
+	return 0;
+}
+
+/* "key=value" from .modinfo, keylen == len if there's no '=' */
+static int kmod_module_info_iter_string(const char *str, size_t len, size_t keylen,
+					void *data)
+{
+	struct kmod_module_info_iter *iter = data;
+	const char *value;
+	size_t valuelen;
+
+	if (keylen == len) {
+		valuelen = 0;
+		value = str;
+	} else {
+		value = str + keylen + 1;
+		valuelen = len - keylen - 1;
+	}
+
+	if (!(iter->keys & kmod_module_info_key_type(str, keylen)))
+		return 0;
+
+	return kmod_module_info_iter_emit(iter, str, keylen, value, valuelen);
+}
 
+static int kmod_module_info_iter_hex(struct kmod_module_info_iter *iter,
+				     const char *key, const char *value, size_t valuelen)
+{
+	DECLARE_STRBUF_WITH_STACK(sbuf, 512);
+	const char *hex = "";
+
+	if (valuelen > 0) {
 		/* Display as 01:12:DE:AD:BE:EF:... */
 		if (!kmod_module_strbuf_pushhex(&sbuf, value, valuelen))
-			goto list_error;
+			return -ENOMEM;
 		hex = strbuf_str(&sbuf);
-
-		n = kmod_module_info_append(list, key, keylen, hex, strlen(hex));
-		if (n == NULL)
-			goto list_error;
-	} else {
-		n = kmod_module_info_append(list, key, keylen, NULL, 0);
-		if (n == NULL)
-			goto list_error;
+		if (hex == NULL)
+			return -ENOMEM;
 	}
 
-	return n;
+	return kmod_module_info_iter_emit(iter, key, strlen(key), hex, strlen(hex));
+}
 
-list_error:
-	return NULL;
+static int kmod_module_info_iter_signature(struct kmod_module_info_iter *iter,
+					   const struct kmod_signature_info *sig_info)
+{
+	int err;
+
+	err = kmod_module_info_iter_emit(iter, "sig_id", strlen("sig_id"),
+					 sig_info->id_type, strlen(sig_info->id_type));
+	if (err < 0)
+		return err;
+
+	err = kmod_module_info_iter_emit(iter, "signer", strlen("signer"),
+					 sig_info->signer, sig_info->signer_len);
+	if (err < 0)
+		return err;
+
+	err = kmod_module_info_iter_hex(iter, "sig_key", sig_info->key_id,
+					sig_info->key_id_len);
+	if (err < 0)
+		return err;
+
+	err = kmod_module_info_iter_emit(iter, "sig_hashalgo", strlen("sig_hashalgo"),
+					 sig_info->hash_algo,
+					 strlen(sig_info->hash_algo));
+	if (err < 0)
+		return err;
+
+	/*
+	 * Omit sig_info->algo for now, as these
+	 * are currently constant.
+	 */
+	return kmod_module_info_iter_hex(iter, "signature", sig_info->sig,
+					 sig_info->sig_len);
 }
 
-KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod,
-				     struct kmod_list **list)
+KMOD_EXPORT int kmod_module_foreach_info(const struct kmod_module *mod, unsigned int keys,
+					 int (*cb)(const char *key, size_t keylen,
+						   const char *value, size_t valuelen,
+						   void *data),
+					 void *data)
 {
-	char **strings;
-	int i, count, ret = -ENOMEM;
-	struct kmod_signature_info *sig_info = NULL;
+	struct kmod_module_info_iter iter = {
+		.keys = keys,
+		.cb = cb,
+		.data = data,
+	};
+	int err;
 
-	if (mod == NULL || list == NULL)
+	if (mod == NULL || cb == NULL)
 		return -ENOENT;
 
-	assert(*list == NULL);
-
 	/* remove const: this can only change internal state */
 	if (kmod_module_is_builtin((struct kmod_module *)mod)) {
+		_cleanup_free_ char **strings = NULL;
+		ssize_t count;
+
 		count = kmod_builtin_get_modinfo(mod->ctx, kmod_module_get_name(mod),
 						 &strings);
 		if (count < 0)
 			return count;
-	} else {
-		ret = kmod_module_load_elf(mod);
-		if (ret)
-			return ret;
 
-		count = kmod_elf_get_modinfo_strings(mod->elf, &strings);
-		if (count < 0)
-			return count;
-	}
+		for (ssize_t i = 0; i < count; i++) {
+			size_t len = strlen(strings[i]);
+			const char *eq = memchr(strings[i], '=', len);
 
-	for (i = 0; i < count; i++) {
-		struct kmod_list *n;
-		const char *key, *value;
-		size_t keylen, valuelen;
-
-		key = strings[i];
-		value = strchr(key, '=');
-		if (value == NULL) {
-			keylen = strlen(key);
-			valuelen = 0;
-			value = key;
-		} else {
-			keylen = value - key;
-			value++;
-			valuelen = strlen(value);
+			err = kmod_module_info_iter_string(
+				strings[i], len, eq != NULL ? (size_t)(eq - strings[i]) : len,
+				&iter);
+			if (err < 0)
+				return err;
 		}
+	} else {
+		err = kmod_module_load_elf(mod);
+		if (err)
+			return err;
 
-		n = kmod_module_info_append(list, key, keylen, value, valuelen);
-		if (n == NULL)
-			goto list_error;
+		err = kmod_elf_foreach_modinfo_string(mod->elf,
+						      kmod_module_info_iter_string, &iter);
+		if (err < 0)
+			return err;
 	}
 
-	if (mod->elf) {
+	if (mod->elf && (keys & KMOD_MODULE_INFO_BUILD_ID)) {
 		const void *build_id;
 		size_t build_id_len;
 
 		if (kmod_elf_get_build_id(mod->elf, &build_id, &build_id_len) == 0) {
-			struct kmod_list *n;
-
-			n = kmod_module_info_append_hex(list, "build-id",
-							strlen("build-id"), build_id,
+			err = kmod_module_info_iter_hex(&iter, "build-id", build_id,
 							build_id_len);
-			if (n == NULL)
-				goto list_error;
-			count++;
+			if (err < 0)
+				return err;
 		}
 	}
 
-	if (mod->file && kmod_module_signature_info(mod->file, &sig_info)) {
-		struct kmod_list *n;
+	if (mod->file && (keys & KMOD_MODULE_INFO_SIGNATURE)) {
+		_cleanup_free_ struct kmod_signature_info *sig_info = NULL;
 
-		n = kmod_module_info_append(list, "sig_id", strlen("sig_id"),
-					    sig_info->id_type, strlen(sig_info->id_type));
-		if (n == NULL)
-			goto list_error;
-		count++;
+		if (kmod_module_signature_info(mod->file, &sig_info)) {
+			err = kmod_module_info_iter_signature(&iter, sig_info);
+			if (err < 0)
+				return err;
+		}
+	}
 
-		n = kmod_module_info_append(list, "signer", strlen("signer"),
-					    sig_info->signer, sig_info->signer_len);
-		if (n == NULL)
-			goto list_error;
-		count++;
+	return iter.count;
+}
 
-		n = kmod_module_info_append_hex(list, "sig_key", strlen("sig_key"),
-						sig_info->key_id, sig_info->key_id_len);
-		if (n == NULL)
-			goto list_error;
-		count++;
+static int kmod_module_info_append_cb(const char *key, size_t keylen, const char *value,
+				      size_t valuelen, void *data)
+{
+	struct kmod_list **list = data;
 
-		n = kmod_module_info_append(list, "sig_hashalgo", strlen("sig_hashalgo"),
-					    sig_info->hash_algo,
-					    strlen(sig_info->hash_algo));
-		if (n == NULL)
-			goto list_error;
-		count++;
+	if (kmod_module_info_append(list, key, keylen, value, valuelen) == NULL)
+		return -ENOMEM;
 
-		/*
-		 * Omit sig_info->algo for now, as these
-		 * are currently constant.
-		 */
-		n = kmod_module_info_append_hex(list, "signature", strlen("signature"),
-						sig_info->sig, sig_info->sig_len);
+	return 0;
+}
 
-		if (n == NULL)
-			goto list_error;
-		count++;
-	}
-	ret = count;
+KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod,
+				     struct kmod_list **list)
+{
+	int ret;
 
-list_error:
-	/* aux structures freed in normal case also */
-	free(sig_info);
+	if (mod == NULL || list == NULL)
+		return -ENOENT;
+
+	assert(*list == NULL);
 
+	ret = kmod_module_foreach_info(mod, KMOD_MODULE_INFO_ALL,
+				       kmod_module_info_append_cb, list);
 	if (ret < 0) {
 		kmod_module_info_free_list(*list);
 		*list = NULL;
 	}
-	free(strings);
+
 	return ret;
 }
 
@@ -2016,17 +2340,18 @@ struct kmod_module_version {
 };
 
 static struct kmod_module_version *kmod_module_versions_new(uint64_t crc,
-							    const char *symbol)
+							    const char *symbol,
+							    size_t symbollen)
 {
 	struct kmod_module_version *mv;
-	size_t symbollen = strlen(symbol) + 1;
 
-	mv = malloc(sizeof(struct kmod_module_version) + symbollen);
+	mv = malloc(sizeof(struct kmod_module_version) + symbollen + 1);
 	if (mv == NULL)
 		return NULL;
 
 	mv->crc = crc;
 	memcpy(mv->symbol, symbol, symbollen);
+	mv->symbol[symbollen] = '\0';
 	return mv;
 }
 
@@ -2035,52 +2360,62 @@ static void kmod_module_version_free(struct kmod_module_version *version)
 	free(version);
 }
 
+KMOD_EXPORT int kmod_module_foreach_version(const struct kmod_module *mod,
+					    int (*cb)(const char *symbol, size_t len,
+						      uint64_t crc,
+						      enum kmod_symbol_bind bind,
+						      void *data),
+					    void *data)
+{
+	int err;
+
+	if (mod == NULL || cb == NULL)
+		return -ENOENT;
+
+	err = kmod_module_load_elf(mod);
+	if (err)
+		return err;
+
+	return kmod_elf_foreach_modversion(mod->elf, cb, data);
+}
+
+static int kmod_module_version_append_cb(const char *symbol, size_t len, uint64_t crc,
+					 enum kmod_symbol_bind bind, void *data)
+{
+	struct kmod_list **list = data;
+	struct kmod_module_version *mv;
+	struct kmod_list *n;
+
+	mv = kmod_module_versions_new(crc, symbol, len);
+	if (mv == NULL)
+		return -ENOMEM;
+
+	n = kmod_list_append(*list, mv);
+	if (n == NULL) {
+		kmod_module_version_free(mv);
+		return -ENOMEM;
+	}
+
+	*list = n;
+	return 0;
+}
+
 KMOD_EXPORT int kmod_module_get_versions(const struct kmod_module *mod,
 					 struct kmod_list **list)
 {
-	struct kmod_modversion *versions;
-	int i, count, ret = 0;
+	int ret;
 
 	if (mod == NULL || list == NULL)
 		return -ENOENT;
 
 	assert(*list == NULL);
 
-	ret = kmod_module_load_elf(mod);
-	if (ret)
-		return ret;
-
-	count = kmod_elf_get_modversions(mod->elf, &versions);
-	if (count < 0)
-		return count;
-
-	for (i = 0; i < count; i++) {
-		struct kmod_module_version *mv;
-		struct kmod_list *n;
-
-		mv = kmod_module_versions_new(versions[i].crc, versions[i].symbol);
-		if (mv == NULL) {
-			kmod_module_versions_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
-
-		n = kmod_list_append(*list, mv);
-		if (n != NULL)
-			*list = n;
-		else {
-			kmod_module_version_free(mv);
-			kmod_module_versions_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
+	ret = kmod_module_foreach_version(mod, kmod_module_version_append_cb, list);
+	if (ret < 0) {
+		kmod_module_versions_free_list(*list);
+		*list = NULL;
 	}
-	ret = count;
 
-list_error:
-	free(versions);
 	return ret;
 }
 
@@ -2116,17 +2451,18 @@ struct kmod_module_symbol {
 	char symbol[];
 };
 
-static struct kmod_module_symbol *kmod_module_symbols_new(uint64_t crc, const char *symbol)
+static struct kmod_module_symbol *kmod_module_symbols_new(uint64_t crc, const char *symbol,
+							  size_t symbollen)
 {
 	struct kmod_module_symbol *mv;
-	size_t symbollen = strlen(symbol) + 1;
 
-	mv = malloc(sizeof(struct kmod_module_symbol) + symbollen);
+	mv = malloc(sizeof(struct kmod_module_symbol) + symbollen + 1);
 	if (mv == NULL)
 		return NULL;
 
 	mv->crc = crc;
 	memcpy(mv->symbol, symbol, symbollen);
+	mv->symbol[symbollen] = '\0';
 	return mv;
 }
 
@@ -2135,52 +2471,62 @@ static void kmod_module_symbol_free(struct kmod_module_symbol *symbol)
 	free(symbol);
 }
 
+KMOD_EXPORT int kmod_module_foreach_symbol(const struct kmod_module *mod,
+					   int (*cb)(const char *symbol, size_t len,
+						     uint64_t crc,
+						     enum kmod_symbol_bind bind,
+						     void *data),
+					   void *data)
+{
+	int err;
+
+	if (mod == NULL || cb == NULL)
+		return -ENOENT;
+
+	err = kmod_module_load_elf(mod);
+	if (err)
+		return err;
+
+	return kmod_elf_foreach_symbol(mod->elf, cb, data);
+}
+
+static int kmod_module_symbol_append_cb(const char *symbol, size_t len, uint64_t crc,
+					enum kmod_symbol_bind bind, void *data)
+{
+	struct kmod_list **list = data;
+	struct kmod_module_symbol *mv;
+	struct kmod_list *n;
+
+	mv = kmod_module_symbols_new(crc, symbol, len);
+	if (mv == NULL)
+		return -ENOMEM;
+
+	n = kmod_list_append(*list, mv);
+	if (n == NULL) {
+		kmod_module_symbol_free(mv);
+		return -ENOMEM;
+	}
+
+	*list = n;
+	return 0;
+}
+
 KMOD_EXPORT int kmod_module_get_symbols(const struct kmod_module *mod,
 					struct kmod_list **list)
 {
-	struct kmod_modversion *symbols;
-	int i, count, ret = 0;
+	int ret;
 
 	if (mod == NULL || list == NULL)
 		return -ENOENT;
 
 	assert(*list == NULL);
 
-	ret = kmod_module_load_elf(mod);
-	if (ret)
-		return ret;
-
-	count = kmod_elf_get_symbols(mod->elf, &symbols);
-	if (count < 0)
-		return count;
-
-	for (i = 0; i < count; i++) {
-		struct kmod_module_symbol *mv;
-		struct kmod_list *n;
-
-		mv = kmod_module_symbols_new(symbols[i].crc, symbols[i].symbol);
-		if (mv == NULL) {
-			kmod_module_symbols_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
-
-		n = kmod_list_append(*list, mv);
-		if (n != NULL)
-			*list = n;
-		else {
-			kmod_module_symbol_free(mv);
-			kmod_module_symbols_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
+	ret = kmod_module_foreach_symbol(mod, kmod_module_symbol_append_cb, list);
+	if (ret < 0) {
+		kmod_module_symbols_free_list(*list);
+		*list = NULL;
 	}
-	ret = count;
 
-list_error:
-	free(symbols);
 	return ret;
 }
 
@@ -2218,19 +2564,19 @@ struct kmod_module_dependency_symbol {
 };
 
 // clang-format off
-static struct kmod_module_dependency_symbol *kmod_module_dependency_symbols_new(uint64_t crc, uint8_t bind, const char *symbol)
+static struct kmod_module_dependency_symbol *kmod_module_dependency_symbols_new(uint64_t crc, uint8_t bind, const char *symbol, size_t symbollen)
 // clang-format on
 {
 	struct kmod_module_dependency_symbol *mv;
-	size_t symbollen = strlen(symbol) + 1;
 
-	mv = malloc(sizeof(struct kmod_module_dependency_symbol) + symbollen);
+	mv = malloc(sizeof(struct kmod_module_dependency_symbol) + symbollen + 1);
 	if (mv == NULL)
 		return NULL;
 
 	mv->crc = crc;
 	mv->bind = bind;
 	memcpy(mv->symbol, symbol, symbollen);
+	mv->symbol[symbollen] = '\0';
 	return mv;
 }
 
@@ -2240,54 +2586,99 @@ static void kmod_module_dependency_symbol_free(
 	free(dependency_symbol);
 }
 
+KMOD_EXPORT int kmod_module_foreach_dependency_symbol(const struct kmod_module *mod,
+						      int (*cb)(const char *symbol,
+								size_t len, uint64_t crc,
+								enum kmod_symbol_bind bind,
+								void *data),
+						      void *data)
+{
+	int err;
+
+	if (mod == NULL || cb == NULL)
+		return -ENOENT;
+
+	err = kmod_module_load_elf(mod);
+	if (err)
+		return err;
+
+	return kmod_elf_foreach_dependency_symbol(mod->elf, cb, data);
+}
+
+static int kmod_module_dependency_symbol_append_cb(const char *symbol, size_t len,
+						   uint64_t crc,
+						   enum kmod_symbol_bind bind, void *data)
+{
+	struct kmod_list **list = data;
+	struct kmod_module_dependency_symbol *mv;
+	struct kmod_list *n;
+
+	mv = kmod_module_dependency_symbols_new(crc, bind, symbol, len);
+	if (mv == NULL)
+		return -ENOMEM;
+
+	n = kmod_list_append(*list, mv);
+	if (n == NULL) {
+		kmod_module_dependency_symbol_free(mv);
+		return -ENOMEM;
+	}
+
+	*list = n;
+	return 0;
+}
+
 KMOD_EXPORT int kmod_module_get_dependency_symbols(const struct kmod_module *mod,
 						   struct kmod_list **list)
 {
-	struct kmod_modversion *symbols;
-	int i, count, ret = 0;
+	int ret;
 
 	if (mod == NULL || list == NULL)
 		return -ENOENT;
 
 	assert(*list == NULL);
 
-	ret = kmod_module_load_elf(mod);
-	if (ret)
-		return ret;
+	ret = kmod_module_foreach_dependency_symbol(
+		mod, kmod_module_dependency_symbol_append_cb, list);
+	if (ret < 0) {
+		kmod_module_dependency_symbols_free_list(*list);
+		*list = NULL;
+	}
 
-	count = kmod_elf_get_dependency_symbols(mod->elf, &symbols);
-	if (count < 0)
-		return count;
+	return ret;
+}
 
-	for (i = 0; i < count; i++) {
-		struct kmod_module_dependency_symbol *mv;
-		struct kmod_list *n;
-
-		mv = kmod_module_dependency_symbols_new(symbols[i].crc, symbols[i].bind,
-							symbols[i].symbol);
-		if (mv == NULL) {
-			kmod_module_dependency_symbols_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
+/*
+ * Get everything depmod needs from @mod with a single load of its ELF: the
+ * modinfo strings selected by @ex->info_keys, plus the exported and required
+ * symbols, which share one walk over .symtab. Any callback may be NULL. The
+ * result of each part, as returned by the respective kmod_module_foreach_*()
+ * function, is stored in @ex.
+ *
+ * Returns 0 or a negative errno if the module could not be loaded.
+ */
+int kmod_module_extract(const struct kmod_module *mod, struct kmod_module_extract *ex)
+{
+	int err;
 
-		n = kmod_list_append(*list, mv);
-		if (n != NULL)
-			*list = n;
-		else {
-			kmod_module_dependency_symbol_free(mv);
-			kmod_module_dependency_symbols_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
-	}
-	ret = count;
+	ex->info_ret = 0;
+	ex->symbol_ret = 0;
+	ex->dependency_symbol_ret = 0;
 
-list_error:
-	free(symbols);
-	return ret;
+	err = kmod_module_load_elf(mod);
+	if (err)
+		return err;
+
+	if (ex->info != NULL)
+		ex->info_ret = kmod_module_foreach_info(mod, ex->info_keys, ex->info,
+							ex->data);
+
+	if (ex->symbol != NULL || ex->dependency_symbol != NULL)
+		ex->symbol_ret = kmod_elf_foreach_symbols(mod->elf, ex->symbol,
+							  ex->dependency_symbol,
+							  ex->data,
+							  &ex->dependency_symbol_ret);
+
+	return 0;
 }
 
 // clang-format off
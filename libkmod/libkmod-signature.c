@@ -138,7 +138,7 @@ bool kmod_module_signature_info(const struct kmod_file *file,
 	size_t sig_len;
 	bool ret;
 
-	ret = kmod_file_get_contents(file, &contents, &size);
+	ret = kmod_file_get_sparse_contents(file, &contents, &size);
 	if (ret)
 		return false;
 
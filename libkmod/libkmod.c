@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -25,8 +26,11 @@
 #include "libkmod-index.h"
 
 #define KMOD_HASH_SIZE (256)
+#define KMOD_POOL_SHARDS (16)
 #define KMOD_LRU_MAX (128)
+#define KMOD_NEGATIVE_LOOKUPS_MAX (1024)
 #define _KMOD_INDEX_MODULES_SIZE KMOD_INDEX_MODULES_BUILTIN + 1
+#define _KMOD_LOOKUP_SOURCES_SIZE KMOD_LOOKUP_BUILTIN + 1
 
 static const struct {
 	const char *fn;
@@ -41,6 +45,18 @@ static const struct {
 	// clang-format on
 };
 
+static const char *const lookup_source_names[] = {
+	// clang-format off
+	[KMOD_LOOKUP_CONFIG] = "config",
+	[KMOD_LOOKUP_DEP] = "dep",
+	[KMOD_LOOKUP_SYMBOLS] = "symbols",
+	[KMOD_LOOKUP_COMMANDS] = "commands",
+	[KMOD_LOOKUP_ALIASES] = "aliases",
+	[KMOD_LOOKUP_BUILTIN_ALIASES] = "builtin_aliases",
+	[KMOD_LOOKUP_BUILTIN] = "builtin",
+	// clang-format on
+};
+
 static const char *const default_config_paths[] = {
 	// clang-format off
 	SYSCONFDIR "/modprobe.d",
@@ -52,6 +68,24 @@ static const char *const default_config_paths[] = {
 	// clang-format on
 };
 
+/*
+ * The module pool is split in shards so threads looking up different modules
+ * on a thread-safe context don't contend on the same lock
+ */
+struct kmod_pool_shard {
+	pthread_mutex_t lock;
+	struct hash *modules_by_name;
+};
+
+/*
+ * Cached misses are sharded the same way, but lookups far outnumber the
+ * insertions so each shard is protected by a rwlock
+ */
+struct kmod_negative_shard {
+	pthread_rwlock_t lock;
+	struct hash *aliases;
+};
+
 struct kmod_ctx {
 	int refcount;
 	int log_priority;
@@ -62,9 +96,23 @@ struct kmod_ctx {
 	char *dirname;
 	enum kmod_file_compression_type kernel_compression;
 	struct kmod_config *config;
-	struct hash *modules_by_name;
+	bool thread_safe;
+	pthread_mutex_t lock; /* recursive, protects lazily initialized module fields */
+	struct kmod_pool_shard pool[KMOD_POOL_SHARDS];
+	struct kmod_negative_shard negative[KMOD_POOL_SHARDS]; /* cached misses */
 	struct index_mm *indexes[_KMOD_INDEX_MODULES_SIZE];
 	unsigned long long indexes_stamp[_KMOD_INDEX_MODULES_SIZE];
+	char *generation; /* KMOD_INDEX_CURRENT target the indexes were loaded from */
+	bool container; /* indexes loaded from modules.bin */
+	unsigned long long container_dep_stamp; /* of modules.dep.bin matching modules.bin */
+	/* of modules.bin and modules.dep.bin last found not to match */
+	unsigned long long stale_container_stamp, stale_container_dep_stamp;
+	bool stats_enabled;
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t usec;
+	} stats[_KMOD_LOOKUP_SOURCES_SIZE];
 };
 
 void kmod_log(const struct kmod_ctx *ctx, int priority, const char *file, int line,
@@ -221,12 +269,23 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 {
 	const char *env;
 	struct kmod_ctx *ctx;
+	pthread_mutexattr_t attr;
+	size_t i;
 	int err;
 
 	ctx = calloc(1, sizeof(struct kmod_ctx));
 	if (!ctx)
 		return NULL;
 
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ctx->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	for (i = 0; i < KMOD_POOL_SHARDS; i++) {
+		pthread_mutex_init(&ctx->pool[i].lock, NULL);
+		pthread_rwlock_init(&ctx->negative[i].lock, NULL);
+	}
+
 	ctx->refcount = 1;
 	ctx->log_fn = log_filep;
 	ctx->log_data = stderr;
@@ -253,10 +312,13 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 		goto fail;
 	}
 
-	ctx->modules_by_name = hash_new(KMOD_HASH_SIZE, NULL);
-	if (ctx->modules_by_name == NULL) {
-		ERR(ctx, "could not create by-name hash\n");
-		goto fail;
+	for (i = 0; i < KMOD_POOL_SHARDS; i++) {
+		ctx->pool[i].modules_by_name =
+			hash_new(KMOD_HASH_SIZE / KMOD_POOL_SHARDS, NULL);
+		if (ctx->pool[i].modules_by_name == NULL) {
+			ERR(ctx, "could not create by-name hash\n");
+			goto fail;
+		}
 	}
 
 	INFO(ctx, "ctx %p created\n", ctx);
@@ -265,7 +327,12 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 	return ctx;
 
 fail:
-	free(ctx->modules_by_name);
+	for (i = 0; i < KMOD_POOL_SHARDS; i++) {
+		hash_free(ctx->pool[i].modules_by_name);
+		pthread_mutex_destroy(&ctx->pool[i].lock);
+		pthread_rwlock_destroy(&ctx->negative[i].lock);
+	}
+	pthread_mutex_destroy(&ctx->lock);
 	free(ctx->dirname);
 	free(ctx);
 	return NULL;
@@ -275,22 +342,36 @@ KMOD_EXPORT struct kmod_ctx *kmod_ref(struct kmod_ctx *ctx)
 {
 	if (ctx == NULL)
 		return NULL;
-	ctx->refcount++;
+	__atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_RELAXED);
 	return ctx;
 }
 
 KMOD_EXPORT struct kmod_ctx *kmod_unref(struct kmod_ctx *ctx)
 {
+	size_t i;
+
 	if (ctx == NULL)
 		return NULL;
 
-	if (--ctx->refcount > 0)
+	if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_ACQ_REL) > 0)
 		return ctx;
 
 	INFO(ctx, "context %p released\n", ctx);
 
+	for (i = 0; ctx->stats_enabled && i < _KMOD_LOOKUP_SOURCES_SIZE; i++) {
+		DBG(ctx, "lookup stats: source=%s hits=%" PRIu64 " misses=%" PRIu64
+			 " usec=%" PRIu64 "\n",
+		    lookup_source_names[i], ctx->stats[i].hits, ctx->stats[i].misses,
+		    ctx->stats[i].usec);
+	}
+
 	kmod_unload_resources(ctx);
-	hash_free(ctx->modules_by_name);
+	for (i = 0; i < KMOD_POOL_SHARDS; i++) {
+		hash_free(ctx->pool[i].modules_by_name);
+		pthread_mutex_destroy(&ctx->pool[i].lock);
+		pthread_rwlock_destroy(&ctx->negative[i].lock);
+	}
+	pthread_mutex_destroy(&ctx->lock);
 	free(ctx->dirname);
 	if (ctx->config)
 		kmod_config_free(ctx->config);
@@ -299,6 +380,97 @@ KMOD_EXPORT struct kmod_ctx *kmod_unref(struct kmod_ctx *ctx)
 	return NULL;
 }
 
+KMOD_EXPORT int kmod_set_thread_safe(struct kmod_ctx *ctx, bool thread_safe)
+{
+	size_t i;
+
+	if (ctx == NULL)
+		return -ENOENT;
+
+	for (i = 0; i < KMOD_POOL_SHARDS; i++) {
+		if (hash_get_count(ctx->pool[i].modules_by_name) > 0)
+			return -EBUSY;
+	}
+
+	ctx->thread_safe = thread_safe;
+	DBG(ctx, "thread_safe=%d\n", thread_safe);
+
+	return 0;
+}
+
+KMOD_EXPORT bool kmod_get_thread_safe(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return false;
+
+	return ctx->thread_safe;
+}
+
+KMOD_EXPORT int kmod_get_stats(const struct kmod_ctx *ctx,
+			      enum kmod_lookup_source source, uint64_t *hits,
+			      uint64_t *misses, uint64_t *usec)
+{
+	if (ctx == NULL)
+		return -ENOENT;
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wtautological-unsigned-enum-zero-compare"
+#endif
+	if (source < 0 || source >= _KMOD_LOOKUP_SOURCES_SIZE)
+		return -ENOENT;
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+	if (hits != NULL)
+		*hits = __atomic_load_n(&ctx->stats[source].hits, __ATOMIC_RELAXED);
+	if (misses != NULL)
+		*misses = __atomic_load_n(&ctx->stats[source].misses, __ATOMIC_RELAXED);
+	if (usec != NULL)
+		*usec = __atomic_load_n(&ctx->stats[source].usec, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+KMOD_EXPORT int kmod_set_stats(struct kmod_ctx *ctx, bool enable)
+{
+	if (ctx == NULL)
+		return -ENOENT;
+
+	ctx->stats_enabled = enable;
+	DBG(ctx, "stats_enabled=%d\n", enable);
+
+	return 0;
+}
+
+bool kmod_stats_enabled(const struct kmod_ctx *ctx)
+{
+	return ctx->stats_enabled;
+}
+
+void kmod_stats_add(struct kmod_ctx *ctx, enum kmod_lookup_source source, bool hit,
+		    unsigned long long usec)
+{
+	if (hit)
+		__atomic_add_fetch(&ctx->stats[source].hits, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&ctx->stats[source].misses, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx->stats[source].usec, usec, __ATOMIC_RELAXED);
+}
+
+void kmod_lock(struct kmod_ctx *ctx)
+{
+	if (ctx->thread_safe)
+		pthread_mutex_lock(&ctx->lock);
+}
+
+void kmod_unlock(struct kmod_ctx *ctx)
+{
+	if (ctx->thread_safe)
+		pthread_mutex_unlock(&ctx->lock);
+}
+
 KMOD_EXPORT void kmod_set_log_fn(struct kmod_ctx *ctx,
 				 void (*log_fn)(void *data, int priority,
 						const char *file, int line, const char *fn,
@@ -326,11 +498,39 @@ KMOD_EXPORT void kmod_set_log_priority(struct kmod_ctx *ctx, int priority)
 	ctx->log_priority = priority;
 }
 
+static unsigned int kmod_shard_index(const char *key)
+{
+	uint32_t h = 2166136261U;
+
+	/* FNV-1a */
+	for (; *key != '\0'; key++)
+		h = (h ^ (uint8_t)*key) * 16777619U;
+
+	return h % KMOD_POOL_SHARDS;
+}
+
+static struct kmod_pool_shard *kmod_pool_shard(struct kmod_ctx *ctx, const char *key)
+{
+	return &ctx->pool[kmod_shard_index(key)];
+}
+
+void kmod_pool_lock(struct kmod_ctx *ctx, const char *key)
+{
+	if (ctx->thread_safe)
+		pthread_mutex_lock(&kmod_pool_shard(ctx, key)->lock);
+}
+
+void kmod_pool_unlock(struct kmod_ctx *ctx, const char *key)
+{
+	if (ctx->thread_safe)
+		pthread_mutex_unlock(&kmod_pool_shard(ctx, key)->lock);
+}
+
 struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx, const char *key)
 {
 	struct kmod_module *mod;
 
-	mod = hash_find(ctx->modules_by_name, key);
+	mod = hash_find(kmod_pool_shard(ctx, key)->modules_by_name, key);
 
 	DBG(ctx, "get module name='%s' found=%p\n", key, mod);
 
@@ -341,14 +541,32 @@ int kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod, const ch
 {
 	DBG(ctx, "add %p key='%s'\n", mod, key);
 
-	return hash_add(ctx->modules_by_name, key, mod);
+	return hash_add(kmod_pool_shard(ctx, key)->modules_by_name, key, mod);
 }
 
 void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key)
 {
 	DBG(ctx, "del %p key='%s'\n", mod, key);
 
-	hash_del(ctx->modules_by_name, key);
+	hash_del(kmod_pool_shard(ctx, key)->modules_by_name, key);
+}
+
+/*
+ * Log, once, a block of a compressed index that a lookup found corrupted.
+ * Return whether there was one.
+ */
+static bool kmod_check_index(struct kmod_ctx *ctx, enum kmod_index index_number)
+{
+	long block;
+
+	block = index_mm_get_bad_block(ctx->indexes[index_number]);
+	if (block < 0)
+		return false;
+
+	ERR(ctx, "index %s is corrupted: could not uncompress block %ld\n",
+	    index_files[index_number].fn, block);
+
+	return true;
 }
 
 static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
@@ -365,6 +583,7 @@ static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
 		DBG(ctx, "use mmapped index '%s' for name=%s\n",
 		    index_files[index_number].fn, name);
 		realnames = index_mm_searchwild(ctx->indexes[index_number], name);
+		kmod_check_index(ctx, index_number);
 	} else {
 		char fn[PATH_MAX];
 
@@ -437,6 +656,7 @@ static char *lookup_file(struct kmod_ctx *ctx, enum kmod_index index_number,
 		DBG(ctx, "use mmapped index '%s' modname=%s\n",
 		    index_files[index_number].fn, name);
 		line = index_mm_search(ctx->indexes[index_number], name);
+		kmod_check_index(ctx, index_number);
 	} else {
 		struct index_file *idx;
 		char fn[PATH_MAX];
@@ -695,24 +915,87 @@ int kmod_lookup_alias_from_commands(struct kmod_ctx *ctx, const char *name,
 	return nmatch;
 }
 
-void kmod_set_modules_visited(struct kmod_ctx *ctx, bool visited)
+/*
+ * Negative lookup cache
+ *
+ * The result of a lookup only depends on the configuration, which doesn't
+ * change during the lifetime of the context, and on the indexes. Misses are
+ * thus only cached while the indexes are loaded: they are mapped from a fixed
+ * version of the files and the cache is dropped whenever they are loaded or
+ * unloaded, which is what kmod_validate_resources() asks the user to do when
+ * any of the stamps changes.
+ *
+ * Each shard holds at most KMOD_NEGATIVE_LOOKUPS_MAX / KMOD_POOL_SHARDS
+ * entries. A full shard is simply emptied: the cache only saves time, and a
+ * stream of distinct unknown aliases would not benefit from it anyway.
+ */
+static void kmod_negative_lookups_clear(struct kmod_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < KMOD_POOL_SHARDS; i++) {
+		struct kmod_negative_shard *shard = &ctx->negative[i];
+
+		if (ctx->thread_safe)
+			pthread_rwlock_wrlock(&shard->lock);
+		hash_free(shard->aliases);
+		shard->aliases = NULL;
+		if (ctx->thread_safe)
+			pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+bool kmod_negative_lookups_find(struct kmod_ctx *ctx, const char *alias)
 {
-	struct hash_iter iter;
-	const void *v;
+	struct kmod_negative_shard *shard = &ctx->negative[kmod_shard_index(alias)];
+	bool found = false;
+
+	if (ctx->thread_safe)
+		pthread_rwlock_rdlock(&shard->lock);
+	if (shard->aliases != NULL)
+		found = hash_find(shard->aliases, alias) != NULL;
+	if (ctx->thread_safe)
+		pthread_rwlock_unlock(&shard->lock);
 
-	hash_iter_init(ctx->modules_by_name, &iter);
-	while (hash_iter_next(&iter, NULL, &v))
-		kmod_module_set_visited((struct kmod_module *)v, visited);
+	return found;
 }
 
-void kmod_set_modules_required(struct kmod_ctx *ctx, bool required)
+void kmod_negative_lookups_add(struct kmod_ctx *ctx, const char *alias)
 {
-	struct hash_iter iter;
-	const void *v;
+	struct kmod_negative_shard *shard = &ctx->negative[kmod_shard_index(alias)];
+	char *key;
+
+	if (ctx->indexes[KMOD_INDEX_MODULES_DEP] == NULL)
+		return;
+
+	if (ctx->thread_safe)
+		pthread_rwlock_wrlock(&shard->lock);
+
+	if (shard->aliases != NULL &&
+	    hash_get_count(shard->aliases) >= KMOD_NEGATIVE_LOOKUPS_MAX / KMOD_POOL_SHARDS) {
+		DBG(ctx, "negative lookup cache shard full, dropping it\n");
+		hash_free(shard->aliases);
+		shard->aliases = NULL;
+	}
 
-	hash_iter_init(ctx->modules_by_name, &iter);
-	while (hash_iter_next(&iter, NULL, &v))
-		kmod_module_set_required((struct kmod_module *)v, required);
+	if (shard->aliases == NULL) {
+		shard->aliases = hash_new(KMOD_HASH_SIZE / KMOD_POOL_SHARDS, free);
+		if (shard->aliases == NULL)
+			goto out;
+	}
+
+	key = strdup(alias);
+	if (key == NULL)
+		goto out;
+
+	if (hash_add_unique(shard->aliases, key, key) < 0)
+		free(key);
+	else
+		DBG(ctx, "cached miss for alias=%s\n", alias);
+
+out:
+	if (ctx->thread_safe)
+		pthread_rwlock_unlock(&shard->lock);
 }
 
 static bool is_cache_invalid(const char *path, unsigned long long stamp)
@@ -728,6 +1011,65 @@ static bool is_cache_invalid(const char *path, unsigned long long stamp)
 	return false;
 }
 
+/*
+ * Read the generation of indexes published by depmod --atomic: a directory
+ * next to the indexes, whose name changes each time a new set is published.
+ *
+ * A depmod without --atomic, e.g. an older release, writes the indexes in
+ * place and leaves a stale generation behind, so it's only used while
+ * modules.dep.bin is still the symlink into it.
+ */
+static int kmod_read_generation(const struct kmod_ctx *ctx, char *buf, size_t bufsize)
+{
+	static const char target[] = KMOD_INDEX_CURRENT "/modules.dep.bin";
+	char path[PATH_MAX];
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "%s/modules.dep.bin", ctx->dirname);
+
+	len = readlink(path, buf, bufsize);
+	if (len < 0)
+		return -errno;
+	if ((size_t)len != strlen(target) || memcmp(buf, target, len) != 0)
+		return -ENOENT;
+
+	snprintf(path, sizeof(path), "%s/" KMOD_INDEX_CURRENT, ctx->dirname);
+
+	len = readlink(path, buf, bufsize);
+	if (len < 0)
+		return -errno;
+	if ((size_t)len >= bufsize || memchr(buf, '/', len) != NULL)
+		return -EINVAL;
+
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/* path of the index @fn in the generation the indexes are loaded from, if any */
+static void kmod_index_path(const struct kmod_ctx *ctx, const char *fn, char *path,
+			    size_t pathlen)
+{
+	if (ctx->generation != NULL)
+		snprintf(path, pathlen, "%s/%s/%s.bin", ctx->dirname, ctx->generation, fn);
+	else
+		snprintf(path, pathlen, "%s/%s.bin", ctx->dirname, fn);
+}
+
+/*
+ * Stop handing out the stale mappings to other contexts; the ones already
+ * using them keep them until they reload.
+ */
+static void kmod_invalidate_indexes(struct kmod_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL)
+			index_mm_invalidate(ctx->indexes[i]);
+	}
+}
+
 KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
 {
 	struct kmod_list *l;
@@ -743,6 +1085,33 @@ KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
 			return KMOD_RESOURCES_MUST_RECREATE;
 	}
 
+	/* a generation is never modified, only replaced as a whole */
+	if (ctx->generation != NULL) {
+		char gen[NAME_MAX + 1];
+
+		if (kmod_read_generation(ctx, gen, sizeof(gen)) == 0 &&
+		    streq(gen, ctx->generation))
+			return KMOD_RESOURCES_OK;
+
+		kmod_invalidate_indexes(ctx);
+		return KMOD_RESOURCES_MUST_RELOAD;
+	}
+
+	/* all the indexes come from the same file, as long as it matches modules.dep.bin */
+	if (ctx->container) {
+		char path[PATH_MAX], dep[PATH_MAX];
+
+		kmod_index_path(ctx, "modules", path, sizeof(path));
+		kmod_index_path(ctx, index_files[KMOD_INDEX_MODULES_DEP].fn, dep, sizeof(dep));
+		if (is_cache_invalid(path, ctx->indexes_stamp[KMOD_INDEX_MODULES_DEP]) ||
+		    is_cache_invalid(dep, ctx->container_dep_stamp)) {
+			kmod_invalidate_indexes(ctx);
+			return KMOD_RESOURCES_MUST_RELOAD;
+		}
+
+		return KMOD_RESOURCES_OK;
+	}
+
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		char path[PATH_MAX];
 
@@ -751,20 +1120,102 @@ KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
 
 		snprintf(path, sizeof(path), "%s/%s.bin", ctx->dirname, index_files[i].fn);
 
-		if (is_cache_invalid(path, ctx->indexes_stamp[i]))
+		if (is_cache_invalid(path, ctx->indexes_stamp[i])) {
+			kmod_invalidate_indexes(ctx);
 			return KMOD_RESOURCES_MUST_RELOAD;
+		}
 	}
 
 	return KMOD_RESOURCES_OK;
 }
 
-KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
+static bool kmod_indexes_loaded(const struct kmod_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Load all the indexes from modules.bin. It's only used if it has all of
+ * them, otherwise they are loaded from the separate files.
+ *
+ * It's also ignored if it doesn't come from the same depmod run as
+ * modules.dep.bin, e.g. when a depmod unaware of modules.bin rewrote the
+ * separate files afterwards. Since depmod writes it last, that's normally
+ * told by the timestamps alone. The section is only compared to the file when
+ * modules.dep.bin is newer, which also happens if the files were copied. A
+ * mismatch is remembered, so neither is read again until one of them changes.
+ */
+static bool kmod_load_container(struct kmod_ctx *ctx)
+{
+	unsigned long long stamp, dep_stamp;
+	char path[PATH_MAX], dep[PATH_MAX];
+	struct stat st;
+	size_t i;
+
+	kmod_index_path(ctx, "modules", path, sizeof(path));
+	kmod_index_path(ctx, index_files[KMOD_INDEX_MODULES_DEP].fn, dep, sizeof(dep));
+	if (stat(dep, &st) < 0)
+		return false;
+	dep_stamp = stat_mstamp(&st);
+
+	if (dep_stamp == ctx->stale_container_dep_stamp && stat(path, &st) == 0 &&
+	    stat_mstamp(&st) == ctx->stale_container_stamp) {
+		DBG(ctx, "%s is known not to match %s, ignoring it\n", path, dep);
+		return false;
+	}
+
+	if (index_mm_open_container(ctx, path, &stamp, ctx->indexes,
+				    _KMOD_INDEX_MODULES_SIZE) < 0)
+		return false;
+
+	if (ctx->indexes[KMOD_INDEX_MODULES_DEP] == NULL ||
+	    (dep_stamp > stamp &&
+	     !index_mm_matches_file(ctx->indexes[KMOD_INDEX_MODULES_DEP], dep))) {
+		DBG(ctx, "%s doesn't match %s, ignoring it\n", path, dep);
+		ctx->stale_container_stamp = stamp;
+		ctx->stale_container_dep_stamp = dep_stamp;
+		goto fail;
+	}
+	ctx->container_dep_stamp = dep_stamp;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		/* see kmod_load_indexes() */
+		if (ctx->indexes[i] == NULL && i != KMOD_INDEX_MODULES_BUILTIN_ALIAS) {
+			DBG(ctx, "%s has no %s, ignoring it\n", path, index_files[i].fn);
+			goto fail;
+		}
+		ctx->indexes_stamp[i] = stamp;
+	}
+
+	ctx->container = true;
+
+	return true;
+
+fail:
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL) {
+			index_mm_close(ctx->indexes[i]);
+			ctx->indexes[i] = NULL;
+		}
+	}
+
+	return false;
+}
+
+static int kmod_load_indexes(struct kmod_ctx *ctx)
 {
 	int ret = 0;
 	size_t i;
 
-	if (ctx == NULL)
-		return -ENOENT;
+	if (!kmod_indexes_loaded(ctx) && kmod_load_container(ctx))
+		return 0;
 
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		char path[PATH_MAX];
@@ -774,7 +1225,7 @@ KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
 			continue;
 		}
 
-		snprintf(path, sizeof(path), "%s/%s.bin", ctx->dirname, index_files[i].fn);
+		kmod_index_path(ctx, index_files[i].fn, path, sizeof(path));
 		ret = index_mm_open(ctx, path, &ctx->indexes_stamp[i], &ctx->indexes[i]);
 
 		/*
@@ -789,6 +1240,47 @@ KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
 		}
 	}
 
+	return ret;
+}
+
+KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
+{
+	char gen[NAME_MAX + 1];
+	int ret, retries = 3;
+
+	if (ctx == NULL)
+		return -ENOENT;
+
+	kmod_negative_lookups_clear(ctx);
+
+	/* indexes loaded from the plain paths can't be tracked by generation */
+	if (ctx->generation != NULL || kmod_indexes_loaded(ctx))
+		goto load;
+
+	/*
+	 * Check the generation again once all the indexes are open: if it
+	 * changed meanwhile, they may come from different sets
+	 */
+	while (kmod_read_generation(ctx, gen, sizeof(gen)) == 0) {
+		ctx->generation = strdup(gen);
+		if (ctx->generation == NULL)
+			return -ENOMEM;
+
+		ret = kmod_load_indexes(ctx);
+		if (kmod_read_generation(ctx, gen, sizeof(gen)) == 0 &&
+		    streq(gen, ctx->generation))
+			goto done;
+
+		kmod_unload_resources(ctx);
+		if (--retries == 0) {
+			ERR(ctx, "indexes at %s keep changing\n", ctx->dirname);
+			return -EAGAIN;
+		}
+	}
+
+load:
+	ret = kmod_load_indexes(ctx);
+done:
 	if (ret)
 		kmod_unload_resources(ctx);
 
@@ -802,6 +1294,8 @@ KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 	if (ctx == NULL)
 		return;
 
+	kmod_negative_lookups_clear(ctx);
+
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		if (ctx->indexes[i] != NULL) {
 			index_mm_close(ctx->indexes[i]);
@@ -809,6 +1303,11 @@ KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 			ctx->indexes_stamp[i] = 0;
 		}
 	}
+
+	free(ctx->generation);
+	ctx->generation = NULL;
+	ctx->container = false;
+	ctx->container_dep_stamp = 0;
 }
 
 KMOD_EXPORT int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type, int fd)
@@ -828,6 +1327,11 @@ KMOD_EXPORT int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type, int
 
 	if (ctx->indexes[type] != NULL) {
 		DBG(ctx, "use mmapped index '%s'\n", index_files[type].fn);
+		if (index_mm_verify(ctx->indexes[type]) < 0) {
+			if (!kmod_check_index(ctx, type))
+				ERR(ctx, "index %s is corrupted\n", index_files[type].fn);
+			return -EBADMSG;
+		}
 		index_mm_dump(ctx->indexes[type], fd, index_files[type].alias_prefix);
 	} else {
 		char fn[PATH_MAX];
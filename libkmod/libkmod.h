@@ -95,6 +95,9 @@ struct kmod_ctx *kmod_unref(struct kmod_ctx *ctx);
  * udev that on boot issues hundreds of calls to lookup the index, calling
  * this function will speedup the searches.
  *
+ * When the indexes were published by depmod --atomic, they are all loaded from
+ * the same generation, even if a new one is published meanwhile.
+ *
  * Returns: 0 on success or < 0 otherwise.
  *
  * Since: 1
@@ -144,6 +147,9 @@ enum kmod_resources {
  * Check if indexes and configuration files changed on disk and the current
  * context is not valid anymore.
  *
+ * Indexes published by depmod --atomic are checked as a whole, with a single
+ * lookup of the current generation.
+ *
  * Returns: the resources state, valid states are #kmod_resources.
  *
  * Since: 3
@@ -186,6 +192,69 @@ enum kmod_index {
  */
 int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type, int fd);
 
+/**
+ * kmod_lookup_source:
+ * @KMOD_LOOKUP_CONFIG: aliases from the configuration files
+ * @KMOD_LOOKUP_DEP: module names in modules.dep
+ * @KMOD_LOOKUP_SYMBOLS: symbol aliases in modules.symbols
+ * @KMOD_LOOKUP_COMMANDS: install and remove commands from the configuration files
+ * @KMOD_LOOKUP_ALIASES: module aliases in modules.alias
+ * @KMOD_LOOKUP_BUILTIN_ALIASES: builtin module aliases in modules.builtin.alias
+ * @KMOD_LOOKUP_BUILTIN: builtin module names in modules.builtin
+ * @_KMOD_LOOKUP_PAD: DO NOT USE; padding to make sure enum is not mapped to char
+ *
+ * The sources consulted by kmod_module_new_from_lookup() and
+ * kmod_module_new_from_name_lookup(), used by kmod_get_stats().
+ */
+enum kmod_lookup_source {
+	KMOD_LOOKUP_CONFIG = 0,
+	KMOD_LOOKUP_DEP,
+	KMOD_LOOKUP_SYMBOLS,
+	KMOD_LOOKUP_COMMANDS,
+	KMOD_LOOKUP_ALIASES,
+	KMOD_LOOKUP_BUILTIN_ALIASES,
+	KMOD_LOOKUP_BUILTIN,
+	_KMOD_LOOKUP_PAD = 1U << 31,
+};
+
+/**
+ * kmod_get_stats:
+ * @ctx: kmod library context
+ * @source: lookup source, valid sources are #kmod_lookup_source
+ * @hits: where to store the number of lookups resolved by @source, or NULL
+ * @misses: where to store the number of lookups @source didn't resolve, or NULL
+ * @usec: where to store the time spent in @source in microseconds, or NULL
+ *
+ * Retrieve the counters of @source accumulated by the lookups done with @ctx
+ * while the statistics were enabled with kmod_set_stats(). Sources that can't
+ * possibly match a key, e.g. module names for a modalias, are skipped and not
+ * accounted for. The counters of all the sources are also logged with debug
+ * priority when @ctx is released.
+ *
+ * Returns: 0 on success or < 0 otherwise: -ENOENT if @ctx is NULL or
+ * @source is not a valid source.
+ *
+ * Since: 35
+ */
+int kmod_get_stats(const struct kmod_ctx *ctx, enum kmod_lookup_source source,
+		   uint64_t *hits, uint64_t *misses, uint64_t *usec);
+
+/**
+ * kmod_set_stats:
+ * @ctx: kmod library context
+ * @enable: whether to account the lookups done with @ctx
+ *
+ * Lookup statistics are disabled by default since they cost two clock reads
+ * for every source consulted. Enable them to have the counters returned by
+ * kmod_get_stats() updated. Disabling them keeps the counters accumulated so
+ * far.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ *
+ * Since: 35
+ */
+int kmod_set_stats(struct kmod_ctx *ctx, bool enable);
+
 /**
  * kmod_set_log_priority:
  * @ctx: kmod library context
@@ -263,6 +332,41 @@ void *kmod_get_userdata(const struct kmod_ctx *ctx);
  */
 const char *kmod_get_dirname(const struct kmod_ctx *ctx);
 
+/**
+ * kmod_set_thread_safe:
+ * @ctx: kmod library context
+ * @thread_safe: whether @ctx may be used from several threads at once
+ *
+ * By default a library context and the modules created from it must only be
+ * used by one thread at a time. When @thread_safe is true, module lookups,
+ * reference counting and the lazily loaded module information are
+ * synchronized, so a single context and its loaded resources can be shared
+ * among threads. kmod_load_resources(), kmod_unload_resources() and the
+ * setters of the context itself are still expected to be called before the
+ * threads start or after they are done.
+ *
+ * The mode can only be changed before any module is created.
+ *
+ * Returns: 0 on success or < 0 on failure: -EBUSY if there are modules
+ * already created for @ctx.
+ *
+ * Since: 35
+ */
+int kmod_set_thread_safe(struct kmod_ctx *ctx, bool thread_safe);
+
+/**
+ * kmod_get_thread_safe:
+ * @ctx: kmod library context
+ *
+ * Check whether @ctx was switched to thread-safe mode with
+ * kmod_set_thread_safe().
+ *
+ * Returns: true if @ctx may be shared among threads
+ *
+ * Since: 35
+ */
+bool kmod_get_thread_safe(const struct kmod_ctx *ctx);
+
 /**
  * SECTION:libkmod-list
  * @short_description: general purpose list
@@ -1120,6 +1224,35 @@ const char *kmod_module_dependency_symbol_get_symbol(const struct kmod_list *ent
  */
 void kmod_module_dependency_symbols_free_list(struct kmod_list *list);
 
+/**
+ * kmod_module_foreach_dependency_symbol:
+ * @mod: kmod module
+ * @cb: function called for each entry
+ * @data: data passed to @cb
+ *
+ * Iterate over the same entries returned by
+ * kmod_module_get_dependency_symbols(), in the same order, without building a
+ * list.
+ *
+ * @symbol given to @cb points directly into the module and is only valid
+ * during the call. It's nul terminated and @len is its length, so callers
+ * don't need to compute it again. @bind is either %KMOD_SYMBOL_UNDEF or
+ * %KMOD_SYMBOL_WEAK.
+ *
+ * If @cb returns < 0 the iteration stops and that value is returned. Entries
+ * already passed to @cb are not retracted if an error is found later on.
+ *
+ * Returns: number of entries passed to @cb on success or < 0 otherwise.
+ *
+ * Since: 35
+ */
+int kmod_module_foreach_dependency_symbol(const struct kmod_module *mod,
+					  int (*cb)(const char *symbol, size_t len,
+						    uint64_t crc,
+						    enum kmod_symbol_bind bind,
+						    void *data),
+					  void *data);
+
 /**
  * kmod_module_get_sections:
  * @mod: kmod module
@@ -1228,6 +1361,32 @@ const char *kmod_module_symbol_get_symbol(const struct kmod_list *entry);
  */
 void kmod_module_symbols_free_list(struct kmod_list *list);
 
+/**
+ * kmod_module_foreach_symbol:
+ * @mod: kmod module
+ * @cb: function called for each entry
+ * @data: data passed to @cb
+ *
+ * Iterate over the same entries returned by kmod_module_get_symbols(), in the
+ * same order, without building a list.
+ *
+ * @symbol given to @cb points directly into the module and is only valid
+ * during the call. It's nul terminated and @len is its length, so callers
+ * don't need to compute it again. @bind is the binding of the symbol,
+ * %KMOD_SYMBOL_GLOBAL when falling back to "__ksymtab_strings".
+ *
+ * If @cb returns < 0 the iteration stops and that value is returned. Entries
+ * already passed to @cb are not retracted if an error is found later on.
+ *
+ * Returns: number of entries passed to @cb on success or < 0 otherwise.
+ *
+ * Since: 35
+ */
+int kmod_module_foreach_symbol(const struct kmod_module *mod,
+			       int (*cb)(const char *symbol, size_t len, uint64_t crc,
+					 enum kmod_symbol_bind bind, void *data),
+			       void *data);
+
 /**
  * kmod_module_get_versions:
  * @mod: kmod module
@@ -1282,6 +1441,31 @@ const char *kmod_module_version_get_symbol(const struct kmod_list *entry);
  */
 void kmod_module_versions_free_list(struct kmod_list *list);
 
+/**
+ * kmod_module_foreach_version:
+ * @mod: kmod module
+ * @cb: function called for each entry
+ * @data: data passed to @cb
+ *
+ * Iterate over the same entries returned by kmod_module_get_versions(), in the
+ * same order, without building a list.
+ *
+ * @symbol given to @cb points directly into the module and is only valid
+ * during the call. It's nul terminated and @len is its length, so callers
+ * don't need to compute it again. @bind is always %KMOD_SYMBOL_UNDEF.
+ *
+ * If @cb returns < 0 the iteration stops and that value is returned. Entries
+ * already passed to @cb are not retracted if an error is found later on.
+ *
+ * Returns: number of entries passed to @cb on success or < 0 otherwise.
+ *
+ * Since: 35
+ */
+int kmod_module_foreach_version(const struct kmod_module *mod,
+				int (*cb)(const char *symbol, size_t len, uint64_t crc,
+					  enum kmod_symbol_bind bind, void *data),
+				void *data);
+
 /**
  * kmod_module_get_info:
  * @mod: kmod module
@@ -1341,6 +1525,59 @@ const char *kmod_module_info_get_value(const struct kmod_list *entry);
  */
 void kmod_module_info_free_list(struct kmod_list *list);
 
+/**
+ * kmod_module_info_keys:
+ * @KMOD_MODULE_INFO_ALIAS: "alias" entries
+ * @KMOD_MODULE_INFO_SOFTDEP: "softdep" entries
+ * @KMOD_MODULE_INFO_WEAKDEP: "weakdep" entries
+ * @KMOD_MODULE_INFO_DEPENDS: "depends" entries
+ * @KMOD_MODULE_INFO_FIRMWARE: "firmware" entries
+ * @KMOD_MODULE_INFO_OTHER: any other entry in ".modinfo"
+ * @KMOD_MODULE_INFO_BUILD_ID: "build-id" from the ELF note
+ * @KMOD_MODULE_INFO_SIGNATURE: the signature entries: sig_id, signer, sig_key,
+ * sig_hashalgo and signature
+ * @KMOD_MODULE_INFO_ALL: everything returned by kmod_module_get_info()
+ *
+ * Sets of keys to be passed to kmod_module_foreach_info().
+ */
+enum kmod_module_info_keys {
+	KMOD_MODULE_INFO_ALIAS = 0x1,
+	KMOD_MODULE_INFO_SOFTDEP = 0x2,
+	KMOD_MODULE_INFO_WEAKDEP = 0x4,
+	KMOD_MODULE_INFO_DEPENDS = 0x8,
+	KMOD_MODULE_INFO_FIRMWARE = 0x10,
+	KMOD_MODULE_INFO_OTHER = 0x20,
+	KMOD_MODULE_INFO_BUILD_ID = 0x40,
+	KMOD_MODULE_INFO_SIGNATURE = 0x80,
+	KMOD_MODULE_INFO_ALL = 0xff,
+};
+
+/**
+ * kmod_module_foreach_info:
+ * @mod: kmod module
+ * @keys: bitmask of #kmod_module_info_keys selecting the entries of interest
+ * @cb: function called for each selected entry
+ * @data: data passed to @cb
+ *
+ * Iterate over the same entries returned by kmod_module_get_info(), in the
+ * same order, but only the ones selected by @keys and without building a list.
+ * @key and @value given to @cb point directly into the module and are only
+ * valid during the call. They are not necessarily nul terminated: use
+ * @keylen and @valuelen. The build-id and signature are only parsed if
+ * requested in @keys.
+ *
+ * If @cb returns < 0 the iteration stops and that value is returned. Entries
+ * already passed to @cb are not retracted if an error is found later on.
+ *
+ * Returns: number of entries passed to @cb on success or < 0 otherwise.
+ *
+ * Since: 35
+ */
+int kmod_module_foreach_info(const struct kmod_module *mod, unsigned int keys,
+			     int (*cb)(const char *key, size_t keylen, const char *value,
+				       size_t valuelen, void *data),
+			     void *data);
+
 /**
  * SECTION:libkmod-loaded
  * @short_description: currently loaded modules
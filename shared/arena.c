@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "util.h"
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+void arena_init(struct arena *arena, size_t chunk_size)
+{
+	arena->chunks = NULL;
+	arena->chunk_size = chunk_size;
+}
+
+void arena_release(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	size_t chunk_size, alloc_size;
+	void *p;
+
+	if (uaddsz_overflow(size, ARENA_ALIGN - 1, &size))
+		return NULL;
+	size &= ~(ARENA_ALIGN - 1);
+
+	if (chunk != NULL && chunk->size - chunk->used >= size) {
+		p = (char *)chunk->data + chunk->used;
+		chunk->used += size;
+		return p;
+	}
+
+	chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+	if (uaddsz_overflow(sizeof(*chunk), chunk_size, &alloc_size))
+		return NULL;
+
+	chunk = malloc(alloc_size);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->size = chunk_size;
+	chunk->used = size;
+
+	/*
+	 * Big allocations get a chunk of their own: keep using the current one
+	 * if it still has more room than the new one
+	 */
+	if (arena->chunks != NULL &&
+	    chunk->size - chunk->used < arena->chunks->size - arena->chunks->used) {
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	return chunk->data;
+}
+
+void *arena_zalloc(struct arena *arena, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (p != NULL)
+		memset(p, 0, size);
+
+	return p;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *s;
+
+	if (uaddsz_overflow(len, 1, &len))
+		return NULL;
+
+	s = arena_alloc(arena, len);
+	if (s == NULL)
+		return NULL;
+
+	memcpy(s, str, len - 1);
+	s[len - 1] = '\0';
+
+	return s;
+}
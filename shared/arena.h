@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <stddef.h>
+
+#include "macro.h"
+
+/*
+ * Bump allocator for data that lives until the end of the program, or of a
+ * well defined phase of it. Nothing is freed individually: everything goes
+ * away at once with arena_release().
+ */
+struct arena_chunk;
+struct arena {
+	struct arena_chunk *chunks;
+	size_t chunk_size;
+};
+
+void arena_init(struct arena *arena, size_t chunk_size);
+void arena_release(struct arena *arena);
+
+/*
+ * Return @size bytes, suitably aligned for any type. The memory is not
+ * initialized.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_zalloc(struct arena *arena, size_t size);
+
+/*
+ * Copy @len bytes from @str and add a terminating NUL
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
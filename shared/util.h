@@ -175,6 +175,11 @@ static inline bool simple_umulsz_overflow(size_t a, size_t b, size_t *res)
 		uint64_t *: umul64_overflow, \
 		default: simple_umulsz_overflow)(a, b, res)
 
+/*
+ * CRC-32 as used by zlib, continuing from @crc: start with 0
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
 #define TAKE_PTR(x)                \
 	({                         \
 		typeof(x) x__ = x; \
@@ -244,7 +244,7 @@ long init_module(void *mem, unsigned long len, _maybe_unused_ const char *args)
 		return -1;
 	}
 
-	err = kmod_elf_new(mem, len, &elf);
+	err = kmod_elf_new(mem, len, false, &elf);
 	if (err < 0) {
 		errno = -err;
 		return -1;
@@ -164,6 +164,50 @@ static void *get_libc_func(const char *f)
 		return _fn(ver, p, st);                                              \
 	}
 
+TS_EXPORT ssize_t readlink(const char *path, char *linkbuf, size_t bufsiz)
+{
+	const char *p;
+	char buf[PATH_MAX * 2];
+	static ssize_t (*_fn)(const char *path, char *linkbuf, size_t bufsiz);
+
+	/* fd_lookup_path() needs the real links of the open file descriptors */
+	if (strstartswith(path, "/proc/self/fd/"))
+		p = path;
+	else
+		p = trap_path(path, buf);
+	if (p == NULL)
+		return -1;
+
+	if (_fn == NULL)
+		_fn = get_libc_func("readlink");
+	return _fn(p, linkbuf, bufsiz);
+}
+
+/* the random suffix is filled in the trapped copy and has to be copied back */
+TS_EXPORT char *mkdtemp(char *template)
+{
+	const char *p;
+	char buf[PATH_MAX * 2];
+	static char *(*_fn)(char *template);
+	size_t len;
+
+	p = trap_path(template, buf);
+	if (p == NULL)
+		return NULL;
+
+	if (_fn == NULL)
+		_fn = get_libc_func("mkdtemp");
+	if (p == template)
+		return _fn(template);
+
+	if (_fn(buf) == NULL)
+		return NULL;
+
+	len = strlen(template);
+	memcpy(template, buf + strlen(buf) - len, len);
+	return template;
+}
+
 WRAP_1ARG(DIR *, NULL, opendir);
 WRAP_1ARG(int, -1, chdir);
 WRAP_1ARG(int, -1, remove);
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shared/arena.h>
+#include <shared/util.h>
+
+#include "testsuite.h"
+
+static int test_arena_alloc(void)
+{
+	const size_t align = _Alignof(max_align_t);
+	struct arena arena;
+	char *a, *b, *c;
+
+	arena_init(&arena, 64);
+	a = arena_alloc(&arena, 1);
+	b = arena_alloc(&arena, 3);
+	c = arena_alloc(&arena, 17);
+	TS_ASSERT(a != NULL && b != NULL && c != NULL);
+	TS_ASSERT(((uintptr_t)a & (align - 1)) == 0);
+	TS_ASSERT(((uintptr_t)b & (align - 1)) == 0);
+	TS_ASSERT(((uintptr_t)c & (align - 1)) == 0);
+	TS_ASSERT(b > a);
+	memset(a, 'a', 1);
+	memset(b, 'b', 3);
+	memset(c, 'c', 17);
+	TS_ASSERT(a[0] == 'a');
+	TS_ASSERT(b[2] == 'b');
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_alloc, .description = "test arena aligned allocations");
+
+static int test_arena_big_alloc(void)
+{
+	const size_t align = _Alignof(max_align_t);
+	struct arena arena;
+	char *a, *big, *b;
+
+	arena_init(&arena, 64);
+	a = arena_alloc(&arena, align);
+	big = arena_zalloc(&arena, 4096);
+	b = arena_alloc(&arena, align);
+	TS_ASSERT(a != NULL && big != NULL && b != NULL);
+	for (size_t i = 0; i < 4096; i++)
+		TS_ASSERT(big[i] == 0);
+
+	/* the big allocation got its own chunk, the small ones keep going */
+	TS_ASSERT(b == a + align);
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_big_alloc, .description = "test arena allocation bigger than chunk");
+
+static int test_arena_strndup(void)
+{
+	struct arena arena;
+	char *s1, *s2;
+
+	arena_init(&arena, 16);
+	s1 = arena_strndup(&arena, "foobar", 3);
+	s2 = arena_strndup(&arena, "0123456789abcdefghij", 20);
+	TS_ASSERT(s1 != NULL && s2 != NULL);
+	TS_ASSERT(streq(s1, "foo"));
+	TS_ASSERT(streq(s2, "0123456789abcdefghij"));
+	arena_release(&arena);
+	TS_ASSERT(arena.chunks == NULL);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_strndup, .description = "test arena strndup");
+
+TESTSUITE_MAIN();
@@ -3,13 +3,23 @@
  * Copyright (C) 2012-2013  ProFUSION embedded systems
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
 
 #include "testsuite.h"
 
@@ -241,4 +251,320 @@ DEFINE_TEST(depmod_check_weakdep,
 		},
 	});
 
+#define ATOMIC_ROOTFS TESTSUITE_ROOTFS "test-depmod/atomic"
+#define ATOMIC_LIB_MODULES ATOMIC_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+
+static bool depmod_atomic_run(void)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		EXEC_TOOL(depmod, "--atomic");
+		_exit(EXIT_FAILURE);
+	}
+
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	       WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static int depmod_atomic_generations(void)
+{
+	struct dirent *de;
+	int n = 0;
+	DIR *d;
+
+	d = opendir(MODULE_DIRECTORY "/" MODULES_UNAME);
+	if (d == NULL)
+		return -1;
+
+	while ((de = readdir(d)) != NULL) {
+		if (strstartswith(de->d_name, "modules.gen."))
+			n++;
+	}
+	closedir(d);
+
+	return n;
+}
+
+static bool depmod_atomic_has(struct kmod_ctx *ctx, const char *modname)
+{
+	struct kmod_module *mod = NULL;
+	bool found;
+
+	if (kmod_module_new_from_name_lookup(ctx, modname, &mod) < 0)
+		return false;
+
+	found = mod != NULL;
+	kmod_module_unref(mod);
+
+	return found;
+}
+
+static int depmod_atomic(void)
+{
+	struct kmod_ctx *ctx;
+	int err;
+
+	TS_ASSERT(depmod_atomic_run());
+	TS_ASSERT(depmod_atomic_generations() == 1);
+
+	ctx = kmod_new(NULL, NULL);
+	TS_ASSERT(ctx != NULL);
+
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(depmod_atomic_has(ctx, "mod-simple"));
+	TS_ASSERT(kmod_validate_resources(ctx) == KMOD_RESOURCES_OK);
+
+	/* the second generation replaces the first one as a whole */
+	TS_ASSERT(chdir(MODULE_DIRECTORY "/" MODULES_UNAME) == 0);
+	TS_ASSERT(unlink("kernel/mod-simple.ko") == 0);
+	TS_ASSERT(depmod_atomic_run());
+	TS_ASSERT(depmod_atomic_generations() == 1);
+
+	TS_ASSERT(kmod_validate_resources(ctx) == KMOD_RESOURCES_MUST_RELOAD);
+	kmod_unload_resources(ctx);
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(!depmod_atomic_has(ctx, "mod-simple"));
+	TS_ASSERT(depmod_atomic_has(ctx, "mod-loop-a"));
+
+	/*
+	 * Replacing the modules.dep.bin symlink with a regular file, as a depmod
+	 * without --atomic does, leaves the generation stale: the indexes must be
+	 * reloaded from the plain paths
+	 */
+	TS_ASSERT(rename("modules.current/modules.dep.bin", "modules.dep.bin") == 0);
+	TS_ASSERT(kmod_validate_resources(ctx) == KMOD_RESOURCES_MUST_RELOAD);
+	kmod_unload_resources(ctx);
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(depmod_atomic_has(ctx, "mod-loop-a"));
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(depmod_atomic,
+	.description = "check if depmod --atomic publishes each generation as a whole",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = ATOMIC_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ ATOMIC_LIB_MODULES "/correct-modules.dep",
+			  ATOMIC_LIB_MODULES "/modules.dep" },
+			{ },
+		},
+	});
+
+#define MANIFEST_ROOTFS TESTSUITE_ROOTFS "test-depmod/manifest"
+
+/*
+ * Times far from now and from each other, so they don't depend on how fast
+ * the test runs: modules and directories are older than modules.dep, unless
+ * made newer on purpose.
+ */
+#define MANIFEST_T_OLD 1000000000
+#define MANIFEST_T_DEP (MANIFEST_T_OLD + 100)
+#define MANIFEST_T_NEW (MANIFEST_T_OLD + 200)
+
+static int manifest_set_mtime(const char *path, time_t sec)
+{
+	struct timespec times[2] = { { .tv_sec = sec }, { .tv_sec = sec } };
+
+	if (utimensat(AT_FDCWD, path, times, 0) < 0)
+		return -errno;
+	return 0;
+}
+
+/* write the contents of @src over @dst, with @sec as modification time */
+static int manifest_copy(const char *src, const char *dst, time_t sec)
+{
+	char buf[4096];
+	ssize_t n;
+	int in, out, err = 0;
+
+	in = open(src, O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return -errno;
+
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		err = -errno;
+		close(in);
+		return err;
+	}
+
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, n) != n) {
+			err = -EIO;
+			break;
+		}
+	}
+	if (n < 0)
+		err = -errno;
+
+	close(in);
+	close(out);
+
+	return err < 0 ? err : manifest_set_mtime(dst, sec);
+}
+
+static bool depmod_manifest_run(bool quick)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		if (quick)
+			EXEC_TOOL(depmod, "-A");
+		else
+			EXEC_TOOL(depmod);
+		_exit(EXIT_FAILURE);
+	}
+
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	       WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* regenerate the files from a tree older than modules.dep */
+static bool depmod_manifest_reset(void)
+{
+	/* the directories last, as setting the times of the files changes them */
+	static const char *const paths[] = {
+		"kernel/mod-simple.ko",
+		"kernel/drivers/mod-loop-a.ko",
+		"kernel/drivers/mod-hidden.ko",
+		"kernel/drivers/mod-hidden2.ko",
+		"kernel/drivers/new/mod-new.ko",
+		"updates/mod-update.ko",
+		"extra/mod-loop-b.ko",
+		"kernel/drivers/new",
+		"kernel/drivers",
+		"kernel",
+		"updates",
+		"extra",
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
+		int err = manifest_set_mtime(paths[i], MANIFEST_T_OLD);
+		if (err < 0 && err != -ENOENT)
+			return false;
+	}
+
+	if (!depmod_manifest_run(false))
+		return false;
+
+	return manifest_set_mtime("modules.dep", MANIFEST_T_DEP) == 0;
+}
+
+static bool depmod_manifest_regenerated(void)
+{
+	struct stat st;
+
+	return stat("modules.dep", &st) == 0 && st.st_mtim.tv_sec != MANIFEST_T_DEP;
+}
+
+static bool depmod_manifest_has(const char *relpath)
+{
+	char buf[4096];
+	ssize_t n;
+	int fd;
+
+	fd = open("modules.dep", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	n = read_str_safe(fd, buf, sizeof(buf));
+	close(fd);
+
+	return n > 0 && strstr(buf, relpath) != NULL;
+}
+
+static int depmod_manifest(void)
+{
+	struct stat st;
+
+	TS_ASSERT(chdir(MODULE_DIRECTORY "/" MODULES_UNAME) == 0);
+
+	/*
+	 * Unchanged: only the modules listed are checked, so a module hidden by
+	 * restoring the time of its directory isn't noticed. The directory
+	 * excluded by the configuration isn't taken as a new one either.
+	 */
+	TS_ASSERT(depmod_manifest_reset());
+	TS_ASSERT(manifest_copy("kernel/mod-simple.ko", "kernel/drivers/mod-hidden.ko",
+				MANIFEST_T_NEW) == 0);
+	TS_ASSERT(manifest_set_mtime("kernel/drivers", MANIFEST_T_OLD) == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(!depmod_manifest_regenerated());
+
+	/* truncated, even at the end of a line: all the directories are read */
+	TS_ASSERT(stat("modules.manifest", &st) == 0);
+	TS_ASSERT(truncate("modules.manifest", st.st_size - strlen("end\n")) == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(depmod_manifest_regenerated());
+	TS_ASSERT(depmod_manifest_has("kernel/drivers/mod-hidden.ko"));
+
+	/* missing: the same */
+	TS_ASSERT(depmod_manifest_reset());
+	TS_ASSERT(manifest_copy("kernel/mod-simple.ko", "kernel/drivers/mod-hidden2.ko",
+				MANIFEST_T_NEW) == 0);
+	TS_ASSERT(manifest_set_mtime("kernel/drivers", MANIFEST_T_OLD) == 0);
+	TS_ASSERT(unlink("modules.manifest") == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(depmod_manifest_regenerated());
+	TS_ASSERT(depmod_manifest_has("kernel/drivers/mod-hidden2.ko"));
+
+	/* a module overwritten in place, with a newer time */
+	TS_ASSERT(depmod_manifest_reset());
+	TS_ASSERT(manifest_copy("kernel/drivers/mod-loop-a.ko",
+				"kernel/drivers/mod-hidden.ko", MANIFEST_T_NEW) == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(depmod_manifest_regenerated());
+
+	/* a removed module */
+	TS_ASSERT(depmod_manifest_reset());
+	TS_ASSERT(unlink("kernel/drivers/mod-hidden2.ko") == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(depmod_manifest_regenerated());
+	TS_ASSERT(!depmod_manifest_has("kernel/drivers/mod-hidden2.ko"));
+
+	/* new subdirectories, even with modules older than modules.dep */
+	TS_ASSERT(depmod_manifest_reset());
+	TS_ASSERT(mkdir("kernel/drivers/new", 0755) == 0);
+	TS_ASSERT(manifest_copy("kernel/mod-simple.ko", "kernel/drivers/new/mod-new.ko",
+				MANIFEST_T_OLD) == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(depmod_manifest_regenerated());
+	TS_ASSERT(depmod_manifest_has("kernel/drivers/new/mod-new.ko"));
+
+	TS_ASSERT(depmod_manifest_reset());
+	TS_ASSERT(mkdir("updates", 0755) == 0);
+	TS_ASSERT(manifest_copy("kernel/mod-simple.ko", "updates/mod-update.ko",
+				MANIFEST_T_OLD) == 0);
+	TS_ASSERT(depmod_manifest_run(true));
+	TS_ASSERT(depmod_manifest_regenerated());
+	TS_ASSERT(depmod_manifest_has("updates/mod-update.ko"));
+
+	/* the excluded directory is still left out */
+	TS_ASSERT(!depmod_manifest_has("mod-loop-b.ko"));
+
+	return 0;
+}
+DEFINE_TEST(depmod_manifest,
+	.description = "check if depmod -A uses modules.manifest to tell if the files are up to date",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = MANIFEST_ROOTFS,
+	});
+
 TESTSUITE_MAIN();
@@ -4,12 +4,15 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <shared/macro.h>
 
@@ -54,6 +57,373 @@ DEFINE_TEST_WITH_FUNC(
 		[TC_UNAME_R] = "5.6.0",
 	});
 
+#define CONTAINER_ROOTFS TESTSUITE_ROOTFS "test-init-load-resources-container/"
+
+/* make @fn in the directory of @ctx newer than the other indexes */
+static int container_touch(struct kmod_ctx *ctx, const char *fn)
+{
+	if (chdir(kmod_get_dirname(ctx)) < 0)
+		return -errno;
+	if (utimensat(AT_FDCWD, fn, NULL, 0) < 0)
+		return -errno;
+	return 0;
+}
+
+static bool container_has(struct kmod_ctx *ctx, const char *alias)
+{
+	struct kmod_list *list = NULL;
+	bool found;
+
+	if (kmod_module_new_from_lookup(ctx, alias, &list) < 0)
+		return false;
+
+	found = list != NULL;
+	kmod_module_unref_list(list);
+
+	return found;
+}
+
+static int container_dump(struct kmod_ctx *ctx, enum kmod_index type)
+{
+	int fd, err;
+
+	fd = open("modules.dump", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	err = kmod_dump_index(ctx, type, fd);
+	close(fd);
+
+	return err;
+}
+
+/* overwrite the first byte of @fn, keeping its timestamps; returns the old one */
+static int container_poke(const char *fn, char c)
+{
+	struct timespec times[2];
+	struct stat st;
+	char old;
+	int fd, err = 0;
+
+	fd = open(fn, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || pread(fd, &old, 1, 0) != 1 || pwrite(fd, &c, 1, 0) != 1) {
+		err = -EIO;
+	} else {
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		if (futimens(fd, times) < 0)
+			err = -errno;
+	}
+
+	close(fd);
+
+	return err < 0 ? err : (unsigned char)old;
+}
+
+static void container_log(void *data, _maybe_unused_ int priority,
+			  _maybe_unused_ const char *file, _maybe_unused_ int line,
+			  _maybe_unused_ const char *fn, const char *format, va_list args)
+{
+	size_t *n_errors = data;
+	char buf[256];
+
+	vsnprintf(buf, sizeof(buf), format, args);
+	if (strstr(buf, "magic check fail") != NULL)
+		(*n_errors)++;
+}
+
+static int test_load_container(void)
+{
+	/*
+	 * modules.bin newer than modules.dep.bin, as depmod writes them, and the
+	 * opposite, as after a copy, which compares the sections to the files
+	 */
+	static const char *const newer[] = { "modules.bin", "modules.dep.bin" };
+	static const enum kmod_index types[] = {
+		KMOD_INDEX_MODULES_DEP,
+		KMOD_INDEX_MODULES_ALIAS,
+		KMOD_INDEX_MODULES_SYMBOL,
+		KMOD_INDEX_MODULES_BUILTIN,
+	};
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	int err;
+
+	for (size_t i = 0; i < ARRAY_SIZE(newer); i++) {
+		ctx = kmod_new(NULL, &null_config);
+		TS_ASSERT(ctx != NULL);
+
+		err = container_touch(ctx, newer[i]);
+		TS_ASSERT(err == 0);
+
+		/* only modules.dep.bin is there besides modules.bin */
+		err = kmod_load_resources(ctx);
+		TS_ASSERT(err == 0);
+		TS_ASSERT(container_has(ctx, "mod-simple"));
+		TS_ASSERT(container_has(ctx, "symbol:printA"));
+
+		for (size_t j = 0; j < ARRAY_SIZE(types); j++)
+			TS_ASSERT(container_dump(ctx, types[j]) == 0);
+
+		TS_ASSERT(kmod_validate_resources(ctx) == KMOD_RESOURCES_OK);
+
+		kmod_unref(ctx);
+	}
+
+	return 0;
+}
+DEFINE_TEST(test_load_container,
+	.description = "test if kmod_load_resources loads the indexes from modules.bin",
+	.config = {
+		[TC_ROOTFS] = CONTAINER_ROOTFS,
+		[TC_UNAME_R] = "4.4.4-good",
+	});
+
+static int test_load_container_stale(void)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	size_t n_errors = 0;
+	int err, old;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	/* the separate indexes were rewritten without mod-simple afterwards */
+	err = container_touch(ctx, "modules.dep.bin");
+	TS_ASSERT(err == 0);
+
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(!container_has(ctx, "mod-simple"));
+	TS_ASSERT(container_has(ctx, "mod-loop-a"));
+
+	/* the mismatch is remembered: a broken magic would be logged if it was read */
+	kmod_unload_resources(ctx);
+	old = container_poke("modules.bin", 'X');
+	TS_ASSERT(old >= 0);
+	kmod_set_log_fn(ctx, container_log, &n_errors);
+
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(n_errors == 0);
+	TS_ASSERT(!container_has(ctx, "mod-simple"));
+	TS_ASSERT(container_has(ctx, "mod-loop-a"));
+	TS_ASSERT(container_poke("modules.bin", old) == 'X');
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(test_load_container_stale,
+	.description = "test if kmod_load_resources ignores a modules.bin not matching modules.dep.bin",
+	.config = {
+		[TC_ROOTFS] = CONTAINER_ROOTFS,
+		[TC_UNAME_R] = "4.4.4-stale",
+	});
+
+static int test_load_container_corrupted(void)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	/* there are no separate indexes to fall back to */
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err < 0);
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST_WITH_FUNC(
+	test_load_container_bad_table, test_load_container_corrupted,
+	.description = "test if kmod_load_resources rejects a modules.bin with a corrupted section table",
+	.config = {
+		[TC_ROOTFS] = CONTAINER_ROOTFS,
+		[TC_UNAME_R] = "4.4.4-bad-table",
+	});
+
+DEFINE_TEST_WITH_FUNC(
+	test_load_container_bad_bounds, test_load_container_corrupted,
+	.description = "test if kmod_load_resources rejects a modules.bin with a section out of bounds",
+	.config = {
+		[TC_ROOTFS] = CONTAINER_ROOTFS,
+		[TC_UNAME_R] = "4.4.4-bad-bounds",
+	});
+
+static int test_load_container_bad_section(void)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	/* sections are only checked against their CRC when verified */
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+
+	err = container_touch(ctx, "modules.bin");
+	TS_ASSERT(err == 0);
+	TS_ASSERT(container_dump(ctx, KMOD_INDEX_MODULES_DEP) == 0);
+	TS_ASSERT(container_dump(ctx, KMOD_INDEX_MODULES_SYMBOL) == -EBADMSG);
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(test_load_container_bad_section,
+	.description = "test if kmod_dump_index detects a corrupted section of modules.bin",
+	.config = {
+		[TC_ROOTFS] = CONTAINER_ROOTFS,
+		[TC_UNAME_R] = "4.4.4-bad-section",
+	});
+
+/* number of mappings of an index named @fn, current or replaced */
+static int count_index_mappings(const char *fn)
+{
+	char line[PATH_MAX + 128];
+	size_t fnlen = strlen(fn);
+	int n = 0;
+	FILE *fp;
+	int fd;
+
+	/* openat() isn't trapped into the rootfs */
+	fd = openat(AT_FDCWD, "/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *end = strchrnul(line, '\n');
+		size_t len;
+
+		*end = '\0';
+		if (strstr(line, " (deleted)") == end - strlen(" (deleted)"))
+			end -= strlen(" (deleted)");
+
+		len = end - line;
+		if (len > fnlen && line[len - fnlen - 1] == '/' &&
+		    memcmp(end - fnlen, fn, fnlen) == 0)
+			n++;
+	}
+
+	fclose(fp);
+
+	return n;
+}
+
+/* replace modules.dep.bin in the directory of @ctx with a newer copy of it */
+static int rewrite_dep_index(struct kmod_ctx *ctx)
+{
+	struct timespec times[2] = { { .tv_nsec = UTIME_OMIT } };
+	char buf[4096];
+	struct stat st;
+	ssize_t n;
+	int in, out, err = 0;
+
+	if (chdir(kmod_get_dirname(ctx)) < 0)
+		return -errno;
+
+	in = open("modules.dep.bin", O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return -errno;
+
+	out = open("modules.dep.bin.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		err = -errno;
+		close(in);
+		return err;
+	}
+
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, n) != n) {
+			err = -EIO;
+			break;
+		}
+	}
+	if (n < 0 || fstat(in, &st) < 0)
+		err = -errno;
+
+	/* make sure the mtime differs from the one loaded */
+	if (err == 0) {
+		times[1] = st.st_mtim;
+		times[1].tv_sec++;
+		if (futimens(out, times) < 0)
+			err = -errno;
+	}
+
+	close(in);
+	close(out);
+
+	if (err == 0 && rename("modules.dep.bin.tmp", "modules.dep.bin") < 0)
+		err = -errno;
+
+	return err;
+}
+
+static int test_index_sharing(void)
+{
+	struct kmod_ctx *ctx1, *ctx2, *ctx3;
+	int err;
+
+	ctx1 = kmod_new(NULL, NULL);
+	TS_ASSERT(ctx1 != NULL);
+	ctx2 = kmod_new(NULL, NULL);
+	TS_ASSERT(ctx2 != NULL);
+
+	/* contexts on the same directory share the mapping */
+	TS_ASSERT(kmod_load_resources(ctx1) == 0);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 1);
+	TS_ASSERT(kmod_load_resources(ctx2) == 0);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 1);
+
+	/* a rewritten index gets a mapping of its own on reload */
+	err = rewrite_dep_index(ctx1);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(kmod_validate_resources(ctx2) == KMOD_RESOURCES_MUST_RELOAD);
+	kmod_unload_resources(ctx2);
+	TS_ASSERT(kmod_load_resources(ctx2) == 0);
+	TS_ASSERT(kmod_validate_resources(ctx2) == KMOD_RESOURCES_OK);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 2);
+
+	/* which is shared with the contexts loading it later */
+	ctx3 = kmod_new(NULL, NULL);
+	TS_ASSERT(ctx3 != NULL);
+	TS_ASSERT(kmod_load_resources(ctx3) == 0);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 2);
+
+	/* each mapping goes away with the last context using it, in any order */
+	kmod_unref(ctx2);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 2);
+	kmod_unref(ctx1);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 1);
+	kmod_unload_resources(ctx3);
+	TS_ASSERT(count_index_mappings("modules.dep.bin") == 0);
+	kmod_unref(ctx3);
+
+	return 0;
+}
+DEFINE_TEST(test_index_sharing,
+	.description = "test if the index mappings are shared among contexts and released with the last one",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-index-sharing/",
+		[TC_UNAME_R] = "4.4.4",
+	});
+
 static int test_initlib(void)
 {
 	struct kmod_ctx *ctx;
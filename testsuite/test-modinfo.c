@@ -3,13 +3,25 @@
  * Copyright (C) 2012-2013  ProFUSION embedded systems
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <shared/strbuf.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
+
+/* kmod_file and kmod_elf are not exported, we need the private header */
+#include <libkmod/libkmod-internal.h>
+
+#undef ERR
 #include "testsuite.h"
 
 #define DEFINE_MODINFO_TEST(_field, _flavor, ...)                      \
@@ -94,4 +106,561 @@ DEFINE_TEST(test_modinfo_builtin,
 		.out = TESTSUITE_ROOTFS "test-modinfo/correct-builtin.txt",
 	});
 
+/*
+ * Entries expected from each fixture module. Only keys whose values come from
+ * the module source or from the signature are given a value: vermagic, name
+ * and the value of depends depend on the kernel the modules are built against.
+ */
+struct info_entry {
+	const char *key;
+	const char *value; /* NULL: any value */
+};
+
+#define INFO_MAX_ENTRIES 8
+
+static const struct {
+	const char *path;
+	struct info_entry entries[INFO_MAX_ENTRIES];
+} foreach_info_modules[] = {
+	{
+		"/mod-simple.ko",
+		{
+			{ "author", "Lucas De Marchi <lucas.demarchi@intel.com>" },
+			{ "license", "GPL" },
+			{ "description", "dummy test module" },
+			{ "depends", NULL },
+		},
+	},
+	{
+		"/mod-simple-sha256.ko",
+		{
+			{ "author", "Lucas De Marchi <lucas.demarchi@intel.com>" },
+			{ "license", "GPL" },
+			{ "description", "dummy test module" },
+			{ "depends", NULL },
+			{ "signer", "Magrathea: Glacier signing key" },
+			{ "sig_key",
+			  "E3:C8:FC:A7:3F:B3:1D:DE:84:81:EF:38:E3:4C:DE:4B:0C:FD:1B:F9" },
+			{ "sig_hashalgo", "sha256" },
+		},
+	},
+	{
+		"/mod-loop-a.ko",
+		{
+			{ "author", "Lucas De Marchi <lucas.demarchi@intel.com>" },
+			{ "license", "LGPL" },
+			{ "description", "dummy test module" },
+			{ "depends", NULL },
+		},
+	},
+};
+
+/*
+ * Every entry passed to the callback must be of a type in @keys, and every
+ * expected entry must be seen once if its type is in @keys, never otherwise.
+ * The callback fails with -ECANCELED on its @stop-th call, if set.
+ */
+struct info_check {
+	unsigned int keys;
+	const struct info_entry *entries;
+	int seen[INFO_MAX_ENTRIES];
+	int calls;
+	int stop;
+	bool mismatch;
+};
+
+static unsigned int info_key_type(const char *key)
+{
+	if (streq(key, "alias"))
+		return KMOD_MODULE_INFO_ALIAS;
+	if (streq(key, "softdep"))
+		return KMOD_MODULE_INFO_SOFTDEP;
+	if (streq(key, "weakdep"))
+		return KMOD_MODULE_INFO_WEAKDEP;
+	if (streq(key, "depends"))
+		return KMOD_MODULE_INFO_DEPENDS;
+	if (streq(key, "firmware"))
+		return KMOD_MODULE_INFO_FIRMWARE;
+	if (streq(key, "build-id"))
+		return KMOD_MODULE_INFO_BUILD_ID;
+	if (streq(key, "sig_id") || streq(key, "signer") || streq(key, "sig_key") ||
+	    streq(key, "sig_hashalgo") || streq(key, "signature"))
+		return KMOD_MODULE_INFO_SIGNATURE;
+	return KMOD_MODULE_INFO_OTHER;
+}
+
+static int foreach_info_cb(const char *key, size_t keylen, const char *value,
+			   size_t valuelen, void *data)
+{
+	struct info_check *check = data;
+	char k[64];
+
+	if (++check->calls == check->stop)
+		return -ECANCELED;
+
+	if (keylen >= sizeof(k)) {
+		ERR("info key too long: %.*s\n", (int)keylen, key);
+		check->mismatch = true;
+		return 0;
+	}
+	memcpy(k, key, keylen);
+	k[keylen] = '\0';
+
+	if (!(check->keys & info_key_type(k))) {
+		ERR("info %s not in keys %#x\n", k, check->keys);
+		check->mismatch = true;
+	}
+
+	for (size_t i = 0; i < INFO_MAX_ENTRIES; i++) {
+		const struct info_entry *e = &check->entries[i];
+
+		if (e->key == NULL || !streq(e->key, k))
+			continue;
+
+		check->seen[i]++;
+		if (e->value != NULL && (strlen(e->value) != valuelen ||
+					 memcmp(e->value, value, valuelen) != 0)) {
+			ERR("info %s=%.*s, expected %s\n", k, (int)valuelen, value,
+			    e->value);
+			check->mismatch = true;
+		}
+	}
+
+	return 0;
+}
+
+static int foreach_info_check(struct kmod_module *mod,
+			      const struct info_entry *entries, unsigned int keys)
+{
+	struct info_check check = {
+		.keys = keys,
+		.entries = entries,
+	};
+	int err;
+
+	err = kmod_module_foreach_info(mod, keys, foreach_info_cb, &check);
+	if (err != check.calls || check.mismatch) {
+		ERR("keys %#x: got %d, %d calls\n", keys, err, check.calls);
+		return -EINVAL;
+	}
+
+	for (size_t i = 0; i < INFO_MAX_ENTRIES && entries[i].key != NULL; i++) {
+		int expected = (keys & info_key_type(entries[i].key)) ? 1 : 0;
+
+		if (check.seen[i] != expected) {
+			ERR("keys %#x: %s seen %d times, expected %d\n", keys,
+			    entries[i].key, check.seen[i], expected);
+			return -EINVAL;
+		}
+	}
+
+	return err;
+}
+
+static int test_modinfo_foreach_info(void)
+{
+	static const unsigned int keys[] = {
+		KMOD_MODULE_INFO_ALIAS | KMOD_MODULE_INFO_DEPENDS,
+		KMOD_MODULE_INFO_OTHER | KMOD_MODULE_INFO_SIGNATURE,
+	};
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	for (size_t i = 0; i < ARRAY_SIZE(foreach_info_modules); i++) {
+		const struct info_entry *entries = foreach_info_modules[i].entries;
+		struct kmod_module *mod;
+		int n, sum = 0;
+
+		err = kmod_module_new_from_path(ctx, foreach_info_modules[i].path, &mod);
+		TS_ASSERT(err == 0);
+
+		n = foreach_info_check(mod, entries, KMOD_MODULE_INFO_ALL);
+		TS_ASSERT(n > 0);
+
+		/* each entry is of exactly one type */
+		for (unsigned int bit = 1; bit & KMOD_MODULE_INFO_ALL; bit <<= 1) {
+			err = foreach_info_check(mod, entries, bit);
+			TS_ASSERT(err >= 0);
+			sum += err;
+		}
+		TS_ASSERT(sum == n);
+
+		for (size_t j = 0; j < ARRAY_SIZE(keys); j++) {
+			err = foreach_info_check(mod, entries, keys[j]);
+			TS_ASSERT(err >= 0);
+		}
+
+		/* stop at the first entry */
+		{
+			struct info_check check = {
+				.keys = KMOD_MODULE_INFO_ALL,
+				.entries = entries,
+				.stop = 1,
+			};
+
+			err = kmod_module_foreach_info(mod, KMOD_MODULE_INFO_ALL,
+						       foreach_info_cb, &check);
+			TS_ASSERT(err == -ECANCELED);
+			TS_ASSERT(check.calls == 1);
+		}
+
+		kmod_module_unref(mod);
+	}
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(test_modinfo_foreach_info,
+	.description = "check kmod_module_foreach_info() against the entries of the fixture modules",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	});
+
+struct symbol_check {
+	const char *const *symbols;
+	int seen[4];
+	enum kmod_symbol_bind bind;
+	bool exact;
+	int calls;
+	int stop;
+	bool mismatch;
+};
+
+/*
+ * Symbols expected from each iterator. Only the symbols defined or used by the
+ * fixture modules are listed: others, like the ones from printk, depend on the
+ * kernel they're built against, as do the CRCs and whether there are versions
+ * at all.
+ */
+static const struct {
+	const char *path;
+	const char *name;
+	int (*foreach)(const struct kmod_module *mod,
+		       int (*cb)(const char *symbol, size_t len, uint64_t crc,
+				 enum kmod_symbol_bind bind, void *data),
+		       void *data);
+	int err; /* returned instead of the symbols, if not 0 */
+	bool exact; /* no other symbols are expected */
+	enum kmod_symbol_bind bind; /* of the listed symbols */
+	const char *symbols[4];
+} foreach_symbols[] = {
+	{
+		.path = "/mod-simple.ko",
+		.name = "symbols",
+		.foreach = kmod_module_foreach_symbol,
+		.err = -ENODATA,
+	},
+	{
+		.path = "/mod-loop-a.ko",
+		.name = "symbols",
+		.foreach = kmod_module_foreach_symbol,
+		.exact = true,
+		.bind = KMOD_SYMBOL_GLOBAL,
+		.symbols = { "printA" },
+	},
+	{
+		.path = "/mod-loop-a.ko",
+		.name = "versions",
+		.foreach = kmod_module_foreach_version,
+		.err = -ENODATA,
+		.symbols = { "printB", "printF", "printG" },
+	},
+	{
+		.path = "/mod-loop-a.ko",
+		.name = "dependency symbols",
+		.foreach = kmod_module_foreach_dependency_symbol,
+		.bind = KMOD_SYMBOL_UNDEF,
+		.symbols = { "printB", "printF", "printG" },
+	},
+};
+
+static int foreach_symbol_cb(const char *symbol, size_t len, uint64_t crc,
+			     enum kmod_symbol_bind bind, void *data)
+{
+	struct symbol_check *check = data;
+	bool found = false;
+
+	if (++check->calls == check->stop)
+		return -ECANCELED;
+
+	if (strlen(symbol) != len) {
+		ERR("symbol %s: got length %zu\n", symbol, len);
+		check->mismatch = true;
+	}
+
+	for (size_t i = 0; check->symbols[i] != NULL; i++) {
+		if (!streq(check->symbols[i], symbol))
+			continue;
+
+		found = true;
+		check->seen[i]++;
+		if (check->bind != KMOD_SYMBOL_NONE && bind != check->bind) {
+			ERR("symbol %s bind=%c, expected %c\n", symbol, bind,
+			    check->bind);
+			check->mismatch = true;
+		}
+	}
+
+	if (!found && check->exact) {
+		ERR("unexpected symbol %s\n", symbol);
+		check->mismatch = true;
+	}
+
+	return 0;
+}
+
+static int test_modinfo_foreach_symbols(void)
+{
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	for (size_t i = 0; i < ARRAY_SIZE(foreach_symbols); i++) {
+		struct kmod_module *mod;
+		struct symbol_check check = {
+			.symbols = foreach_symbols[i].symbols,
+			.bind = foreach_symbols[i].bind,
+			.exact = foreach_symbols[i].exact,
+		};
+
+		err = kmod_module_new_from_path(ctx, foreach_symbols[i].path, &mod);
+		TS_ASSERT(err == 0);
+
+		err = foreach_symbols[i].foreach(mod, foreach_symbol_cb, &check);
+
+		/*
+		 * Without listed symbols @err is required, otherwise it's accepted
+		 * in place of them: versions are only there with CONFIG_MODVERSIONS.
+		 */
+		if (err < 0 && err == foreach_symbols[i].err) {
+			TS_ASSERT(check.calls == 0);
+			kmod_module_unref(mod);
+			continue;
+		}
+		if (foreach_symbols[i].symbols[0] == NULL) {
+			ERR("%s %s: got %d, expected %d\n", foreach_symbols[i].path,
+			    foreach_symbols[i].name, err, foreach_symbols[i].err);
+			return EXIT_FAILURE;
+		}
+
+		if (err != check.calls || check.mismatch) {
+			ERR("%s %s: got %d, %d calls\n", foreach_symbols[i].path,
+			    foreach_symbols[i].name, err, check.calls);
+			return EXIT_FAILURE;
+		}
+
+		for (size_t j = 0; foreach_symbols[i].symbols[j] != NULL; j++) {
+			if (check.seen[j] != 1) {
+				ERR("%s %s: %s seen %d times\n", foreach_symbols[i].path,
+				    foreach_symbols[i].name, foreach_symbols[i].symbols[j],
+				    check.seen[j]);
+				return EXIT_FAILURE;
+			}
+		}
+
+		/* stop at the first entry */
+		memset(&check, 0, sizeof(check));
+		check.symbols = foreach_symbols[i].symbols;
+		check.stop = 1;
+
+		err = foreach_symbols[i].foreach(mod, foreach_symbol_cb, &check);
+		TS_ASSERT(err == -ECANCELED);
+		TS_ASSERT(check.calls == 1);
+
+		kmod_module_unref(mod);
+	}
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(test_modinfo_foreach_symbols,
+	.description = "check the kmod_module_foreach_*() symbol iterators against the symbols of the fixture modules",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	});
+
+static int sparse_modinfo_cb(const char *str, size_t len, _maybe_unused_ size_t keylen,
+			     void *data)
+{
+	struct strbuf *buf = data;
+
+	strbuf_pushmem(buf, str, len);
+	strbuf_pushchar(buf, '\n');
+	return 0;
+}
+
+static int sparse_symbol_cb(const char *symbol, size_t len, uint64_t crc,
+			    enum kmod_symbol_bind bind, void *data)
+{
+	struct strbuf *buf = data;
+	char s[32];
+
+	strbuf_pushmem(buf, symbol, len);
+	snprintf(s, sizeof(s), " %#" PRIx64 " %c\n", crc, bind);
+	strbuf_pushchars(buf, s);
+	return 0;
+}
+
+/* Everything depmod and modinfo get out of a module, as text */
+static int sparse_dump(const struct kmod_file *file, const struct kmod_elf *elf,
+		       struct strbuf *buf)
+{
+	struct kmod_signature_info *sig_info;
+	const void *build_id;
+	size_t build_id_len;
+	char s[32];
+	int err;
+
+	err = kmod_elf_foreach_modinfo_string(elf, sparse_modinfo_cb, buf);
+	snprintf(s, sizeof(s), "modinfo %d\n", err);
+	strbuf_pushchars(buf, s);
+
+	err = kmod_elf_foreach_symbol(elf, sparse_symbol_cb, buf);
+	snprintf(s, sizeof(s), "symbols %d\n", err);
+	strbuf_pushchars(buf, s);
+
+	err = kmod_elf_foreach_dependency_symbol(elf, sparse_symbol_cb, buf);
+	snprintf(s, sizeof(s), "dependency symbols %d\n", err);
+	strbuf_pushchars(buf, s);
+
+	err = kmod_elf_foreach_modversion(elf, sparse_symbol_cb, buf);
+	snprintf(s, sizeof(s), "versions %d\n", err);
+	strbuf_pushchars(buf, s);
+
+	err = kmod_elf_get_build_id(elf, &build_id, &build_id_len);
+	snprintf(s, sizeof(s), "build-id %d\n", err);
+	strbuf_pushchars(buf, s);
+	if (err >= 0)
+		strbuf_pushmem(buf, build_id, build_id_len);
+
+	if (kmod_module_signature_info(file, &sig_info)) {
+		strbuf_pushmem(buf, sig_info->signer, sig_info->signer_len);
+		strbuf_pushmem(buf, sig_info->key_id, sig_info->key_id_len);
+		strbuf_pushmem(buf, sig_info->sig, sig_info->sig_len);
+		free(sig_info);
+	}
+
+	return strbuf_str(buf) != NULL ? 0 : -ENOMEM;
+}
+
+static int test_modinfo_sparse(void)
+{
+	static const char *const modules[] = {
+		"/mod-simple.ko",
+		"/mod-simple-sha256.ko",
+		"/mod-loop-a.ko",
+	};
+	static const char truncated[] = "/mod-simple-truncated.ko";
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+	struct kmod_file *file;
+	const void *mem, *full;
+	off_t size, full_size;
+	int err, fd;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	for (size_t i = 0; i < ARRAY_SIZE(modules); i++) {
+		DECLARE_STRBUF(sparse_out);
+		DECLARE_STRBUF(full_out);
+		struct kmod_file *full_file;
+		struct kmod_elf *elf, *full_elf;
+		uint64_t off, sec_size;
+
+		err = kmod_file_open(ctx, modules[i], &file);
+		TS_ASSERT(err == 0);
+		err = kmod_file_get_sparse_contents(file, &mem, &size);
+		TS_ASSERT(err == 0);
+		TS_ASSERT(kmod_file_is_sparse(file));
+		err = kmod_elf_new(mem, size, true, &elf);
+		TS_ASSERT(err == 0);
+
+		err = kmod_file_open(ctx, modules[i], &full_file);
+		TS_ASSERT(err == 0);
+		err = kmod_file_get_contents(full_file, &full, &full_size);
+		TS_ASSERT(err == 0);
+		TS_ASSERT(!kmod_file_is_sparse(full_file));
+		TS_ASSERT(size == full_size);
+		err = kmod_elf_new(full, full_size, false, &full_elf);
+		TS_ASSERT(err == 0);
+
+		TS_ASSERT(sparse_dump(file, elf, &sparse_out) == 0);
+		TS_ASSERT(sparse_dump(full_file, full_elf, &full_out) == 0);
+		if (!streq(strbuf_str(&sparse_out), strbuf_str(&full_out))) {
+			ERR("%s: sparse:\n%s\nfull:\n%s\n", modules[i],
+			    strbuf_str(&sparse_out), strbuf_str(&full_out));
+			return EXIT_FAILURE;
+		}
+
+		/* the contents of other sections weren't read */
+		err = kmod_elf_get_section(elf, ".gnu.linkonce.this_module", &off,
+					   &sec_size);
+		TS_ASSERT(err == -ENOTSUP);
+		err = kmod_elf_get_section(full_elf, ".gnu.linkonce.this_module", &off,
+					   &sec_size);
+		TS_ASSERT(err > 0);
+
+		/* asking for all of it maps the whole file in place */
+		err = kmod_file_get_contents(file, &mem, &size);
+		TS_ASSERT(err == 0);
+		TS_ASSERT(!kmod_file_is_sparse(file));
+		TS_ASSERT(memcmp(mem, full, size) == 0);
+		strbuf_clear(&sparse_out);
+		TS_ASSERT(sparse_dump(file, elf, &sparse_out) == 0);
+		TS_ASSERT(streq(strbuf_str(&sparse_out), strbuf_str(&full_out)));
+
+		kmod_elf_unref(full_elf);
+		kmod_file_unref(full_file);
+		kmod_elf_unref(elf);
+		kmod_file_unref(file);
+	}
+
+	/* not an ELF file: read as a whole */
+	err = kmod_file_open(ctx, "/correct-author.txt", &file);
+	TS_ASSERT(err == 0);
+	err = kmod_file_get_sparse_contents(file, &mem, &size);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(!kmod_file_is_sparse(file));
+	TS_ASSERT(size > 0 && memcmp(mem, "Lucas De Marchi", strlen("Lucas De Marchi")) == 0);
+	kmod_file_unref(file);
+
+	/* section headers past the end of the file: read as a whole */
+	err = kmod_file_open(ctx, "/mod-simple.ko", &file);
+	TS_ASSERT(err == 0);
+	err = kmod_file_get_contents(file, &full, &full_size);
+	TS_ASSERT(err == 0);
+	fd = open(truncated, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	TS_ASSERT(fd >= 0);
+	TS_ASSERT(write(fd, full, full_size / 2) == full_size / 2);
+	close(fd);
+	kmod_file_unref(file);
+
+	err = kmod_file_open(ctx, truncated, &file);
+	TS_ASSERT(err == 0);
+	err = kmod_file_get_sparse_contents(file, &mem, &size);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(!kmod_file_is_sparse(file));
+	TS_ASSERT(size == full_size / 2);
+	kmod_file_unref(file);
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(test_modinfo_sparse,
+	.description = "check if only reading the metadata of modules gives the same results as reading all of them",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	});
+
 TESTSUITE_MAIN();
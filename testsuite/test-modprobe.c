@@ -49,6 +49,29 @@ DEFINE_TEST_WITH_FUNC(modprobe_show_depends_no_load, modprobe_show_depends2,
 	.modules_loaded = "",
 	);
 
+DEFINE_TEST_WITH_FUNC(modprobe_show_depends_compressed, modprobe_show_depends,
+	.description = "check if output for modprobe --show-depends is correct with compressed indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends-compressed",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends-compressed/correct.txt",
+	},
+	.skip = !ENABLE_ZLIB,
+	);
+DEFINE_TEST_WITH_FUNC(modprobe_show_depends2_compressed, modprobe_show_depends2,
+	.description = "check if output for modprobe --show-depends is correct with compressed indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends-compressed",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends-compressed/correct-mod-simple.txt",
+	},
+	.skip = !ENABLE_ZLIB,
+	);
+
 static int modprobe_show_alias_to_none(void)
 {
 	return EXEC_TOOL(modprobe, "--show-depends", "--ignore-install", "mod-simple");
@@ -118,6 +141,26 @@ DEFINE_TEST(modprobe_builtin_lookup_only,
 		.out = TESTSUITE_ROOTFS "test-modprobe/builtin/correct.txt",
 	});
 
+DEFINE_TEST_WITH_FUNC(modprobe_builtin_compressed, modprobe_builtin,
+	.description = "check if modprobe return 0 for builtin with compressed indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/builtin-compressed",
+	},
+	.skip = !ENABLE_ZLIB,
+	);
+DEFINE_TEST_WITH_FUNC(modprobe_builtin_lookup_only_compressed, modprobe_builtin_lookup_only,
+	.description = "check if modprobe -R correctly returns the builtin module with compressed indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/builtin-compressed",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/builtin-compressed/correct.txt",
+	},
+	.skip = !ENABLE_ZLIB,
+	);
+
 static int modprobe_softdep_loop(void)
 {
 	return EXEC_TOOL(modprobe, "mod-loop-b");
@@ -3,13 +3,18 @@
  * Copyright (C) 2012-2013  ProFUSION embedded systems
  */
 
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <shared/util.h>
+
 #include <libkmod/libkmod.h>
 
 #include "testsuite.h"
@@ -54,6 +59,326 @@ DEFINE_TEST(from_name,
 		.out = TESTSUITE_ROOTFS "test-new-module/from_name/correct.txt",
 	});
 
+#define N_THREADS 8
+#define N_ITERATIONS 2000
+#define N_MODNAMES 5
+
+struct from_name_thread {
+	pthread_t thread;
+	struct kmod_ctx *ctx;
+	struct kmod_module *const *mods;
+	const char *const *modnames;
+	size_t n_mods;
+	bool failed;
+};
+
+static void *from_name_thread(void *data)
+{
+	struct from_name_thread *t = data;
+
+	for (int i = 0; i < N_ITERATIONS && !t->failed; i++) {
+		size_t n = i % t->n_mods;
+		struct kmod_module *mod;
+		char name[32];
+
+		/* already in the pool, must return the very same module */
+		if (kmod_module_new_from_name(t->ctx, t->modnames[n], &mod) < 0) {
+			t->failed = true;
+			break;
+		}
+		if (mod != t->mods[n])
+			t->failed = true;
+		kmod_module_unref(mod);
+
+		/* shared with the other threads, created and released all the time */
+		snprintf(name, sizeof(name), "transient%d", i % 4);
+		if (kmod_module_new_from_name(t->ctx, name, &mod) < 0) {
+			t->failed = true;
+			break;
+		}
+		if (strcmp(kmod_module_get_name(mod), name) != 0)
+			t->failed = true;
+		kmod_module_unref(mod);
+	}
+
+	return NULL;
+}
+
+static int from_name_threads(void)
+{
+	static const char *const modnames[N_MODNAMES] = {
+		// clang-format off
+		"ext4",
+		"balbalbalbbalbalbalbalbalbalbal",
+		"snd-hda-intel",
+		"snd-timer",
+		"iTCO_wdt",
+		// clang-format on
+	};
+	struct kmod_module *mods[N_MODNAMES];
+	struct from_name_thread threads[N_THREADS];
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	TS_ASSERT(ctx != NULL);
+
+	err = kmod_set_thread_safe(ctx, true);
+	TS_ASSERT(err == 0);
+	TS_ASSERT(kmod_get_thread_safe(ctx));
+
+	for (size_t i = 0; i < ARRAY_SIZE(modnames); i++) {
+		err = kmod_module_new_from_name(ctx, modnames[i], &mods[i]);
+		TS_ASSERT(err == 0);
+	}
+
+	/* can't switch modes with modules around */
+	TS_ASSERT(kmod_set_thread_safe(ctx, false) == -EBUSY);
+
+	for (size_t i = 0; i < N_THREADS; i++) {
+		threads[i] = (struct from_name_thread){
+			.ctx = ctx,
+			.mods = mods,
+			.modnames = modnames,
+			.n_mods = ARRAY_SIZE(modnames),
+		};
+		err = pthread_create(&threads[i].thread, NULL, from_name_thread,
+				     &threads[i]);
+		TS_ASSERT(err == 0);
+	}
+
+	for (size_t i = 0; i < N_THREADS; i++) {
+		pthread_join(threads[i].thread, NULL);
+		TS_ASSERT(!threads[i].failed);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(modnames); i++) {
+		printf("modname: %s\n", kmod_module_get_name(mods[i]));
+		kmod_module_unref(mods[i]);
+	}
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(from_name_threads,
+	.description = "check if modules are shared correctly among threads",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_name/",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_name/correct.txt",
+	});
+
+#define N_ROUNDS 20
+
+static const struct {
+	const char *name;
+	const char *modname; /* NULL if the lookup must not find anything */
+	const char *path;
+	const char *options;
+	size_t n_deps;
+} lookup_threads_expected[] = {
+	// clang-format off
+	{ "mod-loop-a", "mod_loop_a", MODULE_DIRECTORY "/4.4.4/kernel/mod-loop-a.ko", "foo=1", 1 },
+	{ "loop-alias", "mod_loop_a", MODULE_DIRECTORY "/4.4.4/kernel/mod-loop-a.ko", "foo=1", 1 },
+	{ "mod-loop-b", "mod_loop_b", MODULE_DIRECTORY "/4.4.4/kernel/mod-loop-b.ko", "bar=2", 0 },
+	{ "mod-simple", "mod_simple", MODULE_DIRECTORY "/4.4.4/kernel/mod-simple.ko", NULL, 0 },
+	{ "pci:v00001234d00005678sv*sd*bc*sc*i*", NULL, NULL, NULL, 0 },
+	// clang-format on
+};
+
+struct lookup_thread {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	struct kmod_ctx *ctx;
+	size_t first;
+	bool failed;
+};
+
+static bool lookup_threads_check(struct kmod_ctx *ctx, size_t i)
+{
+	struct kmod_list *l, *list = NULL;
+	size_t n = 0;
+	bool ok = true;
+
+	if (kmod_module_new_from_lookup(ctx, lookup_threads_expected[i].name, &list) < 0)
+		return false;
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *mod = kmod_module_get_module(l);
+		struct kmod_list *d, *deps, *info = NULL;
+		const char *path, *options;
+		size_t n_deps = 0;
+
+		path = kmod_module_get_path(mod);
+		options = kmod_module_get_options(mod);
+		deps = kmod_module_get_dependencies(mod);
+		kmod_list_foreach(d, deps)
+			n_deps++;
+
+		if (lookup_threads_expected[i].modname == NULL ||
+		    !streq(kmod_module_get_name(mod), lookup_threads_expected[i].modname) ||
+		    path == NULL || !streq(path, lookup_threads_expected[i].path) ||
+		    (options == NULL) != (lookup_threads_expected[i].options == NULL) ||
+		    (options != NULL && !streq(options, lookup_threads_expected[i].options)) ||
+		    n_deps != lookup_threads_expected[i].n_deps)
+			ok = false;
+
+		/* the file and the ELF are also loaded on first use */
+		if (kmod_module_get_info(mod, &info) <= 0)
+			ok = false;
+
+		kmod_module_info_free_list(info);
+		kmod_module_unref_list(deps);
+		kmod_module_unref(mod);
+		n++;
+	}
+	kmod_module_unref_list(list);
+
+	return ok && n == (lookup_threads_expected[i].modname != NULL ? 1 : 0);
+}
+
+static void *lookup_thread(void *data)
+{
+	struct lookup_thread *t = data;
+	size_t n = ARRAY_SIZE(lookup_threads_expected);
+
+	/* start together, so the lazily initialized fields are raced for */
+	pthread_barrier_wait(t->barrier);
+
+	for (size_t i = 0; i < n * 4 && !t->failed; i++) {
+		if (!lookup_threads_check(t->ctx, (t->first + i) % n))
+			t->failed = true;
+	}
+
+	return NULL;
+}
+
+static int lookup_threads(void)
+{
+	struct lookup_thread threads[N_THREADS];
+	pthread_barrier_t barrier;
+	int err;
+
+	for (int round = 0; round < N_ROUNDS; round++) {
+		struct kmod_ctx *ctx;
+
+		ctx = kmod_new(NULL, NULL);
+		TS_ASSERT(ctx != NULL);
+
+		err = kmod_set_thread_safe(ctx, true);
+		TS_ASSERT(err == 0);
+
+		err = kmod_load_resources(ctx);
+		TS_ASSERT(err == 0);
+
+		err = pthread_barrier_init(&barrier, NULL, N_THREADS);
+		TS_ASSERT(err == 0);
+
+		for (size_t i = 0; i < N_THREADS; i++) {
+			threads[i] = (struct lookup_thread){
+				.barrier = &barrier,
+				.ctx = ctx,
+				.first = i,
+			};
+			err = pthread_create(&threads[i].thread, NULL, lookup_thread,
+					     &threads[i]);
+			TS_ASSERT(err == 0);
+		}
+
+		for (size_t i = 0; i < N_THREADS; i++) {
+			pthread_join(threads[i].thread, NULL);
+			TS_ASSERT(!threads[i].failed);
+		}
+
+		pthread_barrier_destroy(&barrier);
+		kmod_unref(ctx);
+	}
+
+	return 0;
+}
+DEFINE_TEST(lookup_threads,
+	.description = "check if lookups and lazily loaded module information are shared correctly among threads",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/lookup-threads/",
+	});
+
+DEFINE_TEST_WITH_FUNC(lookup_threads_compressed, lookup_threads,
+	.description = "check if lookups are shared correctly among threads with compressed indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/lookup-threads-compressed/",
+	},
+	.skip = !ENABLE_ZLIB,
+	);
+
+#define N_CORRUPTED_ALIASES 2000
+
+static void lookup_corrupted_log(void *data, _maybe_unused_ int priority,
+				 _maybe_unused_ const char *file, _maybe_unused_ int line,
+				 _maybe_unused_ const char *fn, const char *format,
+				 va_list args)
+{
+	size_t *n_errors = data;
+	char buf[256];
+
+	vsnprintf(buf, sizeof(buf), format, args);
+	if (strstr(buf, "modules.builtin.alias is corrupted") != NULL)
+		(*n_errors)++;
+}
+
+static int lookup_corrupted(void)
+{
+	struct kmod_ctx *ctx;
+	size_t n_found = 0, n_errors = 0;
+	int err;
+
+	ctx = kmod_new(NULL, NULL);
+	TS_ASSERT(ctx != NULL);
+
+	kmod_set_log_fn(ctx, lookup_corrupted_log, &n_errors);
+
+	/* only the first block of modules.builtin.alias.bin is read here */
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+
+	/*
+	 * The last block is corrupted: the aliases stored in it aren't found,
+	 * and that's logged once, however many lookups go through it
+	 */
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < N_CORRUPTED_ALIASES; i++) {
+			struct kmod_list *list = NULL;
+			char alias[32];
+
+			snprintf(alias, sizeof(alias), "devalias-%04d", i);
+			err = kmod_module_new_from_lookup(ctx, alias, &list);
+			TS_ASSERT(err == 0);
+			if (list != NULL)
+				n_found++;
+			kmod_module_unref_list(list);
+		}
+	}
+
+	TS_ASSERT(n_found > 0 && n_found < 2 * N_CORRUPTED_ALIASES);
+	TS_ASSERT(n_errors == 1);
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(lookup_corrupted,
+	.description = "check if a corrupted block of a compressed index is reported once",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/lookup-corrupted/",
+	},
+	.skip = !ENABLE_ZLIB,
+	);
+
 static int from_alias(void)
 {
 	static const char *const modnames[] = {
@@ -94,4 +419,96 @@ DEFINE_TEST(from_alias,
 		.out = TESTSUITE_ROOTFS "test-new-module/from_alias/correct.txt",
 	});
 
+static int lookup_stats(void)
+{
+	static const char *const keys[] = {
+		"mod-simple",
+		"symbol:printA",
+		"pci:v00001234d00005678",
+		"pci:v00001234d00005678",
+		"loop-alias",
+	};
+	/* hits and misses of each source after looking up all the keys */
+	static const struct {
+		enum kmod_lookup_source source;
+		uint64_t hits;
+		uint64_t misses;
+	} expected[] = {
+		{ KMOD_LOOKUP_CONFIG, 1, 3 },
+		{ KMOD_LOOKUP_DEP, 1, 0 },
+		{ KMOD_LOOKUP_SYMBOLS, 1, 0 },
+		{ KMOD_LOOKUP_COMMANDS, 0, 1 },
+		{ KMOD_LOOKUP_ALIASES, 0, 1 },
+		{ KMOD_LOOKUP_BUILTIN_ALIASES, 0, 1 },
+		{ KMOD_LOOKUP_BUILTIN, 0, 0 },
+	};
+	struct kmod_ctx *ctx;
+	struct kmod_list *list;
+	uint64_t hits, misses;
+	int err;
+
+	TS_ASSERT(kmod_get_stats(NULL, KMOD_LOOKUP_DEP, NULL, NULL, NULL) == -ENOENT);
+	TS_ASSERT(kmod_set_stats(NULL, true) == -ENOENT);
+
+	ctx = kmod_new(NULL, NULL);
+	TS_ASSERT(ctx != NULL);
+
+	err = kmod_load_resources(ctx);
+	TS_ASSERT(err == 0);
+
+	TS_ASSERT(kmod_get_stats(ctx, KMOD_LOOKUP_BUILTIN + 1, NULL, NULL, NULL) ==
+		  -ENOENT);
+
+	/* nothing is accounted until the stats are enabled */
+	list = NULL;
+	err = kmod_module_new_from_lookup(ctx, "mod-loop-b", &list);
+	TS_ASSERT(err == 0 && list != NULL);
+	kmod_module_unref_list(list);
+
+	err = kmod_set_stats(ctx, true);
+	TS_ASSERT(err == 0);
+
+	/*
+	 * Each kind of key only goes through the sources that can match it and
+	 * the repeated miss is answered by the negative lookup cache
+	 */
+	for (size_t i = 0; i < ARRAY_SIZE(keys); i++) {
+		list = NULL;
+		err = kmod_module_new_from_lookup(ctx, keys[i], &list);
+		TS_ASSERT(err == 0);
+		TS_ASSERT((list != NULL) == !strstartswith(keys[i], "pci:"));
+		kmod_module_unref_list(list);
+	}
+
+	err = kmod_set_stats(ctx, false);
+	TS_ASSERT(err == 0);
+
+	list = NULL;
+	err = kmod_module_new_from_lookup(ctx, "mod-loop-a", &list);
+	TS_ASSERT(err == 0 && list != NULL);
+	kmod_module_unref_list(list);
+
+	for (size_t i = 0; i < ARRAY_SIZE(expected); i++) {
+		err = kmod_get_stats(ctx, expected[i].source, &hits, &misses, NULL);
+		TS_ASSERT(err == 0);
+		if (hits != expected[i].hits || misses != expected[i].misses) {
+			ERR("source %u: hits=%" PRIu64 " misses=%" PRIu64
+			    ", expected hits=%" PRIu64 " misses=%" PRIu64 "\n",
+			    expected[i].source, hits, misses, expected[i].hits,
+			    expected[i].misses);
+			return EXIT_FAILURE;
+		}
+	}
+
+	kmod_unref(ctx);
+
+	return 0;
+}
+DEFINE_TEST(lookup_stats,
+	.description = "check if lookups are routed by kind of key and accounted per source",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/lookup-threads/",
+	});
+
 TESTSUITE_MAIN();
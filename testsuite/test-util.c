@@ -294,4 +294,20 @@ static int test_backoff_time(void)
 DEFINE_TEST(test_backoff_time,
 	    .description = "check implementation of get_backoff_delta_msec()");
 
+static int test_crc32_update(void)
+{
+	uint32_t crc;
+
+	TS_ASSERT(crc32_update(0, "", 0) == 0);
+	TS_ASSERT(crc32_update(0, "123456789", 9) == 0xcbf43926);
+
+	/* same result when fed in pieces */
+	crc = crc32_update(0, "1234", 4);
+	crc = crc32_update(crc, "56789", 5);
+	TS_ASSERT(crc == 0xcbf43926);
+
+	return 0;
+}
+DEFINE_TEST(test_crc32_update, .description = "check implementation of crc32_update()");
+
 TESTSUITE_MAIN();
@@ -11,15 +11,19 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
 
+#include <shared/arena.h>
 #include <shared/array.h>
 #include <shared/hash.h>
 #include <shared/macro.h>
@@ -28,6 +32,7 @@
 #include <shared/util.h>
 
 #include <libkmod/libkmod-internal.h>
+#include <libkmod/libkmod-internal-file.h>
 
 #undef ERR
 #undef DBG
@@ -66,6 +71,9 @@ static const struct option cmdopts[] = {
 	{ "dry-run", no_argument, 0, 'n' },
 	{ "symbol-prefix", required_argument, 0, 'P' },
 	{ "warn", no_argument, 0, 'w' },
+	{ "fsync", no_argument, 0, 1 },
+	{ "atomic", no_argument, 0, 2 },
+	{ "compress-indexes", no_argument, 0, 3 },
 	{ "version", no_argument, 0, 'V' },
 	{ "help", no_argument, 0, 'h' },
 	{},
@@ -89,6 +97,10 @@ static void help(void)
 	       "\t-C, --config PATH    Read configuration from PATH\n"
 	       "\t-v, --verbose        Enable verbose mode\n"
 	       "\t-w, --warn           Warn on duplicates\n"
+	       "\t    --fsync          Flush the generated files to disk\n"
+	       "\t    --atomic         Publish all the generated files at once (implies --fsync)\n"
+	       "\t    --compress-indexes\n"
+	       "\t                     Write the binary indexes compressed\n"
 	       "\t-V, --version        show version\n"
 	       "\t-h, --help           show this help\n"
 	       "\n"
@@ -121,25 +133,42 @@ _printf_format_(1, 2) static inline void _show(const char *fmt, ...)
 /* see documentation in libkmod/libkmod-index.c */
 #define INDEX_MAGIC 0xB007F457
 #define INDEX_VERSION_MAJOR 0x0002
-#define INDEX_VERSION_MINOR 0x0001
+#define INDEX_VERSION_MINOR 0x0002
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR << 16) | INDEX_VERSION_MINOR)
 #define INDEX_CHILDMAX 128u
+#define INDEX_CONTAINER_MAGIC 0xB007F45C
+#define INDEX_CONTAINER_VERSION 0x00010000
+#define INDEX_COMPRESSED_MAGIC 0xB007F45D
+#define INDEX_COMPRESSED_VERSION 0x00010000
+#define INDEX_COMPRESSION_ZLIB 1
+#define _INDEX_CONTAINER_SECTIONS (KMOD_INDEX_MODULES_BUILTIN + 1)
 
 struct index_value {
 	struct index_value *next;
 	unsigned int priority;
-	char value[0];
+	char value[];
 };
 
-/* In-memory index (depmod only) */
+/*
+ * In-memory index (depmod only)
+ *
+ * Children are kept in a list sorted by character rather than in a table
+ * indexed by it: most nodes have only one or two of them. Everything is
+ * allocated from the arena in struct index and freed at once.
+ */
 struct index_node {
 	char *prefix; /* path compression */
 	struct index_value *values;
-	uint8_t first; /* range of child nodes */
-	uint8_t last;
+	struct index_node *children; /* sorted by ->ch */
+	struct index_node *next; /* next sibling */
 	uint32_t size; /* size of node */
-	uint32_t total; /* size of node and its children */
-	struct index_node *children[INDEX_CHILDMAX]; /* indexed by character */
+	uint32_t offset; /* position in the file, set by index_layout() */
+	uint8_t ch; /* character leading from the parent to this node */
+};
+
+struct index {
+	struct arena arena;
+	struct index_node root;
 };
 
 /* Format of node offsets within index file */
@@ -158,48 +187,29 @@ static noreturn void fatal_oom(void)
 	exit(EXIT_FAILURE);
 }
 
-static struct index_node *index_create(void)
+static struct index *index_create(void)
 {
-	struct index_node *node;
+	struct index *index;
 
-	node = calloc(1, sizeof(struct index_node));
-	if (node == NULL)
+	index = calloc(1, sizeof(struct index));
+	if (index == NULL)
 		return NULL;
 
-	node->prefix = strdup("");
-	if (node->prefix == NULL) {
-		free(node);
+	arena_init(&index->arena, 1024 * 1024);
+
+	index->root.prefix = arena_strndup(&index->arena, "", 0);
+	if (index->root.prefix == NULL) {
+		free(index);
 		return NULL;
 	}
 
-	node->first = INDEX_CHILDMAX;
-
-	return node;
-}
-
-static void index_values_free(struct index_value *values)
-{
-	while (values) {
-		struct index_value *value = values;
-
-		values = value->next;
-		free(value);
-	}
+	return index;
 }
 
-static void index_destroy(struct index_node *node)
+static void index_destroy(struct index *index)
 {
-	int c;
-
-	for (c = node->first; c <= node->last; c++) {
-		struct index_node *child = node->children[c];
-
-		if (child)
-			index_destroy(child);
-	}
-	index_values_free(node->values);
-	free(node->prefix);
-	free(node);
+	arena_release(&index->arena);
+	free(index);
 }
 
 static void index__checkstring(const char *str)
@@ -216,8 +226,8 @@ static void index__checkstring(const char *str)
 	}
 }
 
-static int index_add_value(struct index_value **values, const char *value,
-			   unsigned int priority)
+static int index_add_value(struct index *index, struct index_value **values,
+			   const char *value, unsigned int priority)
 {
 	struct index_value *v;
 	int duplicate = 0;
@@ -234,7 +244,7 @@ static int index_add_value(struct index_value **values, const char *value,
 		values = &(*values)->next;
 
 	len = strlen(value);
-	v = calloc(1, sizeof(struct index_value) + len + 1);
+	v = arena_alloc(&index->arena, sizeof(struct index_value) + len + 1);
 	if (v == NULL)
 		fatal_oom();
 	v->next = *values;
@@ -245,9 +255,10 @@ static int index_add_value(struct index_value **values, const char *value,
 	return duplicate;
 }
 
-static int index_insert(struct index_node *node, const char *key, const char *value,
+static int index_insert(struct index *index, const char *key, const char *value,
 			unsigned int priority)
 {
+	struct index_node *node = &index->root;
 	int i = 0; /* index within str */
 	uint8_t ch;
 
@@ -255,6 +266,7 @@ static int index_insert(struct index_node *node, const char *key, const char *va
 	index__checkstring(value);
 
 	while (1) {
+		struct index_node **link;
 		int j; /* index within node->prefix */
 
 		/* Ensure node->prefix is a prefix of &str[i].
@@ -263,24 +275,21 @@ static int index_insert(struct index_node *node, const char *key, const char *va
 			ch = node->prefix[j];
 
 			if (ch != key[i + j]) {
-				char *prefix = node->prefix;
 				struct index_node *n;
 
 				/* New child is copy of node with prefix[j+1..N] */
-				n = memdup(node, sizeof(struct index_node));
+				n = arena_alloc(&index->arena, sizeof(struct index_node));
 				if (n == NULL)
 					fatal_oom();
-				n->prefix = strdup(&prefix[j + 1]);
-				if (n->prefix == NULL)
-					fatal_oom();
+				*n = *node;
+				n->prefix = &node->prefix[j + 1];
+				n->ch = ch;
+				n->next = NULL;
 
 				/* Parent has prefix[0..j], child at prefix[j] */
-				memset(node, 0, sizeof(struct index_node));
-				prefix[j] = '\0';
-				node->prefix = prefix;
-				node->first = ch;
-				node->last = ch;
-				node->children[ch] = n;
+				node->prefix[j] = '\0';
+				node->values = NULL;
+				node->children = n;
 
 				break;
 			}
@@ -290,38 +299,50 @@ static int index_insert(struct index_node *node, const char *key, const char *va
 
 		ch = key[i];
 		if (ch == '\0')
-			return index_add_value(&node->values, value, priority);
+			return index_add_value(index, &node->values, value, priority);
 
-		if (!node->children[ch]) {
+		link = &node->children;
+		while (*link != NULL && (*link)->ch < ch)
+			link = &(*link)->next;
+
+		if (*link == NULL || (*link)->ch != ch) {
 			struct index_node *child;
 
-			if (ch < node->first)
-				node->first = ch;
-			if (ch > node->last)
-				node->last = ch;
-			node->children[ch] = calloc(1, sizeof(struct index_node));
-			if (node->children[ch] == NULL)
+			child = arena_zalloc(&index->arena, sizeof(struct index_node));
+			if (child == NULL)
 				fatal_oom();
 
-			child = node->children[ch];
-			child->prefix = strdup(&key[i + 1]);
+			child->prefix = arena_strndup(&index->arena, &key[i + 1],
+						      strlen(&key[i + 1]));
 			if (child->prefix == NULL)
 				fatal_oom();
-			child->first = INDEX_CHILDMAX;
-			index_add_value(&child->values, value, priority);
+			child->ch = ch;
+			child->next = *link;
+			*link = child;
+			index_add_value(index, &child->values, value, priority);
 
 			return 0;
 		}
 
 		/* Descend into child node and continue */
-		node = node->children[ch];
+		node = *link;
 		i++;
 	}
 }
 
 static int index__haschildren(const struct index_node *node)
 {
-	return node->first < INDEX_CHILDMAX;
+	return node->children != NULL;
+}
+
+static uint8_t index__lastchild(const struct index_node *node)
+{
+	const struct index_node *child = node->children;
+
+	while (child->next != NULL)
+		child = child->next;
+
+	return child->ch;
 }
 
 static uint32_t index_get_mask(const struct index_node *node)
@@ -340,21 +361,19 @@ static uint32_t index_get_mask(const struct index_node *node)
 	return mask;
 }
 
-static uint32_t index_calculate_size(struct index_node *node)
+static void index_calculate_size(struct index_node *node)
 {
-	node->size = node->total = 0;
+	node->size = 0;
 
 	if (index__haschildren(node)) {
-		int i;
+		struct index_node *child;
 
 		node->size += 2; /* first + last, uint8_t */
-		node->size += (node->last - node->first + 1) * sizeof(uint32_t);
+		node->size += (index__lastchild(node) - node->children->ch + 1) *
+			      sizeof(uint32_t);
 
-		for (i = node->first; i <= node->last; i++) {
-			struct index_node *child = node->children[i];
-			if (child != NULL)
-				node->total += index_calculate_size(child);
-		}
+		for (child = node->children; child != NULL; child = child->next)
+			index_calculate_size(child);
 	}
 
 	if (node->prefix[0])
@@ -370,109 +389,282 @@ static uint32_t index_calculate_size(struct index_node *node)
 			node->size += strlen(v->value) + 1;
 		}
 	}
-	node->total += node->size;
-
-	return node->total;
 }
 
 /*
- * Recursive pre-order traversal
+ * Node layout
  *
- * Returns total amount of bytes written, i.e. byte count of node and its children
+ * Every lookup walks from the root, so the upper levels of the trie are
+ * touched far more often than the leaves. They are placed breadth-first at the
+ * start of the file until INDEX_HOT_SIZE is reached, and that hot region is
+ * recorded in the header so the reader can prefetch just those pages. The
+ * remaining subtrees follow in pre-order, keeping each one contiguous.
+ * Nodes bigger than INDEX_ALIGN_MIN, i.e. the ones carrying large value lists,
+ * are moved to the next page rather than straddling a page boundary.
  */
-static uint32_t index_write__node(const struct index_node *node, FILE *out,
-				  uint32_t offset)
+#define INDEX_HOT_SIZE (32u * 1024u)
+#define INDEX_ALIGN_MIN 512u
+#define INDEX_PAGE_SIZE 4096u
+
+struct index_layout {
+	struct array nodes; /* in file order */
+	uint32_t end;
+};
+
+static void index_layout_place(struct index_layout *layout, struct index_node *node)
 {
-	uint32_t child_offs[INDEX_CHILDMAX] = {};
-	int child_count = 0;
+	uint32_t page_off = layout->end % INDEX_PAGE_SIZE;
 
-	/* Calculate children offsets */
-	if (index__haschildren(node)) {
-		int i;
-		size_t sizes = 0;
+	if (node->size >= INDEX_ALIGN_MIN && node->size <= INDEX_PAGE_SIZE &&
+	    page_off + node->size > INDEX_PAGE_SIZE)
+		layout->end += INDEX_PAGE_SIZE - page_off;
 
-		child_count = node->last - node->first + 1;
+	node->offset = layout->end;
+	layout->end += node->size;
 
-		for (i = 0; i < child_count; i++) {
-			struct index_node *child;
+	if (array_append(&layout->nodes, node) < 0)
+		fatal_oom();
+}
 
-			child = node->children[node->first + i];
-			if (child == NULL) {
-				child_offs[i] = 0;
-			} else {
-				uint32_t mask = index_get_mask(child);
-				child_offs[i] =
-					htobe32((offset + node->size + sizes) | mask);
-				sizes += child->total;
-			}
+static void index_layout_subtree(struct index_layout *layout, struct index_node *node)
+{
+	struct index_node *child;
+
+	if (node->offset == 0)
+		index_layout_place(layout, node);
+
+	for (child = node->children; child != NULL; child = child->next)
+		index_layout_subtree(layout, child);
+}
+
+/* Returns the end of the hot region */
+static uint32_t index_layout(struct index_layout *layout, struct index_node *root,
+			     uint32_t first_off)
+{
+	struct array queue;
+	uint32_t hot_end;
+	size_t i;
+
+	array_init(&layout->nodes, 4096);
+	layout->end = first_off;
+
+	/* breadth-first placement of the upper levels, root is always hot */
+	array_init(&queue, 256);
+	if (array_append(&queue, root) < 0)
+		fatal_oom();
+
+	for (i = 0; i < queue.count; i++) {
+		struct index_node *node = queue.array[i];
+		struct index_node *child;
+
+		if (i > 0 && layout->end + node->size > first_off + INDEX_HOT_SIZE)
+			break;
+
+		index_layout_place(layout, node);
+
+		for (child = node->children; child != NULL; child = child->next) {
+			if (array_append(&queue, child) < 0)
+				fatal_oom();
 		}
 	}
+	array_free_array(&queue);
+	hot_end = layout->end;
 
-	/* Write this node */
-	if (node->prefix[0]) {
-		fputs(node->prefix, out);
-		fputc('\0', out);
-	}
+	/* everything else, one subtree after the other */
+	index_layout_subtree(layout, root);
+
+	return hot_end;
+}
+
+static char *index_put_u32(char *p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static char *index_put_str(char *p, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	memcpy(p, str, len);
+	return p + len;
+}
+
+/* Serialize @node at its offset in @buf, the holes being already zeroed */
+static void index_write__node(const struct index_node *node, char *buf)
+{
+	char *p = buf + node->offset;
+
+	if (node->prefix[0])
+		p = index_put_str(p, node->prefix);
 
-	if (child_count) {
-		fputc(node->first, out);
-		fputc(node->last, out);
-		fwrite(child_offs, sizeof(uint32_t), child_count, out);
+	if (index__haschildren(node)) {
+		const struct index_node *child;
+		uint8_t first = node->children->ch;
+		uint8_t last = first;
+
+		*p++ = first;
+		p++; /* last, filled below */
+
+		for (child = node->children; child != NULL; child = child->next) {
+			index_put_u32(p + (child->ch - first) * sizeof(uint32_t),
+				      child->offset | index_get_mask(child));
+			last = child->ch;
+		}
+
+		p[-1] = last;
+		p += (last - first + 1) * sizeof(uint32_t);
 	}
 
 	if (node->values) {
 		const struct index_value *v;
 		unsigned int value_count;
-		uint32_t u;
 
 		value_count = 0;
 		for (v = node->values; v != NULL; v = v->next)
 			value_count++;
-		u = htobe32(value_count);
-		fwrite(&u, sizeof(u), 1, out);
+		p = index_put_u32(p, value_count);
 
 		for (v = node->values; v != NULL; v = v->next) {
-			u = htobe32(v->priority);
-			fwrite(&u, sizeof(u), 1, out);
-			fputs(v->value, out);
-			fputc('\0', out);
+			p = index_put_u32(p, v->priority);
+			p = index_put_str(p, v->value);
 		}
 	}
 
-	/* Now write children */
-	if (child_count) {
-		int i;
+	assert(p == buf + node->offset + node->size);
+}
 
-		offset += node->size;
-		for (i = 0; i < child_count; i++) {
-			struct index_node *child = node->children[node->first + i];
-			if (child != NULL)
-				offset += index_write__node(child, out, offset);
-		}
+/*
+ * The size and position of every node is known once the layout is done, so the
+ * whole file is serialized in memory and written at once
+ */
+/* serialized index, kept around to be copied into modules.bin */
+struct index_blob {
+	char *buf;
+	uint32_t size;
+};
+
+/*
+ * Blocks of a compressed index are uncompressed as lookups reach them: small
+ * enough that a lookup doesn't uncompress much more than it reads, big enough
+ * to compress well.
+ */
+#define INDEX_COMPRESSED_BLOCK_SIZE (16u * 1024u)
+
+/* Replace the serialized index in @blob with its compressed variant */
+static int index_compress(struct index_blob *blob)
+{
+	const uint32_t block_count =
+		blob->size / INDEX_COMPRESSED_BLOCK_SIZE +
+		(blob->size % INDEX_COMPRESSED_BLOCK_SIZE != 0);
+	const size_t hdr_size = (5 + block_count + 1) * sizeof(uint32_t);
+	void **blocks;
+	size_t *sizes;
+	size_t total = hdr_size;
+	char *buf = NULL, *p;
+	uint32_t i;
+	int err = 0;
+
+	blocks = calloc(block_count, sizeof(*blocks));
+	sizes = calloc(block_count, sizeof(*sizes));
+	if (blocks == NULL || sizes == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < block_count; i++) {
+		size_t start = (size_t)i * INDEX_COMPRESSED_BLOCK_SIZE;
+		size_t len = MIN(INDEX_COMPRESSED_BLOCK_SIZE, blob->size - start);
+
+		err = kmod_zlib_compress(blob->buf + start, len, &blocks[i], &sizes[i]);
+		if (err < 0)
+			goto out;
+		total += sizes[i];
+	}
+
+	if (total > UINT32_MAX) {
+		err = -EFBIG;
+		goto out;
+	}
+
+	buf = malloc(total);
+	if (buf == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	p = index_put_u32(buf, INDEX_COMPRESSED_MAGIC);
+	p = index_put_u32(p, INDEX_COMPRESSED_VERSION);
+	p = index_put_u32(p, INDEX_COMPRESSION_ZLIB);
+	p = index_put_u32(p, INDEX_COMPRESSED_BLOCK_SIZE);
+	p = index_put_u32(p, blob->size);
+
+	total = hdr_size;
+	for (i = 0; i < block_count; i++) {
+		p = index_put_u32(p, total);
+		memcpy(buf + total, blocks[i], sizes[i]);
+		total += sizes[i];
 	}
+	index_put_u32(p, total);
+
+	free(blob->buf);
+	blob->buf = buf;
+	blob->size = total;
 
-	return node->total;
+out:
+	for (i = 0; blocks != NULL && i < block_count; i++)
+		free(blocks[i]);
+	free(blocks);
+	free(sizes);
+
+	return err;
 }
 
-static void index_write(struct index_node *node, FILE *out)
+static int index_write(struct index *index, FILE *out, bool compress,
+		       struct index_blob *blob)
 {
-	/* First 3 words are magic, index, offset of node */
-	const uint32_t first_off = 3 * sizeof(uint32_t);
-	uint32_t u;
+	/* First 4 words are magic, version, offset of root node and hot size */
+	const uint32_t first_off = 4 * sizeof(uint32_t);
+	struct index_node *node = &index->root;
+	struct index_layout layout;
+	uint32_t hot_end;
+	char *buf, *p;
+	size_t i;
 
 	index_calculate_size(node);
+	hot_end = index_layout(&layout, node, first_off);
 
-	u = htobe32(INDEX_MAGIC);
-	fwrite(&u, sizeof(u), 1, out);
-	u = htobe32(INDEX_VERSION);
-	fwrite(&u, sizeof(u), 1, out);
+	buf = calloc(1, layout.end);
+	if (buf == NULL) {
+		array_free_array(&layout.nodes);
+		return -ENOMEM;
+	}
+
+	p = index_put_u32(buf, INDEX_MAGIC);
+	p = index_put_u32(p, INDEX_VERSION);
+	p = index_put_u32(p, node->offset | index_get_mask(node));
+	index_put_u32(p, hot_end);
+
+	for (i = 0; i < layout.nodes.count; i++)
+		index_write__node(layout.nodes.array[i], buf);
+	array_free_array(&layout.nodes);
+
+	free(blob->buf);
+	blob->buf = buf;
+	blob->size = layout.end;
+
+	if (compress) {
+		int err = index_compress(blob);
+		if (err < 0) {
+			ERR("could not compress index: %s\n", strerror(-err));
+			return err;
+		}
+	}
 
-	/* Write offset of first node */
-	u = htobe32(first_off | index_get_mask(node));
-	fwrite(&u, sizeof(u), 1, out);
+	fwrite(blob->buf, 1, blob->size, out);
 
-	/* Dump trie */
-	index_write__node(node, out, first_off);
+	return 0;
 }
 
 /* configuration parsing **********************************************/
@@ -516,6 +708,9 @@ struct cfg {
 	uint8_t check_symvers;
 	uint8_t print_unknown;
 	uint8_t warn_dups;
+	uint8_t fsync;
+	uint8_t atomic;
+	uint8_t compress_indexes;
 	struct cfg_override *overrides;
 	struct cfg_search *searches;
 	struct cfg_external *externals;
@@ -952,11 +1147,10 @@ struct mod {
 	char *path;
 	const char *relpath; /* path relative to '$ROOT$MODULE_DIRECTORY/$VER/' */
 	char *uncrelpath; /* same as relpath but ending in .ko */
-	struct kmod_list *info_list;
-	struct kmod_list *dep_sym_list;
-	struct array alias_values;
-	struct array softdep_values;
-	struct array weakdep_values;
+	struct array dep_symbols; /* struct dep_symbol */
+	struct array alias_values; /* interned strings */
+	struct array softdep_values; /* interned strings */
+	struct array weakdep_values; /* interned strings */
 	struct array deps; /* struct symbol */
 	size_t baselen; /* points to start of basename/filename */
 	size_t modnamesz;
@@ -972,18 +1166,63 @@ struct mod {
 struct symbol {
 	struct mod *owner;
 	uint64_t crc;
-	char name[];
+	const char *name; /* interned */
+};
+
+struct dep_symbol {
+	uint64_t crc;
+	const char *name; /* interned, as found in the module */
+	uint32_t id; /* string id of the name to resolve */
+	uint8_t bind;
 };
 
+struct interned {
+	uint32_t id;
+	char str[];
+};
+
+/*
+ * Modules, symbols and the strings they refer to live until the end of the
+ * run: they are allocated from @arena and released all at once. Strings are
+ * interned in @strings so each one is stored only once and gets a stable id,
+ * an index into @strings_by_id. Exported symbols are also indexed by the id
+ * of their name in @symbols_by_id, so resolving the required ones doesn't need
+ * to hash their names again.
+ */
 struct depmod {
 	const struct cfg *cfg;
 	struct kmod_ctx *ctx;
+	struct arena arena;
+	struct hash *strings;
+	struct array strings_by_id;
+	struct array symbols_by_id;
+	struct strbuf scratch;
 	struct array modules;
 	struct hash *modules_by_uncrelpath;
 	struct hash *modules_by_name;
 	struct hash *symbols;
+	/*
+	 * Transitive dependencies of each module: one bitset of @closure_words
+	 * per mod->idx, with bits indexed by dep_sort_idx so they come out
+	 * already sorted. @sorted_modules maps dep_sort_idx back to the module.
+	 */
+	uint64_t *closures;
+	size_t closure_words;
+	struct mod **sorted_modules;
+	/* the .bin indexes written so far, by enum kmod_index */
+	struct index_blob blobs[_INDEX_CONTAINER_SECTIONS];
+	/* struct manifest_dir of the directories found below dirname */
+	struct array manifest;
+	bool manifest_failed;
+};
+
+struct manifest_dir {
+	struct timespec mtime;
+	struct array files; /* names of the modules in it */
+	char relpath[];
 };
 
+/* The memory of @mod itself belongs to the arena */
 static void mod_free(struct mod *mod)
 {
 	DBG("free %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
@@ -991,12 +1230,49 @@ static void mod_free(struct mod *mod)
 	array_free_array(&mod->weakdep_values);
 	array_free_array(&mod->softdep_values);
 	array_free_array(&mod->alias_values);
+	array_free_array(&mod->dep_symbols);
 	kmod_module_unref(mod->kmod);
-	kmod_module_info_free_list(mod->info_list);
-	kmod_module_dependency_symbols_free_list(mod->dep_sym_list);
-	free(mod->uncrelpath);
-	free(mod->path);
-	free(mod);
+}
+
+/* Return the id of @str, adding it to the pool if needed, or a negative errno */
+static int depmod_intern(struct depmod *depmod, const char *str, size_t len)
+{
+	struct interned *in;
+	const char *key;
+
+	strbuf_clear(&depmod->scratch);
+	if (strbuf_pushmem(&depmod->scratch, str, len) != len)
+		return -ENOMEM;
+	key = strbuf_str(&depmod->scratch);
+	if (key == NULL)
+		return -ENOMEM;
+
+	in = hash_find(depmod->strings, key);
+	if (in != NULL)
+		return in->id;
+
+	if (depmod->strings_by_id.count >= INT_MAX)
+		return -ENOSPC;
+
+	in = arena_alloc(&depmod->arena, sizeof(struct interned) + len + 1);
+	if (in == NULL)
+		return -ENOMEM;
+
+	in->id = depmod->strings_by_id.count;
+	memcpy(in->str, str, len);
+	in->str[len] = '\0';
+
+	if (array_append(&depmod->strings_by_id, in->str) < 0 ||
+	    array_append(&depmod->symbols_by_id, NULL) < 0 ||
+	    hash_add(depmod->strings, in->str, in) < 0)
+		return -ENOMEM;
+
+	return in->id;
+}
+
+static inline const char *depmod_string(const struct depmod *depmod, uint32_t id)
+{
+	return depmod->strings_by_id.array[id];
 }
 
 static int mod_add_dependency(struct mod *mod, struct symbol *sym)
@@ -1023,21 +1299,21 @@ static int mod_add_dependency(struct mod *mod, struct symbol *sym)
 	return 0;
 }
 
-static void symbol_free(void *data)
-{
-	struct symbol *sym = data;
-
-	DBG("free %p sym=%s, owner=%p %s\n", sym, sym->name, sym->owner,
-	    sym->owner != NULL ? sym->owner->path : "");
-	free(sym);
-}
-
 static int depmod_init(struct depmod *depmod, struct cfg *cfg, struct kmod_ctx *ctx)
 {
 	depmod->cfg = cfg;
 	depmod->ctx = ctx;
 
+	arena_init(&depmod->arena, 1024 * 1024);
+	array_init(&depmod->strings_by_id, 16384);
+	array_init(&depmod->symbols_by_id, 16384);
+	strbuf_init(&depmod->scratch);
 	array_init(&depmod->modules, 128);
+	array_init(&depmod->manifest, 128);
+
+	depmod->strings = hash_new(16384, NULL);
+	if (depmod->strings == NULL)
+		goto strings_failed;
 
 	depmod->modules_by_uncrelpath = hash_new(512, NULL);
 	if (depmod->modules_by_uncrelpath == NULL)
@@ -1047,7 +1323,7 @@ static int depmod_init(struct depmod *depmod, struct cfg *cfg, struct kmod_ctx *
 	if (depmod->modules_by_name == NULL)
 		goto modules_by_name_failed;
 
-	depmod->symbols = hash_new(2048, symbol_free);
+	depmod->symbols = hash_new(2048, NULL);
 	if (depmod->symbols == NULL)
 		goto symbols_failed;
 
@@ -1058,6 +1334,8 @@ symbols_failed:
 modules_by_name_failed:
 	hash_free(depmod->modules_by_uncrelpath);
 modules_by_uncrelpath_failed:
+	hash_free(depmod->strings);
+strings_failed:
 	return -ENOMEM;
 }
 
@@ -1065,6 +1343,9 @@ static void depmod_shutdown(struct depmod *depmod)
 {
 	size_t i;
 
+	for (i = 0; i < ARRAY_SIZE(depmod->blobs); i++)
+		free(depmod->blobs[i].buf);
+
 	hash_free(depmod->symbols);
 
 	hash_free(depmod->modules_by_uncrelpath);
@@ -1075,13 +1356,25 @@ static void depmod_shutdown(struct depmod *depmod)
 		mod_free(depmod->modules.array[i]);
 	array_free_array(&depmod->modules);
 
+	for (i = 0; i < depmod->manifest.count; i++) {
+		struct manifest_dir *dir = depmod->manifest.array[i];
+		array_free_array(&dir->files);
+	}
+	array_free_array(&depmod->manifest);
+
+	hash_free(depmod->strings);
+	array_free_array(&depmod->symbols_by_id);
+	array_free_array(&depmod->strings_by_id);
+	strbuf_release(&depmod->scratch);
+	arena_release(&depmod->arena);
+
 	kmod_unref(depmod->ctx);
 }
 
 static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 {
 	const struct cfg *cfg = depmod->cfg;
-	const char *modname, *lastslash;
+	const char *modname, *path, *lastslash;
 	size_t modnamesz;
 	struct mod *mod;
 	int err;
@@ -1089,7 +1382,7 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	modname = kmod_module_get_name(kmod);
 	modnamesz = strlen(modname) + 1;
 
-	mod = calloc(1, sizeof(struct mod) + modnamesz);
+	mod = arena_zalloc(&depmod->arena, sizeof(struct mod) + modnamesz);
 	if (mod == NULL)
 		return -ENOMEM;
 	mod->kmod = kmod;
@@ -1101,14 +1394,14 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	array_init(&mod->alias_values, 32); // fits ~80%, ~5% are in the xxx+
 	array_init(&mod->softdep_values, 8); // fits ~95%, the rest are sub 16
 	array_init(&mod->weakdep_values, 4); // fits 100%
+	array_init(&mod->dep_symbols, 64);
 
 	array_init(&mod->deps, 4);
 
-	mod->path = strdup(kmod_module_get_path(kmod));
-	if (mod->path == NULL) {
-		free(mod);
+	path = kmod_module_get_path(kmod);
+	mod->path = arena_strndup(&depmod->arena, path, strlen(path));
+	if (mod->path == NULL)
 		return -ENOMEM;
-	}
 	lastslash = strrchr(mod->path, '/');
 	mod->baselen = lastslash - mod->path;
 	if (strncmp(mod->path, cfg->dirname, cfg->dirnamelen) == 0 &&
@@ -1120,36 +1413,29 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	err = hash_add_unique(depmod->modules_by_name, mod->modname, mod);
 	if (err < 0) {
 		ERR("hash_add_unique %s: %s\n", mod->modname, strerror(-err));
-		goto fail;
+		return err;
 	}
 
 	if (mod->relpath != NULL) {
 		size_t uncrelpathlen = lastslash - mod->relpath + modnamesz +
 				       strlen(KMOD_EXTENSION_UNCOMPRESSED);
-		mod->uncrelpath = memdup(mod->relpath, uncrelpathlen + 1);
+		mod->uncrelpath = arena_strndup(&depmod->arena, mod->relpath,
+						uncrelpathlen);
 		if (mod->uncrelpath == NULL) {
-			err = -ENOMEM;
 			hash_del(depmod->modules_by_name, mod->modname);
-			goto fail;
+			return -ENOMEM;
 		}
-		mod->uncrelpath[uncrelpathlen] = '\0';
 		err = hash_add_unique(depmod->modules_by_uncrelpath, mod->uncrelpath, mod);
 		if (err < 0) {
 			ERR("hash_add_unique %s: %s\n", mod->uncrelpath, strerror(-err));
 			hash_del(depmod->modules_by_name, mod->modname);
-			goto fail;
+			return err;
 		}
 	}
 
 	DBG("add %p kmod=%p, path=%s\n", mod, kmod, mod->path);
 
 	return 0;
-
-fail:
-	free(mod->uncrelpath);
-	free(mod->path);
-	free(mod);
-	return err;
 }
 
 static int depmod_module_del(struct depmod *depmod, struct mod *mod)
@@ -1327,6 +1613,10 @@ static bool should_exclude_dir(const struct cfg *cfg, const char *name)
 	if (streq(name, "build") || streq(name, "source"))
 		return true;
 
+	/* our own output, see depmod_generation_create() */
+	if (streq(name, KMOD_INDEX_CURRENT) || strstartswith(name, KMOD_INDEX_GENERATION))
+		return true;
+
 	for (exc = cfg->excludes; exc != NULL; exc = exc->next) {
 		if (streq(name, exc->exclude_dir))
 			return true;
@@ -1335,125 +1625,382 @@ static bool should_exclude_dir(const struct cfg *cfg, const char *name)
 	return false;
 }
 
-static void depmod_modules_search_dir(struct depmod *depmod, DIR *d, struct strbuf *path)
+/*
+ * Remember the modification time of the directory at @path, taken before
+ * reading it, and the modules in it: depfile_up_to_date() can then skip
+ * reading the directories that didn't change since.
+ */
+static struct manifest_dir *depmod_manifest_add(struct depmod *depmod,
+						const struct timespec *mtime,
+						struct strbuf *path)
 {
-	struct dirent *de;
-	int dfd = dirfd(d);
-	size_t baselen;
+	const char *relpath = strbuf_str(path) + depmod->cfg->dirnamelen + 1;
+	struct manifest_dir *dir;
+	size_t len;
 
-	if (!strbuf_pushchar(path, '/')) {
-		ERR("No memory\n");
-		return;
-	}
-	baselen = strbuf_used(path);
+	len = strlen(relpath);
+	dir = arena_alloc(&depmod->arena, sizeof(*dir) + len + 1);
+	if (dir == NULL)
+		goto fail;
 
-	while ((de = readdir(d)) != NULL) {
-		const char *name = de->d_name;
-		size_t namelen;
-		uint8_t is_dir;
+	dir->mtime = *mtime;
+	array_init(&dir->files, 16);
+	memcpy(dir->relpath, relpath, len + 1);
 
-		if (should_exclude_dir(depmod->cfg, name))
-			continue;
+	if (array_append(&depmod->manifest, dir) < 0)
+		goto fail;
 
-		strbuf_shrink_to(path, baselen);
+	return dir;
 
-		namelen = strlen(name);
+fail:
+	depmod->manifest_failed = true;
+	return NULL;
+}
 
-		if (!strbuf_pushchars(path, name)) {
-			ERR("No memory\n");
-			continue;
-		}
+static void depmod_manifest_add_file(struct depmod *depmod, struct manifest_dir *dir,
+				     const char *name, size_t namelen)
+{
+	char *file = arena_strndup(&depmod->arena, name, namelen);
 
-		if (de->d_type == DT_REG)
-			is_dir = 0;
-		else if (de->d_type == DT_DIR)
-			is_dir = 1;
-		else {
-			struct stat st;
-			if (fstatat(dfd, name, &st, 0) < 0) {
-				ERR("fstatat(%d, %s): %m\n", dfd, name);
-				continue;
-			} else if (S_ISREG(st.st_mode))
-				is_dir = 0;
-			else if (S_ISDIR(st.st_mode))
-				is_dir = 1;
-			else {
-				ERR("unsupported file type %s: %o\n", strbuf_str(path),
-				    st.st_mode & S_IFMT);
-				continue;
-			}
-		}
+	if (file == NULL || array_append(&dir->files, file) < 0)
+		depmod->manifest_failed = true;
+}
 
-		if (is_dir) {
-			int fd;
-			DIR *subdir;
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n", dfd, name);
-				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
-				continue;
-			}
+/*
+ * Directory traversal
+ *
+ * Reading the directories is mostly waiting on the filesystem, so it's done by
+ * a pool of threads taking them from a shared queue, to which they add the
+ * subdirectories they find. Each directory keeps its entries in readdir()
+ * order. The modules are then added on the calling thread by walking the
+ * resulting tree depth-first, i.e. in the same order as a serial walk, so ties
+ * in depmod_module_is_higher_priority() are resolved the same way.
+ *
+ * The top directories are read first, on the calling thread. A tree is
+ * usually split into a few large subdirectories such as kernel/ and updates/,
+ * so there's no point in having more threads than those, nor any at all when
+ * there is a single one.
+ */
 
-			depmod_modules_search_dir(depmod, subdir, path);
-			closedir(subdir);
-		} else {
-			int err = depmod_modules_search_file(depmod, baselen, namelen,
-							     strbuf_str(path));
-			if (err < 0)
-				ERR("failed %s: %s\n", strbuf_str(path), strerror(-err));
-		}
-	}
-}
+struct search_dir;
+
+struct search_entry {
+	struct search_dir *subdir; /* NULL for files */
+	size_t namelen;
+	char name[];
+};
 
-static int depmod_modules_search_path(struct depmod *depmod, const char *path)
+struct search_dir {
+	struct search_dir *next; /* in the queue */
+	struct array entries; /* struct search_entry, in readdir() order */
+	struct timespec mtime; /* before reading it */
+	int err;
+	char path[];
+};
+
+struct search_queue {
+	const struct cfg *cfg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct search_dir *head;
+	struct search_dir **tail;
+	size_t pending; /* queued or being read */
+};
+
+static struct search_dir *search_dir_new(const char *path, size_t len, const char *name,
+					 size_t namelen)
 {
-	DECLARE_STRBUF_WITH_STACK(s_path_buf, 256);
-	DIR *d;
-	int err = 0;
+	struct search_dir *dir;
 
-	d = opendir(path);
-	if (d == NULL) {
-		err = -errno;
-		ERR("could not open directory %s: %m\n", path);
-		return err;
-	}
+	dir = malloc(sizeof(*dir) + len + 1 + namelen + 1);
+	if (dir == NULL)
+		return NULL;
 
-	if (!strbuf_pushchars(&s_path_buf, path)) {
-		err = -ENOMEM;
-		goto out;
+	dir->next = NULL;
+	array_init(&dir->entries, 16);
+	dir->err = 0;
+	memcpy(dir->path, path, len);
+	if (name != NULL) {
+		dir->path[len++] = '/';
+		memcpy(dir->path + len, name, namelen);
+		len += namelen;
 	}
+	dir->path[len] = '\0';
 
-	depmod_modules_search_dir(depmod, d, &s_path_buf);
-out:
-	closedir(d);
-	return err;
+	return dir;
 }
 
-static int depmod_modules_search(struct depmod *depmod)
+static void search_dir_free(struct search_dir *dir)
 {
-	int err;
-	struct cfg_external *ext;
+	size_t i;
 
-	err = depmod_modules_search_path(depmod, depmod->cfg->dirname);
-	if (err < 0)
-		return err;
+	for (i = 0; i < dir->entries.count; i++) {
+		struct search_entry *e = dir->entries.array[i];
 
-	for (ext = depmod->cfg->externals; ext != NULL; ext = ext->next) {
-		err = depmod_modules_search_path(depmod, ext->path);
-		if (err < 0 && err == -ENOENT)
-			/* ignore external dir absence */
-			continue;
+		if (e->subdir != NULL)
+			search_dir_free(e->subdir);
+		free(e);
 	}
+	array_free_array(&dir->entries);
+	free(dir);
+}
 
-	return 0;
+static void search_queue_push(struct search_queue *q, struct search_dir *dir)
+{
+	pthread_mutex_lock(&q->lock);
+	*q->tail = dir;
+	q->tail = &dir->next;
+	q->pending++;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
 }
 
-static int mod_cmp(const void *pa, const void *pb)
+static void search_dir_read(struct search_queue *q, struct search_dir *dir)
+{
+	size_t len = strlen(dir->path);
+	struct dirent *de;
+	struct stat st;
+	int dfd;
+	DIR *d;
+
+	d = opendir(dir->path);
+	if (d == NULL) {
+		dir->err = -errno;
+		ERR("could not open directory %s: %m\n", dir->path);
+		return;
+	}
+	dfd = dirfd(d);
+
+	if (fstat(dfd, &st) < 0) {
+		dir->err = -errno;
+		ERR("could not stat directory %s: %m\n", dir->path);
+		closedir(d);
+		return;
+	}
+	dir->mtime = st.st_mtim;
+
+	while ((de = readdir(d)) != NULL) {
+		const char *name = de->d_name;
+		struct search_entry *e;
+		size_t namelen;
+		bool is_dir;
+
+		if (should_exclude_dir(q->cfg, name))
+			continue;
+
+		if (de->d_type == DT_REG)
+			is_dir = false;
+		else if (de->d_type == DT_DIR)
+			is_dir = true;
+		else if (fstatat(dfd, name, &st, 0) < 0) {
+			ERR("fstatat(%d, %s): %m\n", dfd, name);
+			continue;
+		} else if (S_ISREG(st.st_mode))
+			is_dir = false;
+		else if (S_ISDIR(st.st_mode))
+			is_dir = true;
+		else {
+			ERR("unsupported file type %s/%s: %o\n", dir->path, name,
+			    st.st_mode & S_IFMT);
+			continue;
+		}
+
+		namelen = strlen(name);
+		e = malloc(sizeof(*e) + namelen + 1);
+		if (e == NULL) {
+			ERR("No memory\n");
+			continue;
+		}
+		e->namelen = namelen;
+		memcpy(e->name, name, namelen + 1);
+		e->subdir = NULL;
+
+		if (is_dir) {
+			e->subdir = search_dir_new(dir->path, len, name, namelen);
+			if (e->subdir == NULL) {
+				ERR("No memory\n");
+				free(e);
+				continue;
+			}
+		}
+
+		if (array_append(&dir->entries, e) < 0) {
+			ERR("No memory\n");
+			free(e->subdir);
+			free(e);
+			continue;
+		}
+
+		if (e->subdir != NULL)
+			search_queue_push(q, e->subdir);
+	}
+
+	closedir(d);
+}
+
+static void *search_worker(void *data)
+{
+	struct search_queue *q = data;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		struct search_dir *dir;
+
+		while (q->head == NULL && q->pending > 0)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (q->head == NULL)
+			break;
+
+		dir = q->head;
+		q->head = dir->next;
+		if (q->head == NULL)
+			q->tail = &q->head;
+		pthread_mutex_unlock(&q->lock);
+
+		search_dir_read(q, dir);
+
+		pthread_mutex_lock(&q->lock);
+		if (--q->pending == 0)
+			pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+static void search_run(struct search_queue *q)
+{
+	pthread_t threads[16];
+	size_t i, n_threads;
+	long n_cpus;
+
+	/* no thread started yet, the queue holds the top-level directories */
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = n_cpus > 1 ? (size_t)n_cpus : 1;
+	n_threads = MIN(n_threads, MIN(q->pending, ARRAY_SIZE(threads) + 1));
+
+	/* the calling thread is one of the workers */
+	for (i = 0; i + 1 < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, search_worker, q) != 0)
+			break;
+	}
+	n_threads = i;
+
+	search_worker(q);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void depmod_modules_search_dir(struct depmod *depmod, const struct search_dir *dir,
+				      struct strbuf *path, bool manifest)
+{
+	struct manifest_dir *mdir = NULL;
+	size_t baselen, i;
+
+	if (dir->err < 0)
+		return;
+
+	/* the top directory is where the output goes, see depfile_up_to_date() */
+	if (manifest && strbuf_used(path) > depmod->cfg->dirnamelen)
+		mdir = depmod_manifest_add(depmod, &dir->mtime, path);
+
+	if (!strbuf_pushchar(path, '/')) {
+		ERR("No memory\n");
+		return;
+	}
+	baselen = strbuf_used(path);
+
+	for (i = 0; i < dir->entries.count; i++) {
+		const struct search_entry *e = dir->entries.array[i];
+		int err;
+
+		strbuf_shrink_to(path, baselen);
+
+		if (!strbuf_pushchars(path, e->name)) {
+			ERR("No memory\n");
+			continue;
+		}
+
+		if (e->subdir != NULL) {
+			depmod_modules_search_dir(depmod, e->subdir, path, manifest);
+			continue;
+		}
+
+		if (mdir != NULL && path_ends_with_kmod_ext(e->name, e->namelen))
+			depmod_manifest_add_file(depmod, mdir, e->name, e->namelen);
+
+		err = depmod_modules_search_file(depmod, baselen, e->namelen,
+						 strbuf_str(path));
+		if (err < 0)
+			ERR("failed %s: %s\n", strbuf_str(path), strerror(-err));
+	}
+}
+
+static int depmod_modules_search(struct depmod *depmod)
+{
+	DECLARE_STRBUF_WITH_STACK(s_path_buf, 256);
+	struct search_queue q = {
+		.cfg = depmod->cfg,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct array roots;
+	struct cfg_external *ext;
+	const struct search_dir *top;
+	int err = 0;
+	size_t i;
+
+	q.tail = &q.head;
+	array_init(&roots, 8);
+
+	err = array_append(&roots, search_dir_new(depmod->cfg->dirname,
+						  depmod->cfg->dirnamelen, NULL, 0));
+	for (ext = depmod->cfg->externals; ext != NULL && err >= 0; ext = ext->next)
+		err = array_append(&roots, search_dir_new(ext->path, strlen(ext->path),
+							  NULL, 0));
+
+	for (i = 0; i < roots.count; i++) {
+		if (roots.array[i] == NULL)
+			err = -ENOMEM;
+	}
+	if (err < 0)
+		goto out;
+
+	for (i = 0; i < roots.count; i++)
+		search_dir_read(&q, roots.array[i]);
+	search_run(&q);
+
+	/* external directories may be absent */
+	top = roots.array[0];
+	if (top->err < 0) {
+		err = top->err;
+		goto out;
+	}
+
+	for (i = 0; i < roots.count; i++) {
+		const struct search_dir *dir = roots.array[i];
+
+		strbuf_clear(&s_path_buf);
+		if (!strbuf_pushchars(&s_path_buf, dir->path)) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		depmod_modules_search_dir(depmod, dir, &s_path_buf, i == 0);
+	}
+
+out:
+	for (i = 0; i < roots.count; i++) {
+		if (roots.array[i] != NULL)
+			search_dir_free(roots.array[i]);
+	}
+	array_free_array(&roots);
+
+	return err;
+}
+
+static int mod_cmp(const void *pa, const void *pb)
 {
 	const struct mod *a = *(const struct mod **)pa;
 	const struct mod *b = *(const struct mod **)pb;
@@ -1480,32 +2027,71 @@ static int depmod_modules_build_array(struct depmod *depmod)
 	return 0;
 }
 
-static FILE *dfdopen(const char *dname, const char *filename, int flags, const char *mode)
+static int dfdopen_fd(const char *dname, const char *filename, int flags)
 {
 	int fd, dfd;
-	FILE *ret;
 
 	dfd = open(dname, O_RDONLY);
 	if (dfd < 0) {
 		WRN("could not open directory %s: %m\n", dname);
-		return NULL;
+		return -1;
 	}
 
 	fd = openat(dfd, filename, flags);
-	if (fd < 0) {
+	if (fd < 0)
 		WRN("could not open %s at %s: %m\n", filename, dname);
-		ret = NULL;
-	} else {
-		ret = fdopen(fd, mode);
-		if (!ret) {
-			WRN("could not associate stream with %s: %m\n", filename);
-			close(fd);
-		}
-	}
 	close(dfd);
+	return fd;
+}
+
+static FILE *dfdopen(const char *dname, const char *filename, int flags, const char *mode)
+{
+	FILE *ret;
+	int fd;
+
+	fd = dfdopen_fd(dname, filename, flags);
+	if (fd < 0)
+		return NULL;
+
+	ret = fdopen(fd, mode);
+	if (!ret) {
+		WRN("could not associate stream with %s: %m\n", filename);
+		close(fd);
+	}
 	return ret;
 }
 
+/* Map a whole file for reading, empty ones included; release with file_unmap() */
+static int file_map(int fd, const char **map, size_t *size)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	if (st.st_size == 0) {
+		*map = "";
+		*size = 0;
+		return 0;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	*map = p;
+	*size = st.st_size;
+	return 0;
+}
+
+static void file_unmap(const char *map, size_t size)
+{
+	if (size > 0)
+		munmap((void *)map, size);
+}
+
 static void depmod_modules_sort(struct depmod *depmod)
 {
 	char line[PATH_MAX];
@@ -1549,30 +2135,28 @@ corrupted:
 	fclose(fp);
 }
 
-static int depmod_symbol_add(struct depmod *depmod, const char *name, bool prefix_skipped,
-			     uint64_t crc, const struct mod *owner)
+static int depmod_symbol_add_n(struct depmod *depmod, const char *name, size_t len,
+			       uint64_t crc, const struct mod *owner)
 {
-	size_t namelen;
-	int err;
+	int err, id;
 	struct symbol *sym;
 
-	if (!prefix_skipped && (name[0] == depmod->cfg->sym_prefix))
-		name++;
+	id = depmod_intern(depmod, name, len);
+	if (id < 0)
+		return id;
 
-	namelen = strlen(name) + 1;
-	sym = malloc(sizeof(struct symbol) + namelen);
+	sym = arena_alloc(&depmod->arena, sizeof(struct symbol));
 	if (sym == NULL)
 		return -ENOMEM;
 
+	sym->name = depmod_string(depmod, id);
 	sym->owner = (struct mod *)owner;
 	sym->crc = crc;
-	memcpy(sym->name, name, namelen);
 
 	err = hash_add(depmod->symbols, sym->name, sym);
-	if (err < 0) {
-		free(sym);
+	if (err < 0)
 		return err;
-	}
+	depmod->symbols_by_id.array[id] = sym;
 
 	DBG("add %p sym=%s, owner=%p %s\n", sym, sym->name, owner,
 	    owner != NULL ? owner->path : "");
@@ -1580,6 +2164,15 @@ static int depmod_symbol_add(struct depmod *depmod, const char *name, bool prefi
 	return 0;
 }
 
+static int depmod_symbol_add(struct depmod *depmod, const char *name, bool prefix_skipped,
+			     uint64_t crc, const struct mod *owner)
+{
+	if (!prefix_skipped && (name[0] == depmod->cfg->sym_prefix))
+		name++;
+
+	return depmod_symbol_add_n(depmod, name, strlen(name), crc, owner);
+}
+
 static struct symbol *depmod_symbol_find(const struct depmod *depmod, const char *name)
 {
 	if (name[0] == '.') /* PPC64 needs this: .foo == foo */
@@ -1589,6 +2182,90 @@ static struct symbol *depmod_symbol_find(const struct depmod *depmod, const char
 	return hash_find(depmod->symbols, name);
 }
 
+struct depmod_load {
+	struct depmod *depmod;
+	struct mod *mod;
+};
+
+static int depmod_load_module_info(const char *key, size_t keylen, const char *value,
+				   size_t valuelen, void *data)
+{
+	struct depmod_load *load = data;
+	struct mod *mod = load->mod;
+	struct array *values;
+	int id;
+
+	/* key isn't nul terminated */
+	if (keylen == strlen("alias") && memcmp(key, "alias", keylen) == 0)
+		values = &mod->alias_values;
+	else if (keylen == strlen("softdep") && memcmp(key, "softdep", keylen) == 0)
+		values = &mod->softdep_values;
+	else if (keylen == strlen("weakdep") && memcmp(key, "weakdep", keylen) == 0)
+		values = &mod->weakdep_values;
+	else
+		return 0;
+
+	id = depmod_intern(load->depmod, value, valuelen);
+	if (id < 0 || array_append(values, depmod_string(load->depmod, id)) < 0)
+		fatal_oom();
+
+	return 0;
+}
+
+static int depmod_load_module_symbol(const char *symbol, size_t len, uint64_t crc,
+				     enum kmod_symbol_bind bind, void *data)
+{
+	struct depmod_load *load = data;
+
+	return depmod_symbol_add(load->depmod, symbol, false, crc, load->mod);
+}
+
+static int depmod_load_module_dependency_symbol(const char *symbol, size_t len,
+						uint64_t crc, enum kmod_symbol_bind bind,
+						void *data)
+{
+	struct depmod_load *load = data;
+	struct depmod *depmod = load->depmod;
+	const char *name = symbol;
+	struct dep_symbol *ds;
+	int id;
+
+	ds = arena_alloc(&depmod->arena, sizeof(struct dep_symbol));
+	if (ds == NULL)
+		fatal_oom();
+
+	/* resolve by the same name as depmod_symbol_find() */
+	if (len > 0 && name[0] == '.') { /* PPC64 needs this: .foo == foo */
+		name++;
+		len--;
+	}
+	if (len > 0 && name[0] == depmod->cfg->sym_prefix) {
+		name++;
+		len--;
+	}
+
+	id = depmod_intern(depmod, name, len);
+	if (id < 0)
+		fatal_oom();
+
+	ds->crc = crc;
+	ds->bind = bind;
+	ds->id = id;
+	if (name == symbol) {
+		ds->name = depmod_string(depmod, id);
+	} else {
+		id = depmod_intern(depmod, symbol, len + (name - symbol));
+		if (id < 0)
+			fatal_oom();
+		ds->name = depmod_string(depmod, id);
+	}
+
+	if (array_append(&load->mod->dep_symbols, ds) < 0)
+		fatal_oom();
+
+	return 0;
+}
+
 static int depmod_load_modules(struct depmod *depmod)
 {
 	struct mod **itr, **itr_end;
@@ -1599,51 +2276,33 @@ static int depmod_load_modules(struct depmod *depmod)
 	itr_end = itr + depmod->modules.count;
 	for (; itr < itr_end; itr++) {
 		struct mod *mod = *itr;
-		struct kmod_list *l, *list = NULL;
-		int err = kmod_module_get_symbols(mod->kmod, &list);
+		struct depmod_load load = {
+			.depmod = depmod,
+			.mod = mod,
+		};
+		struct kmod_module_extract ex = {
+			.info_keys = KMOD_MODULE_INFO_ALIAS | KMOD_MODULE_INFO_SOFTDEP |
+				     KMOD_MODULE_INFO_WEAKDEP,
+			.info = depmod_load_module_info,
+			.symbol = depmod_load_module_symbol,
+			.dependency_symbol = depmod_load_module_dependency_symbol,
+			.data = &load,
+		};
+		int err = kmod_module_extract(mod->kmod, &ex);
+		if (err == 0)
+			err = ex.symbol_ret;
 		if (err < 0) {
 			if (err == -ENODATA)
 				DBG("ignoring %s: no symbols\n", mod->path);
 			else
 				ERR("failed to load symbols from %s: %s\n", mod->path,
 				    strerror(-err));
-			goto load_info;
-		}
-		kmod_list_foreach(l, list) {
-			const char *name = kmod_module_symbol_get_symbol(l);
-			uint64_t crc = kmod_module_symbol_get_crc(l);
-			depmod_symbol_add(depmod, name, false, crc, mod);
 		}
-		kmod_module_symbols_free_list(list);
-
-load_info:
-		kmod_module_get_info(mod->kmod, &mod->info_list);
-		kmod_list_foreach(l, mod->info_list) {
-			const char *key = kmod_module_info_get_key(l);
-
-			if (streq(key, "alias")) {
-				const char *value = kmod_module_info_get_value(l);
 
-				if (array_append(&mod->alias_values, value) < 0)
-					return 0;
-				continue;
-			}
-			if (streq(key, "softdep")) {
-				const char *value = kmod_module_info_get_value(l);
-
-				if (array_append(&mod->softdep_values, value) < 0)
-					return 0;
-				continue;
-			}
-			if (streq(key, "weakdep")) {
-				const char *value = kmod_module_info_get_value(l);
+		/* a partial list is no better than none */
+		if (ex.dependency_symbol_ret < 0)
+			array_free_array(&mod->dep_symbols);
 
-				if (array_append(&mod->weakdep_values, value) < 0)
-					return 0;
-				continue;
-			}
-		}
-		kmod_module_get_dependency_symbols(mod->kmod, &mod->dep_sym_list);
 		kmod_module_unref(mod->kmod);
 		mod->kmod = NULL;
 	}
@@ -1657,15 +2316,16 @@ load_info:
 static int depmod_load_module_dependencies(struct depmod *depmod, struct mod *mod)
 {
 	const struct cfg *cfg = depmod->cfg;
-	struct kmod_list *l;
+	size_t i;
 	int ret = 0;
 
 	DBG("do dependencies of %s\n", mod->path);
-	kmod_list_foreach(l, mod->dep_sym_list) {
-		const char *name = kmod_module_dependency_symbol_get_symbol(l);
-		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
-		int bindtype = kmod_module_dependency_symbol_get_bind(l);
-		struct symbol *sym = depmod_symbol_find(depmod, name);
+	for (i = 0; i < mod->dep_symbols.count; i++) {
+		const struct dep_symbol *ds = mod->dep_symbols.array[i];
+		const char *name = ds->name;
+		uint64_t crc = ds->crc;
+		int bindtype = ds->bind;
+		struct symbol *sym = depmod->symbols_by_id.array[ds->id];
 		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
 		int err;
 
@@ -1707,7 +2367,7 @@ static int depmod_load_dependencies(struct depmod *depmod)
 		struct mod *mod = *itr;
 		int err;
 
-		if (mod->dep_sym_list == NULL) {
+		if (mod->dep_symbols.count == 0) {
 			DBG("ignoring %s: no dependency symbols\n", mod->path);
 			continue;
 		}
@@ -1723,25 +2383,6 @@ static int depmod_load_dependencies(struct depmod *depmod)
 	return ret;
 }
 
-static int dep_cmp(const void *pa, const void *pb)
-{
-	const struct mod *a = *(const struct mod **)pa;
-	const struct mod *b = *(const struct mod **)pb;
-	return a->dep_sort_idx - b->dep_sort_idx;
-}
-
-static void depmod_sort_dependencies(struct depmod *depmod)
-{
-	struct mod **itr, **itr_end;
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *m = *itr;
-		if (m->deps.count > 1)
-			array_sort(&m->deps, dep_cmp);
-	}
-}
-
 struct vertex {
 	struct vertex *parent;
 	struct mod *mod;
@@ -1977,6 +2618,49 @@ out_list:
 	}
 }
 
+/*
+ * Walk the modules in reverse topological order, so the closure of each
+ * dependency is complete by the time it is merged into its users'.
+ */
+static int depmod_calculate_closures(struct depmod *depmod, const uint16_t *sorted)
+{
+	size_t i, n_mods = depmod->modules.count;
+	size_t words = (n_mods + 63) / 64;
+	size_t size;
+
+	if (umulsz_overflow(n_mods, words, &size) ||
+	    umulsz_overflow(size, sizeof(uint64_t), &size))
+		return -ENOMEM;
+
+	depmod->closures = arena_zalloc(&depmod->arena, size);
+	depmod->sorted_modules = arena_alloc(&depmod->arena, n_mods * sizeof(struct mod *));
+	if (depmod->closures == NULL || depmod->sorted_modules == NULL)
+		return -ENOMEM;
+	depmod->closure_words = words;
+
+	for (i = n_mods; i-- > 0;) {
+		struct mod *m = depmod->modules.array[sorted[i]];
+		uint64_t *closure = depmod->closures + m->idx * words;
+		size_t j;
+
+		depmod->sorted_modules[i] = m;
+
+		for (j = 0; j < m->deps.count; j++) {
+			const struct mod *d = m->deps.array[j];
+			const uint64_t *dc = depmod->closures + d->idx * words;
+			size_t w = d->dep_sort_idx / 64;
+
+			closure[w] |= UINT64_C(1) << (d->dep_sort_idx % 64);
+
+			/* everything @d depends on sorts after it */
+			for (; w < words; w++)
+				closure[w] |= dc[w];
+		}
+	}
+
+	return 0;
+}
+
 static int depmod_calculate_dependencies(struct depmod *depmod)
 {
 	const struct mod **itrm;
@@ -2039,7 +2723,9 @@ static int depmod_calculate_dependencies(struct depmod *depmod)
 		goto exit;
 	}
 
-	depmod_sort_dependencies(depmod);
+	ret = depmod_calculate_closures(depmod, sorted);
+	if (ret < 0)
+		goto exit;
 
 	DBG("calculated dependencies and ordering (%hu modules)\n", n_mods);
 
@@ -2067,39 +2753,29 @@ static int depmod_load(struct depmod *depmod)
 	return 0;
 }
 
-static int mod_fill_all_unique_dependencies(const struct mod *mod, struct array *deps)
+/*
+ * Return the next module in the sorted transitive dependencies of @mod,
+ * starting at position *@pos, which is updated to continue the iteration.
+ */
+static const struct mod *mod_next_dependency(const struct depmod *depmod,
+					     const struct mod *mod, size_t *pos)
 {
-	size_t i;
-	int err = 0;
+	const uint64_t *closure = depmod->closures + mod->idx * depmod->closure_words;
+	size_t w = *pos / 64;
+	uint64_t bits;
 
-	for (i = 0; i < mod->deps.count; i++) {
-		const struct mod *d = mod->deps.array[i];
-
-		err = array_append_unique(deps, d);
-		if (err < 0) {
-			if (err == -EEXIST) {
-				err = 0;
-				continue;
-			}
-			return err;
-		}
+	if (w >= depmod->closure_words)
+		return NULL;
 
-		err = mod_fill_all_unique_dependencies(d, deps);
-		if (err < 0)
-			break;
+	bits = closure[w] & (UINT64_MAX << (*pos % 64));
+	while (bits == 0) {
+		if (++w >= depmod->closure_words)
+			return NULL;
+		bits = closure[w];
 	}
-	return err;
-}
-
-static bool mod_get_all_sorted_dependencies(const struct mod *mod, struct array *deps)
-{
-	deps->count = 0;
-	if (mod_fill_all_unique_dependencies(mod, deps) < 0)
-		return false;
 
-	if (deps->count > 1)
-		array_sort(deps, dep_cmp);
-	return true;
+	*pos = w * 64 + __builtin_ctzll(bits);
+	return depmod->sorted_modules[(*pos)++];
 }
 
 static inline const char *mod_get_compressed_path(const struct mod *mod)
@@ -2112,43 +2788,29 @@ static inline const char *mod_get_compressed_path(const struct mod *mod)
 static int output_deps(struct depmod *depmod, FILE *out)
 {
 	size_t i;
-	struct array deps;
-
-	array_init(&deps, 64);
 
 	for (i = 0; i < depmod->modules.count; i++) {
 		const struct mod *mod = depmod->modules.array[i];
-		const char *p = mod_get_compressed_path(mod);
-		size_t j;
+		const struct mod *d;
+		size_t pos = 0;
 
-		fprintf(out, "%s:", p);
-
-		if (mod->deps.count == 0)
-			goto end;
-
-		if (!mod_get_all_sorted_dependencies(mod, &deps)) {
-			ERR("could not get all sorted dependencies of %s\n", p);
-			goto end;
-		}
+		fprintf(out, "%s:", mod_get_compressed_path(mod));
 
-		for (j = 0; j < deps.count; j++) {
-			const struct mod *d = deps.array[j];
+		while ((d = mod_next_dependency(depmod, mod, &pos)) != NULL)
 			fprintf(out, " %s", mod_get_compressed_path(d));
-		}
-end:
+
 		putc('\n', out);
 	}
 
-	array_free_array(&deps);
 	return 0;
 }
 
 static int output_deps_bin(struct depmod *depmod, FILE *out)
 {
 	DECLARE_STRBUF_WITH_STACK(sbuf, 2048);
-	struct index_node *idx;
+	struct index *idx;
 	size_t i;
-	struct array array;
+	int ret;
 
 	if (out == stdout)
 		return 0;
@@ -2157,28 +2819,21 @@ static int output_deps_bin(struct depmod *depmod, FILE *out)
 	if (idx == NULL)
 		return -ENOMEM;
 
-	array_init(&array, 64);
-
 	for (i = 0; i < depmod->modules.count; i++) {
 		const struct mod *mod = depmod->modules.array[i];
 		const char *p = mod_get_compressed_path(mod);
+		const struct mod *d;
 		const char *line;
-		size_t j;
+		size_t pos = 0;
 		int duplicate;
 
-		if (!mod_get_all_sorted_dependencies(mod, &array)) {
-			ERR("could not get all sorted dependencies of %s\n", p);
-			continue;
-		}
-
 		strbuf_clear(&sbuf);
 		if (!strbuf_pushchars(&sbuf, p) || !strbuf_pushchar(&sbuf, ':')) {
 			ERR("could not write dependencies of %s\n", p);
 			continue;
 		}
 
-		for (j = 0; j < array.count; j++) {
-			const struct mod *d = array.array[j];
+		while ((d = mod_next_dependency(depmod, mod, &pos)) != NULL) {
 			const char *dp = mod_get_compressed_path(d);
 
 			if (!strbuf_pushchar(&sbuf, ' ') || !strbuf_pushchars(&sbuf, dp)) {
@@ -2193,11 +2848,11 @@ static int output_deps_bin(struct depmod *depmod, FILE *out)
 			WRN("duplicate module deps:\n%s\n", line);
 	}
 
-	array_free_array(&array);
-	index_write(idx, out);
+	ret = index_write(idx, out, depmod->cfg->compress_indexes,
+			  &depmod->blobs[KMOD_INDEX_MODULES_DEP]);
 	index_destroy(idx);
 
-	return 0;
+	return ret;
 }
 
 static int output_aliases(struct depmod *depmod, FILE *out)
@@ -2221,8 +2876,9 @@ static int output_aliases(struct depmod *depmod, FILE *out)
 
 static int output_aliases_bin(struct depmod *depmod, FILE *out)
 {
-	struct index_node *idx;
+	struct index *idx;
 	size_t i;
+	int ret;
 
 	if (out == stdout)
 		return 0;
@@ -2254,10 +2910,11 @@ static int output_aliases_bin(struct depmod *depmod, FILE *out)
 		}
 	}
 
-	index_write(idx, out);
+	ret = index_write(idx, out, depmod->cfg->compress_indexes,
+			  &depmod->blobs[KMOD_INDEX_MODULES_ALIAS]);
 	index_destroy(idx);
 
-	return 0;
+	return ret;
 }
 
 static int output_softdeps(struct depmod *depmod, FILE *out)
@@ -2321,7 +2978,7 @@ static int output_symbols(struct depmod *depmod, FILE *out)
 static int output_symbols_bin(struct depmod *depmod, FILE *out)
 {
 	DECLARE_STRBUF_WITH_STACK(salias, 1024);
-	struct index_node *idx;
+	struct index *idx;
 	const char *base = "symbol:";
 	const size_t baselen = strlen(base);
 	struct hash_iter iter;
@@ -2361,7 +3018,8 @@ static int output_symbols_bin(struct depmod *depmod, FILE *out)
 			    sym->owner->modname);
 	}
 
-	index_write(idx, out);
+	ret = index_write(idx, out, depmod->cfg->compress_indexes,
+			  &depmod->blobs[KMOD_INDEX_MODULES_SYMBOL]);
 
 err_alloc:
 	index_destroy(idx);
@@ -2375,8 +3033,9 @@ err_alloc:
 static int output_builtin_bin(struct depmod *depmod, FILE *out)
 {
 	FILE *in;
-	struct index_node *idx;
+	struct index *idx;
 	char line[PATH_MAX], modname[PATH_MAX];
+	int ret;
 
 	if (out == stdout)
 		return 0;
@@ -2401,107 +3060,221 @@ static int output_builtin_bin(struct depmod *depmod, FILE *out)
 		index_insert(idx, modname, "", 0);
 	}
 
-	index_write(idx, out);
+	ret = index_write(idx, out, depmod->cfg->compress_indexes,
+			  &depmod->blobs[KMOD_INDEX_MODULES_BUILTIN]);
 	index_destroy(idx);
 	fclose(in);
 
-	return 0;
-}
-
-static int flush_stream(FILE *in, int endchar)
-{
-	size_t i = 0;
-	int c;
-
-	for (c = fgetc(in); c != EOF && c != endchar && c != '\0'; c = fgetc(in))
-		;
-
-	return c == endchar ? i : 0;
-}
-
-static int flush_stream_to(FILE *in, int endchar, char *dst, size_t dst_sz)
-{
-	size_t i = 0;
-	int c;
-
-	for (c = fgetc(in); c != EOF && c != endchar && c != '\0' && i < dst_sz;
-	     c = fgetc(in))
-		dst[i++] = c;
-
-	if (i == dst_sz) {
-		WRN("Could not flush stream: %d. Partial content: %.*s\n", ENOSPC,
-		    (int)dst_sz, dst);
-		i--;
-	}
-
-	return c == endchar ? i : 0;
+	return ret;
 }
 
 static int output_builtin_alias_bin(struct depmod *depmod, FILE *out)
 {
-	FILE *in;
-	struct index_node *idx;
-	int ret;
+	const char *map = NULL, *p, *eol, *end;
+	struct index *idx;
+	size_t size = 0;
+	int fd, ret;
 
 	if (out == stdout)
 		return 0;
 
-	in = dfdopen(depmod->cfg->dirname, "modules.builtin.modinfo", O_RDONLY, "r");
-	if (in == NULL)
+	fd = dfdopen_fd(depmod->cfg->dirname, "modules.builtin.modinfo", O_RDONLY);
+	if (fd < 0)
 		return 0;
 
+	ret = file_map(fd, &map, &size);
+	close(fd);
+	if (ret < 0) {
+		WRN("could not map modules.builtin.modinfo: %s\n", strerror(-ret));
+		return 0;
+	}
+
 	idx = index_create();
 	if (idx == NULL) {
-		fclose(in);
+		file_unmap(map, size);
 		return -ENOMEM;
 	}
 
-	/* format: modname.key=value\0 */
-	while (!feof(in) && !ferror(in)) {
+	/*
+	 * format: modname.key=value\0
+	 *
+	 * Only the alias records matter, the others are skipped as a whole. The
+	 * value is already terminated in place, so unless it needs normalizing
+	 * it's handed to the index as is.
+	 *
+	 * Unlike the character-by-character parser this replaced, a record
+	 * without '=' doesn't swallow the one after it, and values of PATH_MAX
+	 * or more aren't truncated unless they need normalizing.
+	 */
+	end = map + size;
+	for (p = map; p < end; p = eol + 1) {
+		const char *dot, *eq, *value;
 		char alias[PATH_MAX];
 		char modname[PATH_MAX];
-		char value[PATH_MAX];
 		size_t len;
 
-		len = flush_stream_to(in, '.', modname, sizeof(modname));
-		modname[len] = '\0';
-		if (!len)
-			continue;
+		eol = memchr(p, '\0', end - p);
+		if (eol == NULL)
+			break;
 
-		len = flush_stream_to(in, '=', value, sizeof(value));
-		value[len] = '\0';
-		if (!streq(value, "alias")) {
-			flush_stream(in, '\0');
+		dot = memchr(p, '.', eol - p);
+		if (dot == NULL || dot == p)
 			continue;
-		}
 
-		len = flush_stream_to(in, '\0', value, sizeof(value));
-		value[len] = '\0';
-		if (!len)
+		eq = memchr(dot + 1, '=', eol - dot - 1);
+		if (eq == NULL || eq - dot - 1 != strlen("alias") ||
+		    memcmp(dot + 1, "alias", strlen("alias")) != 0 || eq + 1 == eol)
 			continue;
 
-		alias[0] = '\0';
-		if (alias_normalize(value, alias, NULL) < 0) {
-			WRN("Unmatched bracket in %s\n", value);
+		len = dot - p;
+		if (len >= sizeof(modname)) {
+			WRN("Module name too long in modules.builtin.modinfo: %.*s\n",
+			    (int)len, p);
 			continue;
 		}
+		memcpy(modname, p, len);
+		modname[len] = '\0';
 
-		index_insert(idx, alias, modname, 0);
-	}
+		value = eq + 1;
+		if (strpbrk(value, "-[]") != NULL) {
+			if (alias_normalize(value, alias, NULL) < 0) {
+				WRN("Unmatched bracket in %s\n", value);
+				continue;
+			}
+			value = alias;
+		}
 
-	if (ferror(in)) {
-		ret = -EINVAL;
-	} else {
-		index_write(idx, out);
-		ret = 0;
+		index_insert(idx, value, modname, 0);
 	}
 
+	ret = index_write(idx, out, depmod->cfg->compress_indexes,
+			  &depmod->blobs[KMOD_INDEX_MODULES_BUILTIN_ALIAS]);
+
 	index_destroy(idx);
-	fclose(in);
+	file_unmap(map, size);
 
 	return ret;
 }
 
+/*
+ * modules.manifest: a line with each directory name excluded by the
+ * configuration, then for each directory below dirname, a line with the
+ * modification time it had when it was searched, the number of modules in it
+ * and its path, followed by a line with the name of each of those modules. The
+ * last line tells it's complete:
+ *
+ *	exclude <name>
+ *	...
+ *	<sec>.<nsec> <count> <relpath>
+ *	<name>
+ *	...
+ *	end
+ */
+static int output_manifest(struct depmod *depmod, FILE *out)
+{
+	const struct cfg_exclude *exc;
+	size_t i, j;
+
+	if (out == stdout)
+		return 0;
+
+	/* incomplete or not representable: leave it empty, so it isn't used */
+	if (depmod->manifest_failed)
+		return 0;
+	for (exc = depmod->cfg->excludes; exc != NULL; exc = exc->next) {
+		if (strchr(exc->exclude_dir, '\n') != NULL)
+			return 0;
+	}
+	for (i = 0; i < depmod->manifest.count; i++) {
+		const struct manifest_dir *dir = depmod->manifest.array[i];
+
+		if (strchr(dir->relpath, '\n') != NULL)
+			return 0;
+		for (j = 0; j < dir->files.count; j++) {
+			if (strchr(dir->files.array[j], '\n') != NULL)
+				return 0;
+		}
+	}
+
+	for (exc = depmod->cfg->excludes; exc != NULL; exc = exc->next)
+		fprintf(out, "exclude %s\n", exc->exclude_dir);
+
+	for (i = 0; i < depmod->manifest.count; i++) {
+		const struct manifest_dir *dir = depmod->manifest.array[i];
+
+		fprintf(out, "%lld.%09ld %zu %s\n", (long long)dir->mtime.tv_sec,
+			dir->mtime.tv_nsec, dir->files.count, dir->relpath);
+		for (j = 0; j < dir->files.count; j++)
+			fprintf(out, "%s\n", (const char *)dir->files.array[j]);
+	}
+
+	fputs("end\n", out);
+
+	return 0;
+}
+
+/*
+ * modules.bin: all the .bin indexes in a single file, so readers can open,
+ * map and validate them at once. See documentation in libkmod/libkmod-index.c
+ */
+static int output_container_bin(struct depmod *depmod, FILE *out)
+{
+	static const char pad[INDEX_PAGE_SIZE];
+	char hdr[4 * sizeof(uint32_t) * (_INDEX_CONTAINER_SECTIONS + 1)];
+	char *table = hdr + 4 * sizeof(uint32_t);
+	uint32_t offsets[_INDEX_CONTAINER_SECTIONS];
+	uint32_t n_sections = 0, pos, offset;
+	char *p = table;
+	size_t i;
+
+	if (out == stdout)
+		return 0;
+
+	/* sections start at a page boundary, as the layout of each index expects */
+	offset = INDEX_PAGE_SIZE;
+	for (i = 0; i < ARRAY_SIZE(depmod->blobs); i++) {
+		const struct index_blob *blob = &depmod->blobs[i];
+
+		if (blob->buf == NULL)
+			continue;
+
+		offsets[i] = offset;
+		p = index_put_u32(p, i);
+		p = index_put_u32(p, offset);
+		p = index_put_u32(p, blob->size);
+		p = index_put_u32(p, crc32_update(0, blob->buf, blob->size));
+		n_sections++;
+
+		if (uadd32_overflow(offset, blob->size, &offset) ||
+		    uadd32_overflow(offset, INDEX_PAGE_SIZE - 1, &offset))
+			return -EFBIG;
+		offset &= ~(INDEX_PAGE_SIZE - 1);
+	}
+
+	index_put_u32(hdr, INDEX_CONTAINER_MAGIC);
+	index_put_u32(hdr + 4, INDEX_CONTAINER_VERSION);
+	index_put_u32(hdr + 8, n_sections);
+	index_put_u32(hdr + 12, crc32_update(0, table, p - table));
+	fwrite(hdr, 1, p - hdr, out);
+
+	pos = p - hdr;
+	for (i = 0; i < ARRAY_SIZE(depmod->blobs); i++) {
+		struct index_blob *blob = &depmod->blobs[i];
+
+		if (blob->buf == NULL)
+			continue;
+
+		fwrite(pad, 1, offsets[i] - pos, out);
+		fwrite(blob->buf, 1, blob->size, out);
+		pos = offsets[i] + blob->size;
+
+		free(blob->buf);
+		blob->buf = NULL;
+	}
+
+	return 0;
+}
+
 static int output_devname(struct depmod *depmod, FILE *out)
 {
 	size_t i;
@@ -2554,12 +3327,244 @@ static int output_devname(struct depmod *depmod, FILE *out)
 	return 0;
 }
 
+struct depfile {
+	const char *name;
+	int (*cb)(struct depmod *depmod, FILE *out);
+};
+
+/*
+ * The output callbacks only read the state built by depmod_load(), so each
+ * file is generated by whichever thread picks it up next, into its own
+ * temporary file. Publishing is left to the main thread, in order.
+ */
+struct depfile_job {
+	const struct depfile *depfile;
+	struct tmpfile file;
+	FILE *fp;
+	int r;
+	int ferr;
+};
+
+struct depfile_jobs {
+	struct depmod *depmod;
+	struct depfile_job *jobs;
+	size_t n_jobs;
+	size_t next;
+};
+
+static void *depmod_output_worker(void *data)
+{
+	struct depfile_jobs *jobs = data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->n_jobs) {
+		struct depfile_job *job = &jobs->jobs[i];
+
+		if (job->fp == NULL)
+			continue;
+
+		job->r = job->depfile->cb(jobs->depmod, job->fp);
+		if (jobs->depmod->cfg->fsync && job->r >= 0 &&
+		    (fflush(job->fp) != 0 || fsync(fileno(job->fp)) < 0))
+			job->r = -errno;
+		job->ferr = ferror(job->fp) | fclose(job->fp);
+		job->fp = NULL;
+	}
+
+	return NULL;
+}
+
+static void depmod_output_run(struct depfile_jobs *jobs)
+{
+	pthread_t threads[16];
+	size_t i, n_threads;
+	long n_cpus;
+
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = n_cpus > 1 ? (size_t)n_cpus : 1;
+	n_threads = MIN(n_threads, MIN(jobs->n_jobs, ARRAY_SIZE(threads) + 1));
+
+	/* the calling thread is one of the workers */
+	for (i = 0; i + 1 < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, depmod_output_worker, jobs) != 0)
+			break;
+	}
+	n_threads = i;
+
+	depmod_output_worker(jobs);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * With --atomic the files are written to a new generation directory and
+ * published by replacing the KMOD_INDEX_CURRENT symlink. The usual names are
+ * symlinks through it, so readers resolving them by path see either the old or
+ * the new set, never a mix of both.
+ */
+static int depmod_generation_create(int dfd, const char *dname, char *gen, size_t gensize)
+{
+	char path[PATH_MAX];
+	const char *name;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/" KMOD_INDEX_GENERATION "XXXXXX", dname) >=
+	    (int)sizeof(path))
+		return -ENAMETOOLONG;
+
+	if (mkdtemp(path) == NULL) {
+		int err = -errno;
+		CRIT("could not create directory %s: %m\n", path);
+		return err;
+	}
+	/* mkdtemp() always creates it with 0700 */
+	name = strrchr(path, '/') + 1;
+	if (fchmodat(dfd, name, 0755, 0) < 0 ||
+	    (fd = openat(dfd, name, O_RDONLY | O_DIRECTORY)) < 0) {
+		int err = -errno;
+		CRIT("could not open directory %s: %m\n", path);
+		unlinkat(dfd, name, AT_REMOVEDIR);
+		return err;
+	}
+
+	strncpy(gen, name, gensize - 1);
+	gen[gensize - 1] = '\0';
+
+	return fd;
+}
+
+static void depmod_generation_remove(int dfd, const char *gen)
+{
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	fd = openat(dfd, gen, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0)
+		return;
+
+	d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (unlinkat(fd, de->d_name, 0) < 0)
+			ERR("could not remove %s/%s: %m\n", gen, de->d_name);
+	}
+	closedir(d);
+
+	if (unlinkat(dfd, gen, AT_REMOVEDIR) < 0)
+		ERR("could not remove %s: %m\n", gen);
+}
+
+/* fill @gen with the generation currently published, if any */
+static bool depmod_generation_current(int dfd, char *gen, size_t gensize)
+{
+	ssize_t len;
+
+	len = readlinkat(dfd, KMOD_INDEX_CURRENT, gen, gensize);
+	if (len < 0 || (size_t)len >= gensize)
+		return false;
+	gen[len] = '\0';
+
+	return strstartswith(gen, KMOD_INDEX_GENERATION) && strchr(gen, '/') == NULL;
+}
+
+/* atomically make @name a symlink to @target */
+static int depmod_symlink_replace(int dfd, const char *target, const char *name)
+{
+	char tmp[NAME_MAX + 1];
+	int err;
+
+	snprintf(tmp, sizeof(tmp), ".%s.%d", KMOD_INDEX_CURRENT, getpid());
+	unlinkat(dfd, tmp, 0);
+
+	if (symlinkat(target, dfd, tmp) < 0)
+		return -errno;
+
+	if (renameat(dfd, tmp, dfd, name) < 0) {
+		err = -errno;
+		unlinkat(dfd, tmp, 0);
+		return err;
+	}
+
+	return 0;
+}
+
+static int depmod_generation_publish(int dfd, const char *dname, const char *gen,
+				     const struct depfile *depfiles)
+{
+	const struct depfile *itr;
+	char old[NAME_MAX + 1];
+	bool has_old;
+	int err;
+
+	has_old = depmod_generation_current(dfd, old, sizeof(old));
+
+	err = depmod_symlink_replace(dfd, gen, KMOD_INDEX_CURRENT);
+	if (err < 0) {
+		CRIT("could not publish %s/%s: %s\n", dname, gen, strerror(-err));
+		depmod_generation_remove(dfd, gen);
+		return err;
+	}
+
+	/* only does something the first time --atomic is used */
+	for (itr = depfiles; itr->name != NULL; itr++) {
+		char target[PATH_MAX], link[PATH_MAX];
+		ssize_t len;
+
+		snprintf(target, sizeof(target), KMOD_INDEX_CURRENT "/%s", itr->name);
+
+		len = readlinkat(dfd, itr->name, link, sizeof(link) - 1);
+		if (len >= 0) {
+			link[len] = '\0';
+			if (streq(link, target))
+				continue;
+		}
+
+		err = depmod_symlink_replace(dfd, target, itr->name);
+		if (err < 0) {
+			CRIT("could not link %s/%s: %s\n", dname, itr->name, strerror(-err));
+			return err;
+		}
+	}
+
+	if (fsync(dfd) < 0) {
+		err = -errno;
+		ERR("could not sync directory %s: %m\n", dname);
+		return err;
+	}
+
+	if (has_old && !streq(old, gen))
+		depmod_generation_remove(dfd, old);
+
+	return 0;
+}
+
+/* the files were published in place, stop pointing readers to the old generation */
+static void depmod_generation_drop(int dfd)
+{
+	char old[NAME_MAX + 1];
+
+	if (!depmod_generation_current(dfd, old, sizeof(old)))
+		return;
+
+	if (unlinkat(dfd, KMOD_INDEX_CURRENT, 0) < 0) {
+		ERR("could not remove %s: %m\n", KMOD_INDEX_CURRENT);
+		return;
+	}
+
+	depmod_generation_remove(dfd, old);
+}
+
 static int depmod_output(struct depmod *depmod, FILE *out)
 {
-	static const struct depfile {
-		const char *name;
-		int (*cb)(struct depmod *depmod, FILE *out);
-	} *itr, depfiles[] = {
+	static const struct depfile *itr, depfiles[] = {
 		{ "modules.dep", output_deps },
 		{ "modules.dep.bin", output_deps_bin },
 		{ "modules.alias", output_aliases },
@@ -2571,72 +3576,127 @@ static int depmod_output(struct depmod *depmod, FILE *out)
 		{ "modules.builtin.bin", output_builtin_bin },
 		{ "modules.builtin.alias.bin", output_builtin_alias_bin },
 		{ "modules.devname", output_devname },
+		{ "modules.manifest", output_manifest },
+		/* built from the other indexes, so it must be the last one */
+		{ "modules.bin", output_container_bin },
 		{},
 	};
+	/* not ARRAY_SIZE(): it is not a constant expression */
+	struct depfile_job jobs[sizeof(depfiles) / sizeof(depfiles[0]) - 1] = {};
+	/* two phases: modules.bin can only be built once the other indexes are */
+	struct depfile_jobs indexes = {
+		.depmod = depmod,
+		.jobs = jobs,
+		.n_jobs = ARRAY_SIZE(jobs) - 1,
+	};
+	struct depfile_jobs container = {
+		.depmod = depmod,
+		.jobs = jobs + ARRAY_SIZE(jobs) - 1,
+		.n_jobs = 1,
+	};
 	const char *dname = depmod->cfg->outdirname;
-	int dfd, err = 0;
+	char gen[NAME_MAX + 1];
+	int dfd, odfd, err = 0;
+	size_t i;
 
-	if (out != NULL)
-		dfd = -1;
-	else {
-		err = mkdir_p(dname, strlen(dname), 0755);
-		if (err < 0) {
-			CRIT("could not create directory %s: %s\n", dname, strerror(-err));
-			return err;
-		}
-		dfd = open(dname, O_RDONLY);
-		if (dfd < 0) {
-			err = -errno;
-			CRIT("could not open directory %s: %m\n", dname);
-			return err;
+	if (out != NULL) {
+		for (itr = depfiles; itr->name != NULL; itr++)
+			itr->cb(depmod, out);
+		return 0;
+	}
+
+	err = mkdir_p(dname, strlen(dname), 0755);
+	if (err < 0) {
+		CRIT("could not create directory %s: %s\n", dname, strerror(-err));
+		return err;
+	}
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		CRIT("could not open directory %s: %m\n", dname);
+		return err;
+	}
+
+	odfd = dfd;
+	if (depmod->cfg->atomic) {
+		odfd = depmod_generation_create(dfd, dname, gen, sizeof(gen));
+		if (odfd < 0) {
+			close(dfd);
+			return odfd;
 		}
 	}
 
-	for (itr = depfiles; itr->name != NULL; itr++) {
-		FILE *fp = out;
-		struct tmpfile file;
-		int r, ferr;
+	for (i = 0; i < ARRAY_SIZE(jobs); i++) {
+		struct depfile_job *job = &jobs[i];
+		mode_t mode = 0644;
+
+		job->depfile = &depfiles[i];
+		job->fp = tmpfile_openat(odfd, mode, &job->file);
+		if (job->fp == NULL)
+			ERR("Could not create temporary file at '%s'\n", dname);
+	}
 
-		if (fp == NULL) {
-			mode_t mode = 0644;
+	depmod_output_run(&indexes);
+	depmod_output_run(&container);
 
-			fp = tmpfile_openat(dfd, mode, &file);
-			if (fp == NULL) {
-				ERR("Could not create temporary file at '%s'\n", dname);
-				continue;
-			}
-		}
+	for (i = 0; i < ARRAY_SIZE(jobs); i++) {
+		struct depfile_job *job = &jobs[i];
+		const char *name = job->depfile->name;
 
-		r = itr->cb(depmod, fp);
-		if (fp == out)
+		/* the temporary file couldn't be created */
+		if (job->file.tmpname[0] == '\0') {
+			/* don't publish a generation with a dangling symlink into it */
+			if (depmod->cfg->atomic && err == 0)
+				err = -EIO;
 			continue;
+		}
 
-		ferr = ferror(fp) | fclose(fp);
+		/* stop publishing at the first error, as if later files weren't written */
+		if (err < 0) {
+			tmpfile_release(&job->file);
+			continue;
+		}
 
-		if (r < 0) {
-			tmpfile_release(&file);
+		if (job->r < 0) {
+			tmpfile_release(&job->file);
 
-			ERR("Could not write index '%s': %s\n", itr->name, strerror(-r));
-			err = r;
-			break;
+			ERR("Could not write index '%s': %s\n", name, strerror(-job->r));
+			err = job->r;
+			continue;
 		}
 
-		err = tmpfile_publish(&file, itr->name);
+		err = tmpfile_publish(&job->file, name);
 		if (err != 0) {
-			CRIT("publish temporary from %s to %s\n", file.tmpname, itr->name);
-			break;
+			CRIT("publish temporary from %s to %s\n", job->file.tmpname, name);
+			tmpfile_release(&job->file);
+			continue;
 		}
 
-		if (ferr) {
+		if (job->ferr) {
 			err = -ENOSPC;
-			ERR("Could not create index '%s'. Output is truncated: %s\n",
-			    itr->name, strerror(-err));
-			break;
+			ERR("Could not create index '%s'. Output is truncated: %s\n", name,
+			    strerror(-err));
 		}
 	}
 
-	if (dfd >= 0)
-		close(dfd);
+	/* make the renames durable too */
+	if (err == 0 && depmod->cfg->fsync && fsync(odfd) < 0) {
+		err = -errno;
+		ERR("could not sync directory %s: %m\n", dname);
+	}
+
+	if (depmod->cfg->atomic) {
+		close(odfd);
+		/* nothing was published: readers keep using the previous generation */
+		if (err < 0)
+			depmod_generation_remove(dfd, gen);
+		else
+			err = depmod_generation_publish(dfd, dname, gen, depfiles);
+	} else if (err == 0) {
+		depmod_generation_drop(dfd);
+	}
+
+	close(dfd);
 
 	return err;
 }
@@ -2652,52 +3712,138 @@ static void depmod_add_fake_syms(struct depmod *depmod)
 		depmod_symbol_add(depmod, "TOC.", true, 0, NULL);
 }
 
+/*
+ * Module.symvers and System.map are read from a mapping, with the fields
+ * handed around as pointer and length into it rather than copied out.
+ */
+static int file_map_path(const char *filename, const char **map, size_t *size)
+{
+	int fd, err;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	err = file_map(fd, map, size);
+	close(fd);
+
+	return err;
+}
+
+/* like strtok(..., " \t"), but without modifying the string */
+static const char *next_field(const char *p, const char *end, size_t *len)
+{
+	const char *q;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p == end)
+		return NULL;
+
+	for (q = p; q < end && *q != ' ' && *q != '\t'; q++)
+		;
+	*len = q - p;
+
+	return p;
+}
+
+/* like strtoull(..., 16), but the whole field has to be a number */
+static bool parse_crc(const char *s, size_t len, uint64_t *crc)
+{
+	uint64_t v = 0;
+	size_t i = 0;
+
+	if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+		i = 2;
+	if (i == len)
+		return false;
+
+	for (; i < len; i++) {
+		char c = s[i];
+		unsigned int d;
+
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			d = c - 'A' + 10;
+		else
+			return false;
+
+		if (v >> 60)
+			return false;
+		v = v << 4 | d;
+	}
+
+	*crc = v;
+	return true;
+}
+
 static int depmod_load_symvers(struct depmod *depmod, const char *filename)
 {
-	char line[10240];
-	FILE *fp;
+	const char *map, *p, *eol, *end;
 	unsigned int linenum = 0;
+	size_t size;
+	int err;
 
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		int err = -errno;
-		DBG("load symvers: %s: %m\n", filename);
+	err = file_map_path(filename, &map, &size);
+	if (err < 0) {
+		DBG("load symvers: %s: %s\n", filename, strerror(-err));
 		return err;
 	}
 	DBG("load symvers: %s\n", filename);
 
-	/* eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL" */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		const char *ver, *sym, *where;
-		char *verend;
+	/*
+	 * eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL"
+	 *
+	 * The '\n' is kept in the line, and so in its last field: with only 3
+	 * fields, "vmlinux" doesn't match.
+	 */
+	end = map + size;
+	for (p = map; p < end; p = eol + 1) {
+		const char *ver, *sym, *where, *lim;
+		size_t verlen, symlen, wherelen;
 		uint64_t crc;
 
 		linenum++;
 
-		ver = strtok(line, " \t");
-		sym = strtok(NULL, " \t");
-		where = strtok(NULL, " \t");
-		if (!ver || !sym || !where)
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		lim = eol < end ? eol + 1 : end;
+
+		ver = next_field(p, lim, &verlen);
+		if (ver == NULL)
+			continue;
+		sym = next_field(ver + verlen, lim, &symlen);
+		if (sym == NULL)
+			continue;
+		where = next_field(sym + symlen, lim, &wherelen);
+		if (where == NULL)
 			continue;
 
-		if (!streq(where, "vmlinux"))
+		if (wherelen != strlen("vmlinux") || memcmp(where, "vmlinux", wherelen) != 0)
 			continue;
 
-		errno = 0;
-		crc = strtoull(ver, &verend, 16);
-		if (verend[0] != '\0' || errno == ERANGE) {
-			ERR("%s:%u Invalid symbol version %s: %m\n", filename, linenum,
-			    ver);
+		if (!parse_crc(ver, verlen, &crc)) {
+			ERR("%s:%u Invalid symbol version %.*s\n", filename, linenum,
+			    (int)verlen, ver);
 			continue;
 		}
 
-		depmod_symbol_add(depmod, sym, false, crc, NULL);
+		if (sym[0] == depmod->cfg->sym_prefix) {
+			sym++;
+			symlen--;
+		}
+
+		depmod_symbol_add_n(depmod, sym, symlen, crc, NULL);
 	}
 	depmod_add_fake_syms(depmod);
 
 	DBG("loaded symvers: %s\n", filename);
 
-	fclose(fp);
+	file_unmap(map, size);
 	return 0;
 }
 
@@ -2705,56 +3851,55 @@ static int depmod_load_system_map(struct depmod *depmod, const char *filename)
 {
 	const char ksymstr[] = "__ksymtab_";
 	const size_t ksymstr_len = sizeof(ksymstr) - 1;
-	char line[10240];
-	FILE *fp;
+	const char *map, *p, *eol, *end;
 	unsigned int linenum = 0;
+	size_t size;
+	int err;
 
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		int err = -errno;
-		DBG("load System.map: %s: %m\n", filename);
+	err = file_map_path(filename, &map, &size);
+	if (err < 0) {
+		DBG("load System.map: %s: %s\n", filename, strerror(-err));
 		return err;
 	}
 	DBG("load System.map: %s\n", filename);
 
 	/* eg. c0294200 R __ksymtab_devfs_alloc_devnum */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		char *p, *end;
+	end = map + size;
+	for (p = map; p < end; p = eol + 1) {
+		const char *sym;
 
 		linenum++;
 
-		p = strchr(line, ' ');
-		if (p == NULL)
-			goto invalid_syntax;
-		p++;
-		p = strchr(p, ' ');
-		if (p == NULL)
-			goto invalid_syntax;
-		p++;
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+
+		sym = memchr(p, ' ', eol - p);
+		if (sym != NULL)
+			sym = memchr(sym + 1, ' ', eol - sym - 1);
+		if (sym == NULL) {
+			ERR("%s:%u: invalid line: %.*s\n", filename, linenum, (int)(eol - p),
+			    p);
+			continue;
+		}
+		sym++;
 
 		/* skip prefix */
-		if (p[0] == depmod->cfg->sym_prefix)
-			p++;
+		if (sym < eol && sym[0] == depmod->cfg->sym_prefix)
+			sym++;
 
 		/* Covers gpl-only and normal symbols. */
-		if (!strstartswith(p, ksymstr))
+		if ((size_t)(eol - sym) < ksymstr_len || memcmp(sym, ksymstr, ksymstr_len) != 0)
 			continue;
+		sym += ksymstr_len;
 
-		end = strchr(p, '\n');
-		if (end != NULL)
-			*end = '\0';
-
-		depmod_symbol_add(depmod, p + ksymstr_len, true, 0, NULL);
-		continue;
-
-invalid_syntax:
-		ERR("%s:%u: invalid line: %s\n", filename, linenum, line);
+		depmod_symbol_add_n(depmod, sym, eol - sym, 0, NULL);
 	}
 	depmod_add_fake_syms(depmod);
 
 	DBG("loaded System.map: %s\n", filename);
 
-	fclose(fp);
+	file_unmap(map, size);
 	return 0;
 }
 
@@ -2772,7 +3917,9 @@ static int depfile_up_to_date_dir(DIR *d, const struct timespec *ts, size_t base
 		if (name[0] == '.' &&
 		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
 			continue;
-		if (streq(name, "build") || streq(name, "source"))
+		if (streq(name, "build") || streq(name, "source") ||
+		    streq(name, KMOD_INDEX_CURRENT) ||
+		    strstartswith(name, KMOD_INDEX_GENERATION))
 			continue;
 		namelen = strlen(name);
 		if (baselen + namelen + 2 >= PATH_MAX) {
@@ -2838,6 +3985,257 @@ static int depfile_up_to_date_dir(DIR *d, const struct timespec *ts, size_t base
 	return err;
 }
 
+struct manifest_file {
+	const char *dir;
+	const char *name;
+};
+
+struct manifest_stat {
+	int dfd;
+	const struct timespec *ts;
+	const struct manifest_file *files;
+	size_t n_files;
+	size_t next;
+	int result; /* 1 while all are up-to-date */
+};
+
+static void *depfile_manifest_stat_worker(void *data)
+{
+	struct manifest_stat *ms = data;
+	size_t i, end;
+
+	while (__atomic_load_n(&ms->result, __ATOMIC_RELAXED) == 1) {
+		i = __atomic_fetch_add(&ms->next, 64, __ATOMIC_RELAXED);
+		if (i >= ms->n_files)
+			break;
+
+		for (end = MIN(i + 64, ms->n_files); i < end; i++) {
+			const struct manifest_file *f = &ms->files[i];
+			char path[PATH_MAX];
+			struct stat st;
+			int r = 1;
+
+			snprintf(path, sizeof(path), "%s/%s", f->dir, f->name);
+			if (fstatat(ms->dfd, path, &st, 0) < 0) {
+				DBG("fstatat(%s): %m\n", path);
+				r = -ESTALE;
+			} else if (ts_usec(&st.st_mtim) > ts_usec(ms->ts)) {
+				DBG("%s is newer than modules.dep\n", path);
+				r = 0;
+			}
+
+			if (r != 1) {
+				__atomic_store_n(&ms->result, r, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The stats are mostly waiting on the filesystem, more so on network ones or
+ * with a cold cache, so they are spread over threads according to the amount
+ * of work rather than to the number of CPUs.
+ */
+static int depfile_manifest_stat(struct manifest_stat *ms)
+{
+	pthread_t threads[15];
+	size_t i, n_threads;
+
+	n_threads = MIN(ms->n_files / 512, ARRAY_SIZE(threads));
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, depfile_manifest_stat_worker, ms) != 0)
+			break;
+	}
+	n_threads = i;
+
+	depfile_manifest_stat_worker(ms);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return ms->result;
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Quick check using modules.manifest: if none of the directories changed since
+ * they were searched, no module was added, removed or renamed in them and only
+ * the modules listed need to be checked, without reading the directories. The
+ * top directory, where the output goes, is always read. Unlike
+ * depfile_up_to_date_dir(), a directory that changed, or a new one, is enough
+ * to tell it's outdated.
+ *
+ * up-to-date: 1, outdated: 0, can't tell: < 0
+ */
+static int depfile_up_to_date_manifest(DIR *d, const struct timespec *ts)
+{
+	_cleanup_free_ char *buf = NULL;
+	_cleanup_free_ struct manifest_file *files = NULL;
+	struct manifest_stat ms = {
+		.dfd = dirfd(d),
+		.ts = ts,
+		.result = 1,
+	};
+	struct hash *dirs = NULL;
+	struct dirent *de;
+	struct stat st;
+	char *line, *next;
+	int fd, err = 1, dfd = dirfd(d);
+	bool complete = false;
+	ssize_t len;
+
+	fd = openat(dfd, "modules.manifest", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -ENODATA;
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (buf == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	len = read_str_safe(fd, buf, st.st_size + 1);
+	close(fd);
+	if (len != st.st_size)
+		return len < 0 ? len : -EIO;
+
+	/* there are less modules than lines */
+	for (line = buf, len = 0; (line = strchr(line, '\n')) != NULL; line++)
+		len++;
+	files = malloc(len * sizeof(*files));
+	if (files == NULL)
+		return -ENOMEM;
+
+	dirs = hash_new(512, NULL);
+	if (dirs == NULL)
+		return -ENOMEM;
+
+	for (line = buf; *line != '\0'; line = next) {
+		struct timespec mtime;
+		unsigned long count;
+		char *end, *relpath;
+
+		next = strchr(line, '\n');
+		if (next == NULL)
+			goto invalid;
+		*next++ = '\0';
+
+		if (streq(line, "end")) {
+			complete = *next == '\0';
+			break;
+		}
+
+		/* not searched, so not in the manifest either */
+		if (strstartswith(line, "exclude ")) {
+			relpath = line + strlen("exclude ");
+			if (hash_add(dirs, relpath, relpath) < 0) {
+				err = -ENOMEM;
+				goto out;
+			}
+			continue;
+		}
+
+		errno = 0;
+		mtime.tv_sec = strtoll(line, &end, 10);
+		if (errno != 0 || *end != '.')
+			goto invalid;
+		mtime.tv_nsec = strtol(end + 1, &end, 10);
+		if (errno != 0 || *end != ' ')
+			goto invalid;
+		count = strtoul(end + 1, &end, 10);
+		if (errno != 0 || *end != ' ')
+			goto invalid;
+		relpath = end + 1;
+
+		/* equal times don't tell if it changed after being searched */
+		if (fstatat(dfd, relpath, &st, 0) < 0 || !S_ISDIR(st.st_mode) ||
+		    st.st_mtim.tv_sec != mtime.tv_sec ||
+		    st.st_mtim.tv_nsec != mtime.tv_nsec || !ts_before(&mtime, ts)) {
+			DBG("%s changed since it was searched\n", relpath);
+			err = 0;
+			goto out;
+		}
+
+		if (strchr(relpath, '/') == NULL && hash_add(dirs, relpath, relpath) < 0) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		for (; count > 0; count--) {
+			struct manifest_file *f = &files[ms.n_files++];
+
+			line = next;
+			next = strchr(line, '\n');
+			if (next == NULL)
+				goto invalid;
+			*next++ = '\0';
+
+			f->dir = relpath;
+			f->name = line;
+		}
+	}
+
+	if (!complete)
+		goto invalid;
+
+	/* the top directory: new subdirectories or modules in it */
+	while ((de = readdir(d)) != NULL) {
+		const char *name = de->d_name;
+
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (streq(name, "build") || streq(name, "source") ||
+		    streq(name, KMOD_INDEX_CURRENT) ||
+		    strstartswith(name, KMOD_INDEX_GENERATION))
+			continue;
+
+		if (de->d_type == DT_REG && !path_ends_with_kmod_ext(name, strlen(name)))
+			continue;
+
+		if (fstatat(dfd, name, &st, 0) < 0) {
+			err = -errno;
+			goto out;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (hash_find(dirs, name) == NULL) {
+				DBG("%s is not in the manifest\n", name);
+				err = 0;
+				goto out;
+			}
+		} else if (S_ISREG(st.st_mode) &&
+			   path_ends_with_kmod_ext(name, strlen(name)) &&
+			   ts_usec(&st.st_mtim) > ts_usec(ts)) {
+			DBG("%s is newer than modules.dep\n", name);
+			err = 0;
+			goto out;
+		}
+	}
+
+	ms.files = files;
+	err = depfile_manifest_stat(&ms);
+
+out:
+	hash_free(dirs);
+	return err;
+
+invalid:
+	err = -EINVAL;
+	goto out;
+}
+
 /* up-to-date: 1, outdated: 0, errors < 0 */
 static int depfile_up_to_date(const char *dirname)
 {
@@ -2859,6 +4257,14 @@ static int depfile_up_to_date(const char *dirname)
 		return err;
 	}
 
+	err = depfile_up_to_date_manifest(d, &st.st_mtim);
+	if (err >= 0) {
+		closedir(d);
+		return err;
+	}
+	DBG("can't use modules.manifest: %s\n", strerror(-err));
+	rewinddir(d);
+
 	baselen = strlen(dirname);
 	memcpy(path, dirname, baselen);
 	path[baselen] = '/';
@@ -2968,6 +4374,16 @@ static int do_depmod(int argc, char *argv[])
 		case 'w':
 			cfg.warn_dups = 1;
 			break;
+		case 1:
+			cfg.fsync = 1;
+			break;
+		case 2:
+			cfg.atomic = 1;
+			cfg.fsync = 1;
+			break;
+		case 3:
+			cfg.compress_indexes = 1;
+			break;
 		case 'h':
 			help();
 			return EXIT_SUCCESS;
@@ -2982,6 +4398,16 @@ static int do_depmod(int argc, char *argv[])
 		}
 	}
 
+	/* resolved once, before the indexes are compressed by several threads */
+	if (cfg.compress_indexes) {
+		err = kmod_zlib_load();
+		if (err < 0) {
+			CRIT("--compress-indexes needs zlib, which is not available: %s\n",
+			     strerror(-err));
+			goto cmdline_failed;
+		}
+	}
+
 	if (optind < argc) {
 		if (!is_version_number(argv[optind])) {
 			ERR("Bad version passed %s\n", argv[optind]);